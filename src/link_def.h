@@ -0,0 +1,52 @@
+#ifndef LINK_DEF_H
+#define LINK_DEF_H
+
+#include <stdint.h>
+
+/*
+Uart link between the Pi and a master
+
+A frame is [type][seq][body][crc (2, low byte first)], COBS encoded and
+ended by a 0 byte, which appears nowhere else. A bad frame is dropped
+alone, the reader starts over at the next 0.
+crc: CCITT reflected (0x8408), initial 0xFFFF, over type, seq and body,
+the same as _crc_ccitt_update() of avr-libc.
+
+Both ends start at LINK_BAUDS[0]. With nothing in the master, the Pi asks
+for a rate with LINK_SPEED, the master answers at the old rate and
+switches, the Pi switches when it has the answer and confirms the new rate
+with another LINK_SPEED. If it is not answered the Pi falls back to
+LINK_BAUDS[0], the master does too after LINK_SPEED_TIMEOUT without a good
+frame, so the Pi keeps a faster link alive with LINK_SPEED when it is idle.
+
+A master may drive several TWPC busses (districts) at the same time, the
+byte after a packet holds its rate and the districts (bits) it goes to.
+No districts is all of them in step, broadcasts go so. Answers keep the
+order of the packets whichever district finishes first.
+*/
+
+#define LINK_PACKET 1 // Pi: twpc packet (4), TWPC rate | districts (1, left out if 0), seq counts the packets of the link
+#define LINK_REPLY 2 // master: reply (4) to the packet of seq, 0 if nobody answered
+#define LINK_LOST 3 // master: the packet of seq came in a bad frame and is not answered
+#define LINK_SENSOR 4 // master: onewire beacon: pin, train, tick (2)
+#define LINK_STATS 5 // master: good frames, bad frames, bus faults, rx bytes dropped, rx overruns (2 each)
+#define LINK_SPEED 6 // Pi: index of LINK_BAUDS (1), master: the same, switched after it
+#define LINK_SENT 7 // master: the packet of seq had TWPC_NO_REPLY and went out, nothing to read
+
+#define LINK_BODY_MAX 10
+#define LINK_FRAME_MAX ( LINK_BODY_MAX + 4 ) // decoded
+#define LINK_ENCODED_MAX ( LINK_FRAME_MAX + 2 ) // COBS code byte and the 0
+#define LINK_PACKET_FRAME 8 // decoded length of a LINK_PACKET frame, one more with a rate
+#define LINK_RATE(a) ( (a) & 0x0F ) // of the byte after the packet
+#define LINK_DISTRICTS(a) ( (a) >> 4 )
+#define LINK_DISTRICT(district) ( 0x10 << (district) )
+#define LINK_DISTRICTS_MAX 4
+
+#define LINK_CRC_INIT 0xFFFF
+#define LINK_STATS_TICKS 8192 // master ticks between LINK_STATS frames, about 4 s
+
+#define LINK_BAUDS { 57600, 500000, 1000000 } // 500k and 1M are exact with U2X at 16 MHz
+#define LINK_BAUDS_N 3
+#define LINK_SPEED_TIMEOUT 4096 // master ticks without a good frame before the master falls back, about 2 s
+
+#endif
@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <simavr/sim_avr.h>
+#include <simavr/sim_elf.h>
+#include <simavr/avr_ioport.h>
+#include <simavr/avr_uart.h>
+#include "../link_def.h"
+
+/*
+Cycle harness of the master timer interrupt (make cycles)
+
+Runs the firmware built with COM_CYCLES in simavr, it keeps every district
+busy with packets of its own, while the TWPC data lines and the onewire line
+get random levels and the uart random bytes at the highest rate of the link.
+Every TIMER1_COMPA_vect is timed from its vector to its reti and counted by
+the path it took, which the ISR leaves in GPIOR0, the uart interrupts too.
+
+The budget holds if the worst timer path fits a tick and, since the timer
+blocks the uart RX interrupt, the worst timer path and one RX interrupt fit
+the two bytes the RX FIFO takes. It exits with 1 if not. Not run yet (no
+avr-gcc and simavr where it was written), TWPC_FAST waits for it.
+*/
+
+#define CYCLES_VECTOR 0x2C // TIMER1_COMPA_vect of the atmega328p, in bytes
+#define CYCLES_RX_VECTOR 0x48 // USART_RX_vect
+#define CYCLES_UDRE_VECTOR 0x4C // USART_UDRE_vect
+#define CYCLES_GPIOR0 0x3E // in the data space
+#define CYCLES_RETI 0x9518
+#define CYCLES_ENTRY 4 // taking the interrupt, before the vector
+#define CYCLES_TICK 992 // between two interrupts, TWPC_TICK_US at 16 MHz
+#define CYCLES_BYTE ( 10 * 16000000 / CYCLES_BAUD ) // a uart byte at the highest rate
+#define CYCLES_RX_FIFO 2 // bytes
+
+typedef struct {
+	uint64_t count;
+	uint64_t sum;
+	uint32_t min;
+	uint32_t max;
+} cycles_path_t;
+
+static const uint32_t cycles_bauds[LINK_BAUDS_N] = LINK_BAUDS;
+#define CYCLES_BAUD cycles_bauds[LINK_BAUDS_N - 1] // the firmware runs at it with COM_CYCLES
+
+static const char *twpc_names[] = { "-", "line on", "line off", "send bit", "reply start", "reply wait", "recv bit", "done", "fault" };
+static const char *onewire_names[] = { "-", "drive", "float", "start", "bit", "stop" };
+
+static cycles_path_t paths[256];
+static cycles_path_t serial_paths[2]; // RX, UDRE
+
+static void cycles_count(cycles_path_t *p, uint32_t cycles) {
+	if ( p->count == 0 || cycles < p->min ) {
+		p->min = cycles;
+	}
+	if ( cycles > p->max ) {
+		p->max = cycles;
+	}
+	p->count++;
+	p->sum += cycles;
+}
+
+static void cycles_print(const char *twpc, const char *onewire, cycles_path_t *p) {
+	printf("%-12s %-8s %10llu %6u %6llu %6u\n", twpc, onewire, (unsigned long long)p->count, p->min,
+		(unsigned long long)( p->count > 0 ? p->sum / p->count : 0 ), p->max);
+}
+
+int main(int argc, char **argv) {
+	elf_firmware_t f;
+	long n = argc > 2 ? atol(argv[2]) : 20000;
+	if ( argc < 2 ) {
+		printf("Usage: %s firmware.elf [interrupts]\n", argv[0]);
+		return 1;
+	}
+	memset(&f, 0, sizeof(f));
+	if ( elf_read_firmware(argv[1], &f) != 0 ) {
+		printf("Cannot read %s\n", argv[1]);
+		return 1;
+	}
+	strcpy(f.mmcu, "atmega328p");
+	f.frequency = 16000000;
+	avr_t *avr = avr_make_mcu_by_name(f.mmcu);
+	if ( avr == NULL ) {
+		return 1;
+	}
+	avr_init(avr);
+	avr_load_firmware(avr, &f);
+	uint32_t flags = 0;
+	avr_ioctl(avr, AVR_IOCTL_UART_GET_FLAGS('0'), &flags);
+	flags &= ~AVR_UART_FLAG_STDIO; // the frames of the firmware are not for the console
+	avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS('0'), &flags);
+	avr_irq_t *twpc_data[] = { avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 2), avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 4) }; // a district each
+	avr_irq_t *onewire = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('C'), 0);
+	avr_irq_t *rx = avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_INPUT);
+	int inside = 0; // the vector being timed, interrupts do not nest
+	uint64_t start = 0;
+	uint64_t next_byte = 0;
+	srand(1);
+	for ( long done = 0; done < n; ) {
+		uint16_t opcode = avr->flash[avr->pc] | avr->flash[avr->pc + 1] << 8;
+		if ( !inside && ( avr->pc == CYCLES_VECTOR || avr->pc == CYCLES_RX_VECTOR || avr->pc == CYCLES_UDRE_VECTOR ) ) {
+			inside = avr->pc;
+			start = avr->cycle;
+		}
+		if ( inside == CYCLES_VECTOR && avr->pc == CYCLES_VECTOR ) {
+			avr_raise_irq(twpc_data[0], rand() % 4 != 0); // mostly idle, '0' = +Vcc
+			avr_raise_irq(twpc_data[1], rand() % 4 != 0);
+			avr_raise_irq(onewire, rand() % 2);
+		}
+		if ( avr->cycle >= next_byte ) {
+			avr_raise_irq(rx, rand() & 0xFF);
+			next_byte = avr->cycle + CYCLES_BYTE;
+		}
+		int state = avr_run(avr);
+		if ( inside && opcode == CYCLES_RETI ) {
+			uint32_t cycles = avr->cycle - start + CYCLES_ENTRY;
+			if ( inside == CYCLES_VECTOR ) {
+				cycles_count(&paths[avr->data[CYCLES_GPIOR0]], cycles);
+				done++;
+			} else {
+				cycles_count(&serial_paths[inside == CYCLES_UDRE_VECTOR], cycles);
+			}
+			inside = 0;
+		}
+		if ( state == cpu_Done || state == cpu_Crashed ) {
+			printf("The firmware stopped\n");
+			return 1;
+		}
+	}
+	uint32_t worst = 0;
+	printf("%-12s %-8s %10s %6s %6s %6s\n", "twpc", "onewire", "count", "min", "avg", "max");
+	for ( int i = 0; i < 256; i++ ) {
+		cycles_path_t *p = &paths[i];
+		if ( p->count == 0 ) {
+			continue;
+		}
+		cycles_print(( i >> 4 ) < 9 ? twpc_names[i >> 4] : "?", ( i & 15 ) < 6 ? onewire_names[i & 15] : "?", p);
+		worst = p->max > worst ? p->max : worst;
+	}
+	cycles_print("uart rx", "", &serial_paths[0]);
+	cycles_print("uart udre", "", &serial_paths[1]);
+	uint32_t tick = worst + serial_paths[0].max + serial_paths[1].max;
+	uint32_t fifo = worst + serial_paths[0].max;
+	printf("worst %u cycles (%.1f us), %.1f%% of a tick\n", worst, worst / 16.0, worst * 100.0 / CYCLES_TICK);
+	printf("with the uart %u of %u cycles a tick, %u of %u cycles the RX FIFO lasts at %u baud\n", tick, CYCLES_TICK,
+		fifo, CYCLES_RX_FIFO * CYCLES_BYTE, (unsigned)CYCLES_BAUD);
+	if ( tick > CYCLES_TICK || fifo > CYCLES_RX_FIFO * CYCLES_BYTE ) {
+		printf("Over budget\n");
+		return 1;
+	}
+	return 0;
+}
@@ -2,6 +2,7 @@
 #include <avr/interrupt.h>
 #include <avr/pgmspace.h>
 #include <util/delay.h>
+#include <string.h>
 #include "serial.h"
 #include "../twpc_def.h"
 
@@ -11,10 +12,13 @@ Model Railway Master code
 created by L Szabi 2015
 
 Code for master station
-- TWPC master
-- Onewire server
+- TWPC master, transactions run by the timer from a ring of pending packets per district,
+  each at the bit rate the Pi asks for, without the reply for TWPC_NO_REPLY
+- TWPC_DISTRICTS busses driven at the same time, one port write and one pin read per interrupt
+- Onewire server, every sensor pin of the port read at once
+- both busses stepped by the timer through schedules, make cycles times it
 - LED
-- UART
+- UART, framed (link_def.h), at the rate the Pi asks for
 
 */
 
@@ -26,21 +30,25 @@ Code for master station
 #define ONEWIRE_PORT PORTC
 #define ONEWIRE_PIN PINC
 
-#define TWPC_POWER_P 1
+// A district is a power line and a data input of its own, district 0 is the bus of the old boards
+#define TWPC_DISTRICTS 2
+
 #define TWPC_POWER_DDR DDRB
 #define TWPC_POWER_PORT PORTB
+#define TWPC_POWER_ALL ( _BV(1) | _BV(3) )
 
-#define TWPC_DATA_P 2
 #define TWPC_DATA_DDR DDRB
 #define TWPC_DATA_PIN PINB
+#define TWPC_DATA_ALL ( _BV(2) | _BV(4) )
 
-#define TWPC_FAULT_THRESHOLD 25
+static const uint8_t twpc_power_masks[TWPC_DISTRICTS] = { _BV(1), _BV(3) };
+static const uint8_t twpc_data_masks[TWPC_DISTRICTS] = { _BV(2), _BV(4) };
 
-#define ONEWIRE_PINS_N 1
+#define TWPC_FAULT_THRESHOLD 25 // half bits
 
-#if ONEWIRE_PINS_N > 0
-static const int onewire_pins[] = { 0 }; // multiple places
-#endif
+#define COM_DIV TWPC_TICK_DIV // timer interrupts per tick of the clock and the onewire bus
+
+#define ONEWIRE_PINS _BV(0) // sensors on the onewire port, up to all 8, the bit is the pin number
 
 // LED driver
 
@@ -65,283 +73,510 @@ void led_blink(void) {
 
 // Communication
 
-#define TWPC_STATE_IDLE 0
-#define TWPC_STATE_SEND 1
-#define TWPC_STATE_RECV 2
-
-static volatile int twpc_even = 1;
-static volatile int twpc_bit = 0;
-static volatile int twpc_state = 0;
-static volatile int twpc_fault = 0;
-
-#if ONEWIRE_PINS_N > 0
-static volatile int onewire_even = 0;
-static volatile int onewire_idx = 0;
-static volatile int onewire_bit = 0;
-static volatile int onewire_data = 0;
-
-static volatile int onewire_pin = 0;
-static volatile int onewire_dev = 0;
-static volatile int onewire_got = 0;
-
-static volatile int onewire_last[ONEWIRE_PINS_N];
+// The timer runs both busses from schedules: a step says what to do on the line,
+// the ticks until the next step and how many times it is done (data bits)
+typedef struct {
+	uint8_t action;
+	uint8_t ticks;
+	uint8_t count;
+} com_step_t;
+
+#define COM_NONE 0 // no step this tick
+
+#define TWPC_LINE_ON 1
+#define TWPC_LINE_OFF 2
+#define TWPC_SEND_BIT 3 // lowest bit of the shift register, shifted out
+#define TWPC_REPLY_START 4 // first start bit of the reply, the slave sends the second one, the end of a TWPC_NO_REPLY packet
+#define TWPC_REPLY_WAIT 5 // polled every timer interrupt until the second start bit or a fault
+#define TWPC_RECV_BIT 6 // shifted into the shift register from the top
+#define TWPC_DONE 7
+#define TWPC_FAULT 8 // nobody answered, only a path of the cycle harness
+
+// A transaction: the packet, then the reply of the slave, ticks are half bits
+static const com_step_t twpc_schedule[] = {
+	{ TWPC_LINE_ON, 2, 1 }, // first start bit '1'
+	{ TWPC_LINE_OFF, 2, 1 }, // second start bit '0'
+	{ TWPC_SEND_BIT, 2, TWPC_DATA_BITS },
+	{ TWPC_LINE_OFF, 3, 1 }, // stop bit, the reply starts a tick later
+	{ TWPC_REPLY_START, 1, 1 },
+	{ TWPC_REPLY_WAIT, 2, 1 },
+	{ TWPC_RECV_BIT, 2, TWPC_DATA_BITS },
+	{ TWPC_LINE_OFF, 2, 1 },
+	{ TWPC_DONE, 1, 1 }
+};
+
+#define TWPC_IDLE ( sizeof(twpc_schedule) / sizeof(com_step_t) )
+
+// A transaction running, on one district or in step on several (broadcasts), then it is the lane
+// of the lowest one which drives and reads all of them. Only the timer touches these.
+typedef struct {
+	uint8_t step; // of twpc_schedule
+	uint8_t left; // times the step is still done
+	uint8_t wait; // timer interrupts until the step
+	uint8_t half; // timer interrupts of a half bit at the rate of the transaction
+	uint32_t shift; // packet going out, reply coming in
+	uint8_t fault;
+	uint8_t slot; // of twpc_done for the answer
+	uint8_t quiet; // nobody answers it
+	uint8_t power; // power pins driven
+	uint8_t data; // data pins read, '1' only if it is '1' on all of them
+	uint8_t districts; // bits
+} twpc_lane_t;
+
+static twpc_lane_t twpc_lanes[TWPC_DISTRICTS];
+static uint8_t twpc_busy = 0; // districts a lane is driving
+static uint8_t twpc_power = TWPC_POWER_ALL; // written to the power pins after the lanes stepped, set: '0'
+static uint8_t twpc_in; // the data pins, read before the lanes step
+
+static volatile uint16_t twpc_faults = 0; // transactions nobody answered
+
+#if ONEWIRE_PINS
+#define ONEWIRE_DRIVE 1 // first start bit, driven by the master
+#define ONEWIRE_FLOAT 2
+#define ONEWIRE_START 3 // second start bit of the beacons, else the next query
+#define ONEWIRE_BIT 4
+#define ONEWIRE_STOP 5
+
+// Asks the beacons under all sensors for the trains above them, the pins are read together,
+// bit i of every pin goes into onewire_slices[i] (a bit per pin), the main loop sorts them out
+static const com_step_t onewire_schedule[] = {
+	{ ONEWIRE_DRIVE, 2, 1 },
+	{ ONEWIRE_FLOAT, 2, 1 },
+	{ ONEWIRE_START, 2, 1 },
+	{ ONEWIRE_BIT, 2, 8 },
+	{ ONEWIRE_STOP, 2, 1 }
+};
+
+static uint8_t onewire_step = 0;
+static uint8_t onewire_left = 1;
+static uint8_t onewire_wait = 1;
+static uint8_t onewire_bit;
+static uint8_t onewire_alive; // pins which sent the second start bit
+
+// Written by the timer only while onewire_got is 0, the main loop clears it when it is done
+static volatile uint8_t onewire_slices[8];
+static volatile uint8_t onewire_got = 0; // pins with a whole beacon in onewire_slices
+static volatile uint16_t onewire_time = 0; // tick of the beacons
+static uint8_t onewire_last[8]; // train of each pin, main loop only
 #endif
 
-static volatile twpc_packet_t twpc_data_send;
-static volatile int twpc_sent = 1;
+static uint8_t com_div = 0;
+static volatile uint16_t ticks = 0; // 0.496ms each, every COM_DIV timer interrupts
+
+// Packets of the uart wait in the twpc_pending ring of their districts, the lane of each
+// district takes one after the other and puts the replies into twpc_done, the main loop never
+// waits for the bus. Every packet has its place in twpc_done from the moment it is queued,
+// so the answers keep the order of the packets while the districts run side by side.
+// Packets for the master itself and lost ones are answered there right away.
+typedef struct {
+	twpc_packet_t packet;
+	uint8_t seq; // of the frame of the packet
+	uint8_t type; // of the answer: LINK_REPLY, LINK_LOST if the frame was bad, TWPC_WAITING in twpc_done until it is there
+	uint8_t rate; // of the TWPC bus
+	uint8_t districts; // bits
+	uint8_t slot; // of twpc_done
+} twpc_transaction_t;
+
+#define TWPC_WAITING 0
+#define TWPC_PENDING_SIZE 16 // per district
+
+typedef struct {
+	twpc_transaction_t buffer[TWPC_PENDING_SIZE];
+	uint8_t start; // moved by the timer
+	uint8_t end; // moved by the main loop
+} twpc_pending_t;
+
+typedef struct {
+	twpc_transaction_t buffer[TWPC_BUFFER_SIZE];
+	uint8_t start; // both moved by the main loop, the timer fills the places in between
+	uint8_t end;
+} twpc_done_t;
+
+static volatile twpc_pending_t twpc_pending[TWPC_DISTRICTS];
+static volatile twpc_done_t twpc_done;
 
-volatile twpc_packet_t twpc_data_recv;
-volatile int twpc_received = 0;
-
-// using inverted logic: '0' = +Vcc, '1' = 0V
-static void twpc_line_off(void) {
-	TWPC_POWER_PORT |= _BV(TWPC_POWER_P);
-}
-
-static void twpc_line_on(void) {
-	TWPC_POWER_PORT &= ~_BV(TWPC_POWER_P);
-}
-
-static uint32_t twpc_read(void) {
-	return !( TWPC_DATA_PIN & _BV(TWPC_DATA_P) ) ? 1UL : 0UL;
-}
-
-#if ONEWIRE_PINS_N > 0
-static int onewire_read(void) {
-	ONEWIRE_DDR &= ~_BV(onewire_pins[onewire_idx]);
-	ONEWIRE_PORT &= ~_BV(onewire_pins[onewire_idx]);
-	return ( ONEWIRE_PIN & _BV(onewire_pins[onewire_idx]) ? 1 : 0 );
+void com_init(void) {
+	TCCR1A = 0;
+#ifdef TWPC_FAST
+	OCR1A = 123; // TWPC_TICK_US
+	TCCR1B = _BV(WGM12) | _BV(CS11); // F_CPU/8, CTC mode
+#else
+	OCR1A = 30; // 0.5ms
+	TCCR1B = _BV(WGM12) | _BV(CS12); // F_CPU/256, CTC mode
+#endif
+	TIMSK1 = _BV(OCIE1A);
+	TWPC_POWER_PORT |= TWPC_POWER_ALL; // using inverted logic: '0' = +Vcc, '1' = 0V
+	TWPC_POWER_DDR |= TWPC_POWER_ALL;
+	TWPC_DATA_DDR &= ~TWPC_DATA_ALL;
+	for ( uint8_t d = 0; d < TWPC_DISTRICTS; d++ ) {
+		twpc_lanes[d].step = TWPC_IDLE;
+	}
 }
 
-/* not used
-static void onewire_line_off(void) {
-	ONEWIRE_DDR |= _BV(onewire_pins[onewire_idx]);
-	ONEWIRE_PORT &= ~_BV(onewire_pins[onewire_idx]);
-} */
-
-static void onewire_line_on(void) {
-	ONEWIRE_DDR |= _BV(onewire_pins[onewire_idx]);
-	ONEWIRE_PORT |= _BV(onewire_pins[onewire_idx]);
+// Room for a packet on every district
+static int twpc_room(void) {
+	if ( ( twpc_done.end + 1 ) % TWPC_BUFFER_SIZE == twpc_done.start ) {
+		return 0;
+	}
+	for ( uint8_t d = 0; d < TWPC_DISTRICTS; d++ ) {
+		if ( ( twpc_pending[d].end + 1 ) % TWPC_PENDING_SIZE == twpc_pending[d].start ) {
+			return 0;
+		}
+	}
+	return 1;
 }
 
-static void onewire_next(void) {
-	onewire_idx = ( onewire_idx + 1 ) % ONEWIRE_PINS_N;
+// Queues a transaction on its districts, 0 if there is no room for it yet
+int com_send(twpc_transaction_t *t) {
+	if ( !twpc_room() ) {
+		return 0;
+	}
+	volatile twpc_transaction_t *a = &twpc_done.buffer[twpc_done.end];
+	a->packet.data_raw = t->packet.data_raw;
+	a->seq = t->seq;
+	a->rate = 0;
+	if ( t->type != LINK_REPLY || t->packet.uid == 0 ) {
+		a->type = t->type; // lost, or handled by the main loop already
+	} else {
+		a->type = TWPC_WAITING;
+		for ( uint8_t d = 0; d < TWPC_DISTRICTS; d++ ) {
+			volatile twpc_pending_t *b = &twpc_pending[d];
+			if ( t->districts & _BV(d) ) {
+				b->buffer[b->end].packet.data_raw = t->packet.data_raw;
+				b->buffer[b->end].rate = t->rate;
+				b->buffer[b->end].districts = t->districts;
+				b->buffer[b->end].slot = twpc_done.end;
+				b->end = ( b->end + 1 ) % TWPC_PENDING_SIZE;
+			}
+		}
+	}
+	twpc_done.end = ( twpc_done.end + 1 ) % TWPC_BUFFER_SIZE;
+	return 1;
 }
-#endif
 
-void com_init(void) {
-	OCR1A = 30; // 0.5ms
-	TCCR1A = 0;
-	TCCR1B = _BV(WGM12) | _BV(CS12); // F_CPU/256, CTC mode
-	TIMSK1 = _BV(OCIE1A);
-	TWPC_POWER_DDR |= _BV(TWPC_POWER_P);
-	TWPC_DATA_DDR &= ~_BV(TWPC_DATA_P);
-	twpc_line_off();
-#if ONEWIRE_PINS_N > 0
-	for ( int i = 0; i < ONEWIRE_PINS_N; i++ ) {
-		onewire_last[i] = 0;
+// Next answer, 0 if none is ready
+int com_recv(twpc_transaction_t *t) {
+	volatile twpc_transaction_t *a = &twpc_done.buffer[twpc_done.start];
+	if ( twpc_done.start == twpc_done.end || a->type == TWPC_WAITING ) {
+		return 0;
 	}
-#endif
+	t->packet.data_raw = a->packet.data_raw;
+	t->seq = a->seq;
+	t->type = a->type;
+	t->rate = a->rate;
+	twpc_done.start = ( twpc_done.start + 1 ) % TWPC_BUFFER_SIZE;
+	return 1;
 }
 
-void com_send(twpc_packet_t *packet) {
-	while ( !twpc_sent );
-	twpc_sent = 0;
-	twpc_data_send.data_raw = packet->data_raw;
-	twpc_bit = 0;
-	twpc_state = TWPC_STATE_SEND;
+// Reply of the transaction just finished, 0 after a fault
+static void twpc_finish(twpc_lane_t *l, uint32_t reply) {
+	volatile twpc_transaction_t *a = &twpc_done.buffer[l->slot];
+	a->packet.data_raw = reply;
+	a->type = l->quiet ? LINK_SENT : LINK_REPLY; // last, the main loop may take it from here
+	l->step = TWPC_IDLE;
+	twpc_busy &= ~l->districts;
 }
 
-void com_recv(void) {
-	while ( !twpc_sent );
-	twpc_bit = 0;
-	twpc_received = 0;
-	twpc_state = TWPC_STATE_RECV;
-	while ( twpc_received == 0 );
+// Next transaction of a district: one of its own, or one of several districts when it
+// is at the head of all of them and their lanes are idle, then the lowest one runs it
+static void twpc_next(uint8_t d) {
+	volatile twpc_pending_t *b = &twpc_pending[d];
+	if ( b->start == b->end || ( twpc_busy & _BV(d) ) ) {
+		return;
+	}
+	volatile twpc_transaction_t *t = &b->buffer[b->start];
+	uint8_t districts = t->districts;
+	if ( ( districts & ( _BV(d) - 1 ) ) || ( twpc_busy & districts ) ) {
+		return;
+	}
+	for ( uint8_t e = d + 1; e < TWPC_DISTRICTS; e++ ) {
+		volatile twpc_pending_t *o = &twpc_pending[e];
+		if ( ( districts & _BV(e) ) && ( o->start == o->end || o->buffer[o->start].slot != t->slot ) ) {
+			return;
+		}
+	}
+	twpc_lane_t *l = &twpc_lanes[d];
+	l->shift = t->packet.data_raw;
+	l->slot = t->slot;
+	l->half = TWPC_HALF_TICKS(t->rate);
+	l->quiet = t->packet.checksum & TWPC_NO_REPLY;
+	l->power = 0;
+	l->data = 0;
+	l->districts = districts;
+	twpc_busy |= districts;
+	for ( uint8_t e = d; e < TWPC_DISTRICTS; e++ ) {
+		if ( districts & _BV(e) ) {
+			l->power |= twpc_power_masks[e];
+			l->data |= twpc_data_masks[e];
+			twpc_pending[e].start = ( twpc_pending[e].start + 1 ) % TWPC_PENDING_SIZE;
+		}
+	}
+	l->step = 0;
+	l->left = twpc_schedule[0].count;
 }
 
-ISR(TIMER1_COMPA_vect) {
-#if ONEWIRE_PINS_N > 0
-	// code for onewire
-	if ( onewire_even ) {
-		if ( onewire_bit == 0 ) { // send first start bit
-			onewire_line_on();
-			onewire_bit = 1;
-		} else if ( onewire_bit == 1 ) { // float line
-			onewire_read();
-			onewire_bit = 2;
-		} else if ( onewire_bit == 2 ) { // wait for second start bit
-			if ( onewire_read() ) { // accept data
-				onewire_bit = 3;
-				onewire_data = 0;
-			} else {
-				onewire_bit = 0;
-				onewire_next();
-			}
-		} else if ( onewire_bit > 2 && onewire_bit < 11 ) {
-			onewire_data |= onewire_read() << ( onewire_bit - 3 );
-			onewire_bit++;
-		} else {
-			if ( onewire_read() && onewire_last[onewire_idx] != onewire_data ) { // error checking
-				onewire_pin = onewire_idx;
-				onewire_dev = onewire_data;
-				onewire_last[onewire_idx] = onewire_data;
-				onewire_got = 1;
-			}
-			onewire_bit = 0;
-			onewire_next();
+// Step of the transaction of a lane due this tick, returns what it did
+static inline uint8_t twpc_tick(uint8_t d) {
+	twpc_lane_t *l = &twpc_lanes[d];
+	if ( l->step == TWPC_IDLE ) {
+		twpc_next(d);
+		if ( l->step == TWPC_IDLE ) {
+			return COM_NONE;
 		}
+	} else if ( --l->wait ) {
+		return COM_NONE;
 	}
-	onewire_even ^= 1;
-#endif
-	// code for twpc
-	if ( twpc_even ) {
-		// code for sending
-		if ( twpc_state == TWPC_STATE_SEND ) { // is there data to send?
-			if ( twpc_bit == 0 ) {
-				twpc_line_on(); // first start bit '1'
-			} else if ( twpc_bit == 1 ) {
-				twpc_line_off(); // second start bit '0'
-			} else if ( twpc_bit >= 2 && twpc_bit < 2 + TWPC_DATA_BITS ) { // send data
-				if ( twpc_data_send.data_raw & ( 1UL << (twpc_bit - 2) ) ) {
-					twpc_line_on();
-				} else {
-					twpc_line_off();
-				}
-			} else if ( twpc_bit == 2 + TWPC_DATA_BITS ) {
-				twpc_line_off();
-				twpc_bit++;
+	const com_step_t *s = &twpc_schedule[l->step];
+	l->wait = s->ticks * l->half;
+	switch ( s->action ) {
+		case TWPC_LINE_ON:
+			twpc_power &= ~l->power;
+			break;
+		case TWPC_LINE_OFF:
+			twpc_power |= l->power;
+			break;
+		case TWPC_SEND_BIT:
+			if ( (uint8_t)l->shift & 1 ) {
+				twpc_power &= ~l->power;
 			} else {
-				twpc_sent = 1;
-				twpc_state = TWPC_STATE_IDLE; // data sent
+				twpc_power |= l->power;
 			}
-			twpc_bit++;
-		}
-	} else {
-		// code for receiving
-		if ( twpc_state == TWPC_STATE_RECV ) {
-			if ( twpc_bit == 0 ) { // send first start bit
-				twpc_line_on(); // '1' -> no voltage on line
-				twpc_bit = 1;
-				twpc_even ^= 1;
-				twpc_fault = 0;
-			} else if ( twpc_bit == 1 ) { // waiting for second start bit
-				if ( !twpc_read() ) {
-					twpc_data_recv.data_raw = 0;
-					twpc_bit = 2;
-				} else {
-					twpc_even ^= 1; // loop back
+			l->shift >>= 1;
+			break;
+		case TWPC_REPLY_START:
+			if ( l->quiet ) { // the line stays on after the stop bit
+				twpc_finish(l, 0);
+				return TWPC_DONE;
+			}
+			twpc_power &= ~l->power; // '1' -> no voltage on line
+			l->fault = 0;
+			break;
+		case TWPC_REPLY_WAIT:
+			if ( !( twpc_in & l->data ) ) { // no second start bit yet
+				l->wait = 1;
 #if TWPC_FAULT_THRESHOLD > 0
-					twpc_fault++;
-					if ( twpc_fault > TWPC_FAULT_THRESHOLD ) {
-						twpc_line_off();
-						twpc_received = 1;
-						twpc_state = TWPC_STATE_IDLE;
-					}
-#endif
+				if ( ++l->fault > TWPC_FAULT_THRESHOLD * l->half ) {
+					twpc_power |= l->power;
+					twpc_faults++;
+					twpc_finish(l, 0);
+					return TWPC_FAULT;
 				}
-			} else if ( twpc_bit >= 2 && twpc_bit < 2 + TWPC_DATA_BITS ) { // read data
-				twpc_data_recv.data_raw |= twpc_read() << ( twpc_bit - 2 );
-				twpc_bit++;
-			} else if ( twpc_bit == 2 + TWPC_DATA_BITS ) {
-				twpc_line_off();
-				twpc_bit++;
-			} else {
-				twpc_received = 1;
-				twpc_state = TWPC_STATE_IDLE;
+#endif
+				return TWPC_REPLY_WAIT;
 			}
-		}
+			l->wait += l->half - 1; // the bits are read in their middle
+			break;
+		case TWPC_RECV_BIT:
+			l->shift >>= 1;
+			if ( !( twpc_in & l->data ) ) {
+				l->shift |= 1UL << ( TWPC_DATA_BITS - 1 );
+			}
+			break;
+		case TWPC_DONE:
+			twpc_finish(l, l->shift);
+			return TWPC_DONE;
 	}
-	twpc_even ^= 1;
-}
-
-// Main
-
-static int read_nibble(char c) {
-	if ( c >= '0' && c <= '9' ) {
-		return c - '0';
-	} else if ( c >= 'a' && c <= 'f' ) {
-		return c - 'a' + 0x0a;
-	} else if ( c >= 'A' && c <= 'F' ) {
-		return c - 'A' + 0x0a;
+	if ( --l->left == 0 ) {
+		l->step++;
+		l->left = twpc_schedule[l->step].count;
 	}
-	return 0;
+	return s->action;
 }
 
-static char write_nibble(int x) {
-	if ( x >= 0 && x < 10 ) {
-		return '0' + x;
-	} else if ( x >= 0x0a && x <= 0x0f ) {
-		return 'a' + x - 0x0a;
-	}
-	return '0';
+#if ONEWIRE_PINS
+static void onewire_restart(void) {
+	onewire_step = 0;
+	onewire_left = onewire_schedule[0].count;
 }
 
-int read_byte(char first, char second) {
-	return read_nibble(first) << 4 | read_nibble(second);
+// Step of the beacon query due this tick, returns what it did
+static inline uint8_t onewire_tick(void) {
+	if ( --onewire_wait ) {
+		return COM_NONE;
+	}
+	const com_step_t *s = &onewire_schedule[onewire_step];
+	onewire_wait = s->ticks;
+	switch ( s->action ) {
+		case ONEWIRE_DRIVE:
+			ONEWIRE_DDR |= ONEWIRE_PINS;
+			ONEWIRE_PORT |= ONEWIRE_PINS;
+			break;
+		case ONEWIRE_FLOAT:
+			ONEWIRE_DDR &= ~ONEWIRE_PINS;
+			ONEWIRE_PORT &= ~ONEWIRE_PINS;
+			break;
+		case ONEWIRE_START:
+			onewire_alive = onewire_got ? 0 : ONEWIRE_PIN & ONEWIRE_PINS; // the last ones are not taken yet
+			if ( !onewire_alive ) { // no beacon
+				onewire_restart();
+				return ONEWIRE_START;
+			}
+			onewire_bit = 0;
+			break;
+		case ONEWIRE_BIT:
+			onewire_slices[onewire_bit++] = ONEWIRE_PIN;
+			break;
+		case ONEWIRE_STOP:
+			onewire_got = onewire_alive & ONEWIRE_PIN; // error checking
+			onewire_time = ticks;
+			onewire_restart();
+			return ONEWIRE_STOP;
+	}
+	if ( --onewire_left == 0 ) {
+		onewire_step++;
+		onewire_left = onewire_schedule[onewire_step].count;
+	}
+	return s->action;
 }
+#endif
 
-void write_byte(char *s, int x) {
-	s[0] = write_nibble((x & 0xF0) >> 4);
-	s[1] = write_nibble(x & 0x0F);
+// The path taken (onewire action | twpc action << 4 of the last lane which did something)
+// is left in GPIOR0 for the cycle harness
+ISR(TIMER1_COMPA_vect) {
+	uint8_t path = COM_NONE;
+	twpc_in = TWPC_DATA_PIN; // every district at once
+	if ( ++com_div == COM_DIV ) {
+		com_div = 0;
+		ticks++;
+#if ONEWIRE_PINS
+		path = onewire_tick();
+#endif
+	}
+	for ( uint8_t d = 0; d < TWPC_DISTRICTS; d++ ) {
+		uint8_t action = twpc_tick(d);
+		if ( action != COM_NONE ) {
+			path = ( path & 0x0F ) | action << 4;
+		}
+	}
+	TWPC_POWER_PORT = ( TWPC_POWER_PORT & ~TWPC_POWER_ALL ) | twpc_power; // every district at once
+#ifdef COM_CYCLES
+	GPIOR0 = path;
+#else
+	(void)path;
+#endif
 }
 
-void write_int(char *s, uint32_t x) {
-	write_byte(s, x >> 24);
-	write_byte(&s[2], x >> 16);
-	write_byte(&s[4], x >> 8);
-	write_byte(&s[6], x);
-	s[8] = '\0';
-}
+// Main
 
 int main(void) {
 	cli();
 	led_init();
 	com_init();
-	serial_init(57600);
+	const uint32_t bauds[LINK_BAUDS_N] = LINK_BAUDS;
+#ifdef COM_CYCLES
+	serial_init(bauds[LINK_BAUDS_N - 1]); // the harness sends at the highest rate
+#else
+	serial_init(bauds[0]);
+#endif
 	led_blink();
-	twpc_packet_t last_packet;
+	serial_frame_t frame;
+	twpc_transaction_t t;
+	uint8_t seq = 0; // of the next packet of the server
+	uint16_t stats[5] = { 0, 0, 0, 0, 0 }; // good frames, bad frames, bus faults, rx dropped, rx overruns
+	uint16_t stats_tick = 0;
+	uint8_t speed = 0; // index of bauds
+	uint16_t speed_tick = 0; // of the last good frame
 	DDRD |= _BV(7); // work this out later
 	DDRB |= _BV(0);
 	PORTD |= _BV(7);
 	PORTB &= ~_BV(0);
 	sei();
 	while ( 1 ) {
-		// Receive data from uart
-		if ( serial_available() >= sizeof(twpc_packet_t) ) {
-			serial_gets((char *)&last_packet, sizeof(twpc_packet_t));
-			if ( last_packet.checksum == TWPC_CHECKSUM(last_packet) ) {
-				if ( last_packet.uid == 0 ) {
-					char msg[16];
-					write_int(msg, last_packet.data_raw);
-					serial_puts(msg);
-					if ( last_packet.cmd == TWPC_CMD_SW_STRAIGHT ) {
-						PORTD |= _BV(7);
-						PORTB &= ~_BV(0);
-					} else if ( last_packet.cmd == TWPC_CMD_SW_FORK ) {
-						PORTD &= ~_BV(7);
-						PORTB |= _BV(0);
-					}
-				} else {
-					com_send(&last_packet);
-					com_recv();
-					char msg[16];
-					write_int(msg, twpc_data_recv.data_raw);
-					serial_puts(msg);
-					twpc_data_recv.data_raw = 0;
+		cli();
+		uint16_t now = ticks;
+		stats[2] = twpc_faults;
+		sei();
+		stats[3] = serial_dropped();
+		stats[4] = serial_overruns();
+#ifdef COM_CYCLES
+		// keeps the bus busy for the cycle harness, nothing comes from the uart there
+		t.packet.uid = 1;
+		t.packet.cmd = TWPC_CMD_STATUS;
+		t.packet.arg = 0;
+		t.packet.checksum = TWPC_CHECKSUM(t.packet);
+		t.seq = 0;
+		t.type = LINK_REPLY;
+		t.rate = TWPC_RATES - 1;
+		t.districts = _BV(seq++ % TWPC_DISTRICTS); // all of them busy
+		com_send(&t);
+#endif
+		// Receive frames from uart, as long as there is room for the packets
+		int result = twpc_room() ? serial_get_frame(&frame) : 0;
+		if ( result > 0 ) {
+			speed_tick = now;
+		}
+		if ( result > 0 && frame.type == LINK_SPEED && frame.len == 1 && frame.body[0] < LINK_BAUDS_N ) {
+			// answered at the old rate, the Pi switches when it has it
+			serial_put_frame(LINK_SPEED, frame.seq, frame.body, 1);
+			if ( frame.body[0] != speed ) {
+				speed = frame.body[0];
+				serial_baud(bauds[speed]);
+			}
+		} else if ( result > 0 && frame.type == LINK_PACKET && ( frame.len == sizeof(twpc_packet_t) || frame.len == sizeof(twpc_packet_t) + 1 ) ) {
+			stats[0]++;
+			memcpy(&t.packet, frame.body, sizeof(twpc_packet_t));
+			t.seq = frame.seq;
+			t.rate = frame.len > sizeof(twpc_packet_t) && LINK_RATE(frame.body[4]) < TWPC_RATES ? LINK_RATE(frame.body[4]) : 0;
+			t.districts = frame.len > sizeof(twpc_packet_t) ? LINK_DISTRICTS(frame.body[4]) & ( _BV(TWPC_DISTRICTS) - 1 ) : 0;
+			if ( t.districts == 0 ) {
+				t.districts = _BV(TWPC_DISTRICTS) - 1;
+			}
+			t.type = TWPC_CHECKSUM_OK(t.packet) ? LINK_REPLY : LINK_LOST;
+			seq = frame.seq + 1;
+			if ( t.type == LINK_REPLY && t.packet.uid == 0 ) {
+				if ( t.packet.cmd == TWPC_CMD_SW_STRAIGHT ) {
+					PORTD |= _BV(7);
+					PORTB &= ~_BV(0);
+				} else if ( t.packet.cmd == TWPC_CMD_SW_FORK ) {
+					PORTD &= ~_BV(7);
+					PORTB |= _BV(0);
 				}
-			} else {
-				serial_puts("re");
-				serial_flush_rx();
+			}
+			com_send(&t);
+		} else if ( result < 0 ) {
+			stats[1]++;
+			if ( frame.len == LINK_PACKET_FRAME || frame.len == LINK_PACKET_FRAME + 1 ) { // most likely the next packet
+				t.packet.data_raw = 0;
+				t.seq = seq++;
+				t.type = LINK_LOST;
+				t.rate = 0;
+				com_send(&t);
 			}
 		}
+		// Answers in the order of the packets
+		while ( com_recv(&t) ) {
+			serial_put_frame(t.type, t.seq, &t.packet, t.type == LINK_REPLY ? sizeof(twpc_packet_t) : 0);
+		}
+#if ONEWIRE_PINS
+		// Beacons of the sensors, a bit of each pin in every slice, sent when the train changed
 		if ( onewire_got ) {
-			onewire_got = 0;
-			char buf[10];
-			write_byte(buf, onewire_dev);
-			buf[2] = '\0';
-			serial_put('w');
-			serial_puts(buf);
+			for ( uint8_t pin = 0; pin < 8; pin++ ) {
+				if ( !( onewire_got & _BV(pin) ) ) {
+					continue;
+				}
+				uint8_t dev = 0;
+				for ( uint8_t i = 0; i < 8; i++ ) {
+					if ( onewire_slices[i] & _BV(pin) ) {
+						dev |= _BV(i);
+					}
+				}
+				if ( onewire_last[pin] != dev ) {
+					uint8_t event[4] = { pin, dev, onewire_time & 0xFF, onewire_time >> 8 };
+					onewire_last[pin] = dev;
+					serial_put_frame(LINK_SENSOR, 0, event, 4);
+				}
+			}
+			onewire_got = 0; // the timer takes the next beacons
+		}
+#endif
+		if ( (uint16_t)( now - stats_tick ) >= LINK_STATS_TICKS ) {
+			stats_tick = now;
+			serial_put_frame(LINK_STATS, 0, stats, sizeof(stats));
+		}
+		// The Pi is gone or cannot hear the rate, both start over at the first one
+		if ( speed != 0 && (uint16_t)( now - speed_tick ) >= LINK_SPEED_TIMEOUT ) {
+			speed = 0;
+			serial_baud(bauds[0]);
 		}
 	}
 	return 1;
@@ -1,37 +1,58 @@
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <util/crc16.h>
 #include "serial.h"
 
 volatile static ring_buffer_t tx;
 volatile static ring_buffer_t rx;
 
-void buf_store(char c, volatile ring_buffer_t *b) {
-	int i = ( b->end + 1 ) % SERIAL_BUF_SIZE;
-	while ( b->start == i );
+static uint8_t frame_rx[LINK_ENCODED_MAX]; // encoded bytes of the frame being received
+static int8_t frame_rx_n = 0; // -1: too long, skipped up to the next 0
+static volatile uint8_t tx_used = 0; // TXC tells when the last byte is out
+
+static volatile uint16_t rx_dropped = 0; // the rx buffer was full
+static volatile uint16_t rx_overruns = 0; // the uart had no room, the ISR came too late
+
+// 0 if the buffer is full, the byte is dropped
+uint8_t buf_store(char c, volatile ring_buffer_t *b) {
+	uint8_t i = ( b->end + 1 ) & SERIAL_BUF_MASK;
+	if ( i == b->start ) {
+		return 0;
+	}
 	b->buffer[b->end] = c;
 	b->end = i;
+	return 1;
 }
 
 char buf_get(volatile ring_buffer_t *b) {
 	if ( b->start != b->end ) {
 		char c = b->buffer[b->start];
-		b->start = ( b->start + 1 ) % SERIAL_BUF_SIZE;
+		b->start = ( b->start + 1 ) & SERIAL_BUF_MASK;
 		return c;
 	}
 	return 0;
 }
 
-int buf_available(volatile ring_buffer_t *b) {
-	return ( SERIAL_BUF_SIZE + b->end - b->start ) % SERIAL_BUF_SIZE;
+uint8_t buf_available(volatile ring_buffer_t *b) {
+	return ( b->end - b->start ) & SERIAL_BUF_MASK;
 }
 
 ISR(USART_RX_vect) {
-	buf_store(CAT(UDR, SERIAL_PORT,), &rx);
+	if ( CAT(UCSR, SERIAL_PORT, A) & _BV(CAT(DOR, SERIAL_PORT,)) ) {
+		rx_overruns++;
+	}
+	if ( !buf_store(CAT(UDR, SERIAL_PORT,), &rx) ) {
+		rx_dropped++;
+	} else if ( buf_available(&rx) >= SERIAL_RX_STOP ) {
+		SERIAL_CTS_PORT |= _BV(SERIAL_CTS_P);
+	}
 }
 
 ISR(USART_UDRE_vect) {
 	if ( buf_available(&tx) ) {
+		CAT(UCSR, SERIAL_PORT, A) |= _BV(CAT(TXC, SERIAL_PORT,));
 		CAT(UDR, SERIAL_PORT,) = buf_get(&tx);
+		tx_used = 1;
 	} else {
 		CAT(UCSR, SERIAL_PORT, B) &= ~_BV(UDRIE0);
 	}
@@ -39,50 +60,76 @@ ISR(USART_UDRE_vect) {
 
 void serial_flush(void) {
 	while ( tx.start != tx.end );
-	tx.start = 0;
-	tx.end = 0;
-	rx.start = 0;
-	rx.end = 0;
+	serial_flush_rx();
 }
 
 void serial_flush_rx(void) {
-	rx.start = 0;
-	rx.end = 0;
+	rx.start = rx.end;
+	SERIAL_CTS_PORT &= ~_BV(SERIAL_CTS_P);
 }
 
-void serial_init(uint16_t baud) {
-	serial_flush();
+static void serial_ubrr(uint32_t baud) {
 	uint16_t b = ( ( F_CPU / ( baud * 8UL ) ) - 1 );
 	CAT(UBRR, SERIAL_PORT, H) = b >> 8;
 	CAT(UBRR, SERIAL_PORT, L) = b;
+}
+
+void serial_init(uint32_t baud) {
+	SERIAL_CTS_DDR |= _BV(SERIAL_CTS_P);
+	serial_flush();
+	serial_ubrr(baud);
 	CAT(UCSR, SERIAL_PORT, A) |= ( 1 << CAT(U2X, SERIAL_PORT,) );
 	CAT(UCSR, SERIAL_PORT, B) |= ( 1 << CAT(RXEN, SERIAL_PORT,) ) | ( 1 << CAT(TXEN, SERIAL_PORT,) ) | ( 1 << CAT(RXCIE, SERIAL_PORT,) );
 	CAT(UCSR, SERIAL_PORT, C) |= ( 1 << CAT(UCSZ, SERIAL_PORT, 0) ) | ( 1 << CAT(UCSZ, SERIAL_PORT, 1) );
 	sei();
 }
 
+// Changes the rate once everything queued is out, what was received is kept
+void serial_baud(uint32_t baud) {
+	while ( tx.start != tx.end );
+	while ( tx_used && !( CAT(UCSR, SERIAL_PORT, A) & _BV(CAT(TXC, SERIAL_PORT,)) ) );
+	serial_ubrr(baud);
+	frame_rx_n = 0;
+}
+
 void serial_end(void) {
 	serial_flush();
 	CAT(UCSR, SERIAL_PORT, B) = 0;
 }
 	
+// Waits for room if the buffer is full, never to be called with interrupts off
 void serial_put(char c) {
-	buf_store(c, &tx);
+	while ( !buf_store(c, &tx) );
 	CAT(UCSR, SERIAL_PORT, B) |= _BV(CAT(UDRIE, SERIAL_PORT,));
 }
 
 void serial_puts(char *c) {
 	while ( *c ) {
-		buf_store(*c++, &tx);
+		serial_put(*c++);
 	}
-	CAT(UCSR, SERIAL_PORT, B) |= _BV(CAT(UDRIE, SERIAL_PORT,));
 }
 
 void serial_putn(char *c, int l) {
 	while ( l-- ) {
-		buf_store(*c++, &tx);
+		serial_put(*c++);
 	}
-	CAT(UCSR, SERIAL_PORT, B) |= _BV(CAT(UDRIE, SERIAL_PORT,));
+}
+
+// Counters of the ISR, read with interrupts off as they are 16 bits
+uint16_t serial_dropped(void) {
+	uint8_t sreg = SREG;
+	cli();
+	uint16_t n = rx_dropped;
+	SREG = sreg;
+	return n;
+}
+
+uint16_t serial_overruns(void) {
+	uint8_t sreg = SREG;
+	cli();
+	uint16_t n = rx_overruns;
+	SREG = sreg;
+	return n;
 }
 
 int serial_available(void) {
@@ -90,7 +137,11 @@ int serial_available(void) {
 }
 
 char serial_get(void) {
-	return buf_get(&rx);
+	char c = buf_get(&rx);
+	if ( buf_available(&rx) <= SERIAL_RX_GO ) {
+		SERIAL_CTS_PORT &= ~_BV(SERIAL_CTS_P);
+	}
+	return c;
 }
 
 int serial_gets(char *msg, int l) {
@@ -112,3 +163,89 @@ char serial_peek(void) {
 	}
 	return 0;
 }
+
+// Frames of the link, see link_def.h
+
+// COBS encoded with its crc and the 0 at the end
+void serial_put_frame(uint8_t type, uint8_t seq, const void *body, uint8_t len) {
+	uint8_t frame[LINK_FRAME_MAX];
+	uint8_t out[LINK_ENCODED_MAX];
+	uint16_t crc = LINK_CRC_INIT;
+	uint8_t n = 0;
+	frame[n++] = type;
+	frame[n++] = seq;
+	for ( uint8_t i = 0; i < len; i++ ) {
+		frame[n++] = ( (const uint8_t *)body )[i];
+	}
+	for ( uint8_t i = 0; i < n; i++ ) {
+		crc = _crc_ccitt_update(crc, frame[i]);
+	}
+	frame[n++] = crc;
+	frame[n++] = crc >> 8;
+	uint8_t code = 0;
+	uint8_t pos = 1;
+	for ( uint8_t i = 0; i < n; i++ ) {
+		if ( frame[i] == 0 ) {
+			out[code] = pos - code;
+			code = pos++;
+		} else {
+			out[pos++] = frame[i];
+		}
+	}
+	out[code] = pos - code;
+	out[pos++] = 0;
+	serial_putn((char *)out, pos);
+}
+
+// 1 if a good frame was received, -1 if a bad one, 0 if none is complete yet
+int serial_get_frame(serial_frame_t *f) {
+	uint8_t frame[LINK_FRAME_MAX];
+	while ( serial_available() ) {
+		uint8_t c = serial_get();
+		if ( c != 0 ) {
+			if ( frame_rx_n >= 0 && frame_rx_n < LINK_ENCODED_MAX - 1 ) {
+				frame_rx[frame_rx_n++] = c;
+			} else {
+				frame_rx_n = -1;
+			}
+			continue;
+		}
+		int8_t len = frame_rx_n;
+		uint8_t n = 0;
+		frame_rx_n = 0;
+		f->len = 0;
+		if ( len == 0 ) {
+			continue;
+		} else if ( len < 0 ) {
+			return -1;
+		}
+		for ( uint8_t i = 0; i < len; ) {
+			uint8_t code = frame_rx[i++];
+			if ( i + code - 1 > len ) {
+				return -1;
+			}
+			for ( uint8_t j = 1; j < code; j++ ) {
+				frame[n++] = frame_rx[i++];
+			}
+			if ( i < len ) {
+				frame[n++] = 0;
+			}
+		}
+		f->len = n;
+		uint16_t crc = LINK_CRC_INIT;
+		for ( uint8_t i = 0; i + 2 < n; i++ ) {
+			crc = _crc_ccitt_update(crc, frame[i]);
+		}
+		if ( n < 4 || n - 4 > LINK_BODY_MAX || frame[n - 2] != ( crc & 0xFF ) || frame[n - 1] != crc >> 8 ) {
+			return -1;
+		}
+		f->type = frame[0];
+		f->seq = frame[1];
+		f->len = n - 4;
+		for ( uint8_t i = 0; i < f->len; i++ ) {
+			f->body[i] = frame[2 + i];
+		}
+		return 1;
+	}
+	return 0;
+}
@@ -2,34 +2,55 @@
 #define SERIAL_H
 
 #include <stdint.h>
+#include "../link_def.h"
 
 #define SERIAL_PORT 0
 
-#define SERIAL_BUF_SIZE 256
+#define SERIAL_BUF_SIZE 256 // a power of 2, at most 256 for the uint8_t indices
+#define SERIAL_BUF_MASK ( SERIAL_BUF_SIZE - 1 )
+
+// CTS of the Pi, high while the rx buffer is nearly full
+#define SERIAL_CTS_P 2
+#define SERIAL_CTS_DDR DDRD
+#define SERIAL_CTS_PORT PORTD
+#define SERIAL_RX_STOP 192 // bytes in rx when CTS goes high, the Pi may still send a few
+#define SERIAL_RX_GO 64 // and when it goes low again
 
 #define CAT_A(a, b, c) a ## b ## c
 #define CAT(a, b, c) CAT_A(a, b, c)
 
+// One writer and one reader, each moves its own index only, so an ISR never waits
 typedef struct {
 	char buffer[SERIAL_BUF_SIZE];
-	int start;
-	int end;
+	uint8_t start; // moved by the reader
+	uint8_t end; // moved by the writer
 } ring_buffer_t;
 
-void buf_store(char, volatile ring_buffer_t *);
+typedef struct {
+	uint8_t type;
+	uint8_t seq;
+	uint8_t body[LINK_BODY_MAX];
+	uint8_t len; // of the body, of the whole decoded frame if it was bad
+} serial_frame_t;
+
+uint8_t buf_store(char, volatile ring_buffer_t *);
 char buf_get(volatile ring_buffer_t *);
-int buf_available(volatile ring_buffer_t *);
+uint8_t buf_available(volatile ring_buffer_t *);
 
 void serial_flush(void);
 void serial_flush_rx(void);
 
-void serial_init(uint16_t);
+void serial_init(uint32_t);
+void serial_baud(uint32_t);
 void serial_end(void);
 
 void serial_put(char);
 void serial_puts(char *);
 void serial_putn(char *, int l);
 
+uint16_t serial_dropped(void);
+uint16_t serial_overruns(void);
+
 int serial_available(void);
 char serial_wait(void);
 char serial_peek(void);
@@ -37,4 +58,7 @@ char serial_peek(void);
 char serial_get(void);
 int serial_gets(char *, int l);
 
+void serial_put_frame(uint8_t, uint8_t, const void *, uint8_t);
+int serial_get_frame(serial_frame_t *);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,961 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "io.h"
+#include "uart.h"
+#include "control.h"
+#include "bus.h"
+#include "journal.h"
+#include "registry.h"
+#include "discovery.h"
+#include "layout.h"
+#include "interlock.h"
+#include "dispatch.h"
+#include "speed.h"
+#include "rate.h"
+#include "confirm.h"
+#include "group.h"
+#include "handover.h"
+#include "state.h"
+
+typedef struct {
+	int fd;
+	int districts; // TWPC busses of the master, the routes say how many
+	// packets waiting for the link, at most BUS_LINK_WINDOW per district are in the master at once
+	twpc_packet_t queue[BUS_LINK_QUEUE];
+	uint16_t head;
+	uint16_t tail;
+	// interlocking commands, sent before the queue and beyond the window
+	twpc_packet_t urgent[BUS_LINK_URGENT];
+	uint16_t urgent_head;
+	uint16_t urgent_tail;
+	// packets in the master, kept until they are answered
+	twpc_packet_t inflight_queue[BUS_LINK_INFLIGHT];
+	uint8_t inflight_rate[BUS_LINK_INFLIGHT]; // TWPC rate each was sent at, BUS_RATE_PROBE or-ed
+	uint16_t inflight_head;
+	int inflight;
+	uint8_t seq; // of the next packet, the inflight ones are the ones before
+	uint64_t last;
+	uint64_t last_tx; // bus_now() of the last frame to the master
+	// rate, an index of LINK_BAUDS
+	int speed;
+	int speed_top; // highest one of the uart
+	int speed_max; // highest one tried now, lowered for a while when one fails
+	int speed_asked; // LINK_SPEED not answered yet, -1 if none, nothing else is sent meanwhile
+	int speed_drain; // nothing is sent until the master answered everything, then the rate changes
+	uint64_t speed_hold; // bus_now() until nothing is sent after a fall back, 0 if none
+	uint64_t speed_failed; // bus_now() when speed_max was lowered
+	uint64_t speed_window; // bus_now() since the bad frames are counted
+	int speed_errors;
+	// frame of the master being received
+	uart_reader_t reader;
+	// master clock of the sensor events
+	uint16_t tick;
+	uint64_t ticks; // since tick_offset
+	uint64_t tick_offset; // journal_time() of tick 0
+	uint64_t tick_rx; // journal_time() of the last sensor event
+	int adopted; // handed over by the previous server
+	uint64_t sent;
+	uint64_t replies;
+	uint64_t errors;
+	uint64_t timeouts;
+	uint64_t overflows;
+	uint64_t received; // bytes from the master
+	uint16_t master_stats[5]; // last LINK_STATS of the master
+} bus_link_t;
+
+// A link as handed over to the next server process: what is waiting, what is in the master
+typedef struct {
+	uint16_t queued;
+	uint16_t urgent;
+	uint16_t inflight;
+	twpc_packet_t queue[BUS_LINK_QUEUE];
+	twpc_packet_t urgent_queue[BUS_LINK_URGENT];
+	twpc_packet_t inflight_queue[BUS_LINK_INFLIGHT];
+	uint8_t inflight_rate[BUS_LINK_INFLIGHT];
+	uint8_t seq;
+	int8_t speed; // -1 if a LINK_SPEED was not answered
+	uart_reader_t reader;
+	uint16_t tick;
+	uint64_t ticks;
+	uint64_t tick_offset;
+	uint64_t tick_rx;
+} bus_link_state_t;
+
+typedef struct {
+	pthread_t thread;
+	volatile int running;
+	io_t *io;
+	queue_t cmds;
+	queue_t *workers[BUS_MAX_WORKERS];
+	int workers_n;
+	bus_link_t links[UART_MAX_LINKS];
+	int links_n;
+	uint8_t route[256]; // uid -> link
+	uint8_t district[256]; // uid -> district of its link
+	int batch; // commands of the clients are being taken, the links are pumped after the last one
+	uint64_t commands;
+	uint64_t events;
+	uint64_t dropped;
+	uint64_t rx_time; // journal_time() of the last uart read
+	uint64_t sensors;
+	uint64_t sensor_latency; // worst uart read to occupancy update, ns
+} bus_t;
+
+static bus_t bus;
+static const int bus_bauds[LINK_BAUDS_N] = LINK_BAUDS;
+
+static uint64_t bus_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static void bus_link_import(bus_link_t *l, const char *data, int len) {
+	const bus_link_state_t *state = (const bus_link_state_t *)data;
+	if ( len != sizeof(bus_link_state_t) || state->queued > BUS_LINK_QUEUE || state->urgent > BUS_LINK_URGENT
+		|| state->inflight > BUS_LINK_INFLIGHT ) {
+		return;
+	}
+	memcpy(l->queue, state->queue, state->queued * sizeof(twpc_packet_t));
+	l->head = state->queued;
+	memcpy(l->urgent, state->urgent_queue, state->urgent * sizeof(twpc_packet_t));
+	l->urgent_head = state->urgent;
+	memcpy(l->inflight_queue, state->inflight_queue, state->inflight * sizeof(twpc_packet_t));
+	memcpy(l->inflight_rate, state->inflight_rate, state->inflight);
+	l->inflight_head = state->inflight;
+	l->inflight = state->inflight;
+	l->seq = state->seq;
+	l->last = bus_now();
+	if ( state->speed < 0 || state->speed >= LINK_BAUDS_N ) { // the master may have switched or not
+		uart_baud(l - bus.links, bus_bauds[0]);
+		l->speed_hold = l->last + BUS_SPEED_HOLD;
+	} else {
+		l->speed = state->speed;
+		l->speed_top = l->speed > l->speed_top ? l->speed : l->speed_top;
+	}
+	l->reader = state->reader;
+	if ( l->reader.n >= LINK_ENCODED_MAX ) {
+		l->reader.n = -1;
+	}
+	l->tick = state->tick;
+	l->ticks = state->ticks;
+	l->tick_offset = state->tick_offset;
+	l->tick_rx = state->tick_rx;
+	l->adopted = 1;
+}
+
+static void bus_link_export(bus_link_t *l, bus_link_state_t *state) {
+	memset(state, 0, sizeof(bus_link_state_t));
+	while ( l->head != l->tail ) {
+		state->queue[state->queued++] = l->queue[l->tail++ % BUS_LINK_QUEUE];
+	}
+	while ( l->urgent_head != l->urgent_tail ) {
+		state->urgent_queue[state->urgent++] = l->urgent[l->urgent_tail++ % BUS_LINK_URGENT];
+	}
+	for ( int i = l->inflight; i > 0; i-- ) {
+		state->inflight_rate[state->inflight] = l->inflight_rate[(uint16_t)( l->inflight_head - i ) % BUS_LINK_INFLIGHT];
+		state->inflight_queue[state->inflight++] = l->inflight_queue[(uint16_t)( l->inflight_head - i ) % BUS_LINK_INFLIGHT];
+	}
+	state->seq = l->seq;
+	state->speed = l->speed_asked >= 0 ? -1 : l->speed;
+	state->reader = l->reader;
+	state->tick = l->tick;
+	state->ticks = l->ticks;
+	state->tick_offset = l->tick_offset;
+	state->tick_rx = l->tick_rx;
+}
+
+int bus_init(int backend) {
+	memset(&bus, 0, sizeof(bus_t));
+	if ( queue_init(&bus.cmds, sizeof(bus_cmd_t), BUS_QUEUE_SIZE) < 0 ) {
+		return -1;
+	}
+	bus.io = io_create(backend);
+	if ( bus.io == NULL ) {
+		queue_free(&bus.cmds);
+		return -1;
+	}
+	io_add(bus.io, bus.cmds.fd, IO_FD_STREAM);
+	bus.links_n = uart_links();
+	for ( int i = 0; i < bus.links_n; i++ ) {
+		bus_link_t *l = &bus.links[i];
+		l->fd = uart_fd(i);
+		l->districts = 1;
+		io_add(bus.io, l->fd, IO_FD_STREAM);
+		while ( l->speed_top + 1 < LINK_BAUDS_N && bus_bauds[l->speed_top + 1] <= uart_baud_max(i) ) {
+			l->speed_top++;
+		}
+		handover_record_t *r = handover_find(HANDOVER_LINK, uart_path(i));
+		if ( r != NULL && r->fd == l->fd ) {
+			bus_link_import(l, r->data, r->len);
+		}
+		l->speed_max = l->speed_top;
+		l->speed_asked = -1;
+	}
+	return 0;
+}
+
+// Devices from uid lo to hi (inclusive) are reached through district of link
+int bus_route(int lo, int hi, int link, int district) {
+	if ( lo < 0 || hi > 254 || lo > hi || link < 0 || link >= bus.links_n || district < 0 || district >= LINK_DISTRICTS_MAX ) {
+		return -1;
+	}
+	for ( int uid = lo; uid <= hi; uid++ ) {
+		bus.route[uid] = link;
+		bus.district[uid] = district;
+	}
+	if ( district >= bus.links[link].districts ) {
+		bus.links[link].districts = district + 1;
+	}
+	return 0;
+}
+
+int bus_attach(queue_t *q) {
+	if ( bus.workers_n == BUS_MAX_WORKERS ) {
+		return -1;
+	}
+	bus.workers[bus.workers_n++] = q;
+	return 0;
+}
+
+int bus_submit(const bus_cmd_t *cmd) {
+	return queue_push(&bus.cmds, cmd);
+}
+
+static void bus_broadcast(bus_event_t *ev) {
+	bus.events++;
+	for ( int i = 0; i < bus.workers_n; i++ ) {
+		if ( queue_push(bus.workers[i], ev) < 0 ) {
+			bus.dropped++;
+		}
+	}
+}
+
+static void bus_refused(int link, twpc_packet_t *packet) {
+	bus_event_t ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.type = BUS_EV_REFUSED;
+	ev.link = link;
+	ev.packet = *packet;
+	bus_broadcast(&ev);
+	dispatch_reply(packet, 0);
+}
+
+// District bit of a device for the master, 0 (all of them) if the master has one or for everybody
+static int bus_district(int link, int uid) {
+	if ( bus.links[link].districts < 2 || uid == 0 || uid == 255 ) {
+		return 0;
+	}
+	return LINK_DISTRICT(bus.district[uid]);
+}
+
+// Writes a packet to the master and keeps it until it is answered, returns its journal_time()
+static uint64_t bus_transmit(int link, twpc_packet_t *packet, int rate, int probe, int districts) {
+	bus_link_t *l = &bus.links[link];
+	char frame[LINK_ENCODED_MAX];
+	uint8_t body[sizeof(twpc_packet_t) + 1];
+	uint64_t time = journal_time();
+	memcpy(body, packet, sizeof(twpc_packet_t));
+	body[sizeof(twpc_packet_t)] = rate | districts;
+	journal_write(time, JOURNAL_TX, link, 0, rate, packet->data_raw);
+	io_send(bus.io, l->fd, frame, uart_frame(frame, LINK_PACKET, l->seq++, body, body[sizeof(twpc_packet_t)] > 0 ? sizeof(body) : sizeof(twpc_packet_t)));
+	l->inflight_rate[l->inflight_head % BUS_LINK_INFLIGHT] = rate | ( probe ? BUS_RATE_PROBE : 0 );
+	l->inflight_queue[l->inflight_head++ % BUS_LINK_INFLIGHT] = *packet;
+	l->inflight++;
+	l->sent++;
+	l->last = bus_now();
+	l->last_tx = l->last;
+	return time;
+}
+
+// Members of a group routed to the link
+static int bus_group_members(int link, int group, uint8_t *uids) {
+	int n = 0;
+	int all = group_members(group, uids);
+	for ( int i = 0; i < all; i++ ) {
+		if ( bus.route[uids[i]] == link ) {
+			uids[n++] = uids[i];
+		}
+	}
+	return n;
+}
+
+// A group packet is the same packet to each member on the link: the interlocking checks every one
+// and refuses all of them if it would refuse or change one, it goes at the rate of the slowest member
+// on the districts of the members
+static void bus_send_group(int link, twpc_packet_t *packet) {
+	uint8_t uids[256];
+	twpc_packet_t member = *packet;
+	int n = bus_group_members(link, packet->uid - TWPC_GROUP_FIRST, uids);
+	int rate = TWPC_RATES - 1;
+	int districts = 0;
+	if ( n == 0 ) {
+		return;
+	}
+	for ( int i = 0; i < n; i++ ) {
+		member.uid = uids[i];
+		if ( !interlock_unchanged(&member) ) {
+			bus_refused(link, packet);
+			return;
+		}
+		rate = rate_get(uids[i]) < rate ? rate_get(uids[i]) : rate;
+		districts |= bus_district(link, uids[i]);
+	}
+	packet->checksum = TWPC_CHECKSUM(*packet) | TWPC_NO_REPLY;
+	uint64_t time = bus_transmit(link, packet, rate, 0, districts);
+	for ( int i = 0; i < n; i++ ) {
+		member.uid = uids[i];
+		member.checksum = TWPC_CHECKSUM(member);
+		interlock_check(&member);
+		if ( member.cmd == TWPC_CMD_MOTOR_A || member.cmd == TWPC_CMD_MOTOR_B ) {
+			speed_sent(&member, time);
+		}
+	}
+	group_sent(n);
+}
+
+// The interlocking has the last word on every packet, probe: 1 to try the next rate of the device,
+// quiet: 1 to leave out the reply if the device can
+static void bus_send(int link, twpc_packet_t *packet, int probe, int quiet) {
+	if ( TWPC_IS_GROUP(packet->uid) ) {
+		bus_send_group(link, packet);
+		return;
+	}
+	if ( interlock_check(packet) < 0 ) {
+		bus_refused(link, packet);
+		return;
+	}
+	if ( quiet && confirm_quiet(packet) ) {
+		packet->checksum |= TWPC_NO_REPLY;
+	}
+	uint64_t time = bus_transmit(link, packet, rate_get(packet->uid) + probe, probe, bus_district(link, packet->uid));
+	if ( packet->cmd == TWPC_CMD_MOTOR_A || packet->cmd == TWPC_CMD_MOTOR_B ) {
+		speed_sent(packet, time);
+	}
+}
+
+// A light or motor packet at the head of the queue takes the same packet of the other members
+// of a group along, if every member on the link has one queued as its first. The group with the
+// most members wins, returns the group packet or 0 (uid 0 is not a group).
+static uint8_t bus_collapse(int link, twpc_packet_t *packet) {
+	bus_link_t *l = &bus.links[link];
+	uint16_t first[TWPC_GROUP_FIRST]; // uid -> queue position of its first packet, l->head if none
+	uint8_t uids[256];
+	int best = -1;
+	int best_n = 1;
+	if ( !confirm_quiet(packet) || !interlock_unchanged(packet) ) {
+		return 0;
+	}
+	for ( int uid = 0; uid < TWPC_GROUP_FIRST; uid++ ) {
+		first[uid] = l->head;
+	}
+	for ( uint16_t i = l->tail; i != l->head; i++ ) {
+		twpc_packet_t *p = &l->queue[i % BUS_LINK_QUEUE];
+		if ( p->uid < TWPC_GROUP_FIRST && first[p->uid] == l->head ) {
+			first[p->uid] = i;
+		}
+	}
+	for ( int group = 0; group < TWPC_GROUPS; group++ ) {
+		int n = bus_group_members(link, group, uids);
+		int all = n > best_n;
+		for ( int i = 0; i < n && all; i++ ) {
+			twpc_packet_t *p = &l->queue[first[uids[i]] % BUS_LINK_QUEUE];
+			all = uids[i] == packet->uid || ( first[uids[i]] != l->head && p->cmd == packet->cmd && p->arg == packet->arg
+				&& interlock_unchanged(p) );
+		}
+		if ( all && memchr(uids, packet->uid, n) != NULL ) {
+			best = group;
+			best_n = n;
+		}
+	}
+	if ( best < 0 ) {
+		return 0;
+	}
+	bus_group_members(link, best, uids);
+	for ( int i = 0; i < best_n; i++ ) {
+		if ( uids[i] != packet->uid ) {
+			l->queue[first[uids[i]] % BUS_LINK_QUEUE].data_raw = 0;
+		}
+	}
+	return TWPC_GROUP_UID(best);
+}
+
+static void bus_pump(int link) {
+	bus_link_t *l = &bus.links[link];
+	if ( l->speed_asked >= 0 || l->speed_drain || l->speed_hold != 0 ) {
+		return;
+	}
+	while ( l->inflight < BUS_LINK_INFLIGHT && l->urgent_head != l->urgent_tail ) {
+		bus_send(link, &l->urgent[l->urgent_tail++ % BUS_LINK_URGENT], 0, 0);
+	}
+	while ( l->inflight < BUS_LINK_WINDOW * l->districts && l->head != l->tail ) {
+		twpc_packet_t *packet = &l->queue[l->tail++ % BUS_LINK_QUEUE];
+		if ( packet->data_raw == 0 ) {
+			continue; // went with a group packet
+		}
+		uint8_t group = bus_collapse(link, packet);
+		if ( group != 0 ) {
+			packet->uid = group;
+		}
+		bus_send(link, packet, 0, 1);
+	}
+}
+
+static void bus_queue(int link, twpc_packet_t *packet) {
+	bus_link_t *l = &bus.links[link];
+	if ( (uint16_t)( l->head - l->tail ) >= BUS_LINK_QUEUE ) {
+		l->overflows++;
+		return;
+	}
+	l->queue[l->head++ % BUS_LINK_QUEUE] = *packet;
+	if ( !bus.batch ) {
+		bus_pump(link);
+	}
+}
+
+// Interlocking command: goes out right away, ahead of everything queued
+static void bus_urgent(twpc_packet_t *packet) {
+	if ( bus.links_n == 0 ) {
+		return;
+	}
+	bus_link_t *l = &bus.links[bus.route[packet->uid]];
+	if ( (uint16_t)( l->urgent_head - l->urgent_tail ) >= BUS_LINK_URGENT ) {
+		l->overflows++;
+		return;
+	}
+	l->urgent[l->urgent_head++ % BUS_LINK_URGENT] = *packet;
+	bus_pump(bus.route[packet->uid]);
+}
+
+static void bus_dispatch(twpc_packet_t *packet) {
+	if ( packet->uid == 255 || TWPC_IS_GROUP(packet->uid) ) { // a group packet is dropped on links without members
+		for ( int i = 0; i < bus.links_n; i++ ) {
+			bus_queue(i, packet);
+		}
+	} else if ( bus.links_n > 0 ) {
+		bus_queue(bus.route[packet->uid], packet);
+	}
+}
+
+// Fields of the state stream from the registry entry of a device
+static void bus_device_state(int uid) {
+	registry_device_t d;
+	if ( registry_get(uid, &d) == 0 ) {
+		state_set(uid, STATE_PRESENT, d.present);
+		state_set(uid, STATE_FLAGS, d.state);
+		state_set(uid, STATE_SPEED, d.speed);
+	}
+}
+
+static void bus_device_changed(int uid, int link) {
+	bus_event_t ev;
+	bus_device_state(uid);
+	memset(&ev, 0, sizeof(ev));
+	ev.type = BUS_EV_DEVICE;
+	ev.link = link;
+	ev.packet.uid = uid;
+	bus_broadcast(&ev);
+}
+
+static void bus_speed_measured(int train, int mms) {
+	bus_event_t ev;
+	state_set(train, STATE_MMS, mms > 0xFFFF ? 0xFFFF : mms);
+	memset(&ev, 0, sizeof(ev));
+	ev.type = BUS_EV_SPEED;
+	ev.packet.uid = train;
+	ev.packet.cmd = mms > 0xFFFF ? 0xFF : mms >> 8;
+	ev.packet.arg = mms > 0xFFFF ? 0xFF : mms & 0xFF;
+	bus_broadcast(&ev);
+}
+
+static void bus_route_changed(int train, int route, int state) {
+	bus_event_t ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.type = BUS_EV_ROUTE;
+	ev.packet.uid = train;
+	ev.packet.cmd = route;
+	ev.packet.arg = state;
+	bus_broadcast(&ev);
+}
+
+// A packet which has no answer, counted and told to the clients
+static void bus_error(int link, twpc_packet_t *request) {
+	bus_event_t ev;
+	bus.links[link].errors++;
+	journal_write(journal_time(), JOURNAL_ERROR, link, 0, 0, request->data_raw);
+	memset(&ev, 0, sizeof(ev));
+	ev.type = BUS_EV_ERROR;
+	ev.link = link;
+	bus_broadcast(&ev);
+	dispatch_reply(request, 0);
+}
+
+// A packet the master will not answer
+static void bus_lost(int link, twpc_packet_t *request) {
+	bus_error(link, request);
+	discovery_abort(link);
+}
+
+// A packet its device did not answer at its rate goes again first, at the lower one,
+// unless a later packet to the device is in the master already
+static void bus_retry(int link, twpc_packet_t *request) {
+	bus_link_t *l = &bus.links[link];
+	for ( int i = l->inflight; i > 0; i-- ) {
+		if ( l->inflight_queue[(uint16_t)( l->inflight_head - i ) % BUS_LINK_INFLIGHT].uid == request->uid ) {
+			bus_lost(link, request);
+			return;
+		}
+	}
+	if ( (uint16_t)( l->urgent_head - l->urgent_tail ) >= BUS_LINK_URGENT ) {
+		bus_lost(link, request);
+		return;
+	}
+	l->urgent[--l->urgent_tail % BUS_LINK_URGENT] = *request;
+}
+
+// Tries the next rate of a device with a packet which changes nothing
+static void bus_probe(int link, int uid) {
+	bus_link_t *l = &bus.links[link];
+	twpc_packet_t packet;
+	if ( l->inflight >= BUS_LINK_INFLIGHT || l->speed_asked >= 0 || l->speed_drain || l->speed_hold != 0 ) {
+		return; // the device is tried again later
+	}
+	packet.uid = uid;
+	packet.cmd = TWPC_CMD_STATUS;
+	packet.arg = 0;
+	packet.checksum = TWPC_CHECKSUM(packet);
+	bus_send(link, &packet, 1, 0);
+}
+
+// Each member heard the group packet the way it hears a quiet one of its own
+static void bus_group_sent(int link, twpc_packet_t *request) {
+	uint8_t uids[256];
+	twpc_packet_t member = *request;
+	int n = bus_group_members(link, request->uid - TWPC_GROUP_FIRST, uids);
+	for ( int i = 0; i < n; i++ ) {
+		member.uid = uids[i];
+		confirm_sent(&member, bus_now());
+	}
+}
+
+// Answer to the packet of seq, NULL if the master lost it,
+// packets sent before it which had no answer are lost as well
+static void bus_answered(int link, int seq, twpc_packet_t *reply) {
+	bus_link_t *l = &bus.links[link];
+	int behind = (uint8_t)( seq - (uint8_t)( l->seq - l->inflight ) );
+	if ( behind >= l->inflight ) {
+		return; // not waiting for it (any more)
+	}
+	for ( ; behind >= 0; behind-- ) {
+		uint16_t i = (uint16_t)( l->inflight_head - l->inflight ) % BUS_LINK_INFLIGHT;
+		twpc_packet_t request = l->inflight_queue[i];
+		int rate = l->inflight_rate[i] & ~BUS_RATE_PROBE;
+		int probe = l->inflight_rate[i] & BUS_RATE_PROBE;
+		l->inflight--;
+		int good = reply != NULL && reply->uid == request.uid && reply->checksum == TWPC_CHECKSUM(*reply);
+		if ( behind > 0 || reply == NULL ) {
+			bus_lost(link, &request);
+		} else if ( TWPC_IS_GROUP(request.uid) ) {
+			bus_group_sent(link, &request);
+		} else if ( request.checksum & TWPC_NO_REPLY ) { // the probe has a reply, only it moves the device up
+			confirm_sent(&request, bus_now());
+			if ( rate_answered(request.uid, rate, 1, bus_now()) ) {
+				bus_probe(link, request.uid);
+			}
+		} else if ( discovery_reply(link, &request, reply) ) {
+			return;
+		} else if ( rate > 0 && !good ) { // too fast for the device, or noise
+			rate_answered(request.uid, rate, 0, bus_now());
+			if ( !probe ) {
+				bus_retry(link, &request);
+			}
+		} else if ( reply->data_raw == 0 ) {
+			confirm_reply(&request, reply);
+			dispatch_reply(&request, 0);
+			if ( registry_lost(request.uid) ) {
+				bus_device_changed(request.uid, link);
+			}
+		} else {
+			if ( good && rate_answered(request.uid, rate, 1, bus_now()) ) {
+				bus_probe(link, request.uid);
+			}
+			if ( good ) {
+				confirm_reply(&request, reply);
+				group_reply(&request, reply, bus_now());
+			}
+			dispatch_reply(&request, good);
+			if ( good && registry_seen(link, &request, reply) ) { // a broken reply would make up a device
+				bus_device_changed(reply->uid, link);
+			}
+		}
+	}
+}
+
+// Master tick of a sensor event to journal_time(): exact between the events of a link,
+// shifted by the smallest delay seen between an event and its uart read
+static uint64_t bus_tick_time(bus_link_t *l, uint16_t tick) {
+	if ( l->tick_rx == 0 || bus.rx_time - l->tick_rx > BUS_TICK_RESYNC * 1000000ULL ) {
+		l->ticks = 0;
+		l->tick_offset = bus.rx_time;
+	} else {
+		l->ticks += (uint16_t)( tick - l->tick );
+		uint64_t time = l->tick_offset + l->ticks * BUS_TICK_NS;
+		if ( time > bus.rx_time ) {
+			l->tick_offset -= time - bus.rx_time;
+		}
+	}
+	l->tick = tick;
+	l->tick_rx = bus.rx_time;
+	return l->tick_offset + l->ticks * BUS_TICK_NS;
+}
+
+// Onewire event: the occupancy is updated before anything else
+static void bus_sensor(int link, int pin, int train, uint16_t tick) {
+	bus_event_t ev;
+	uint64_t time = bus_tick_time(&bus.links[link], tick);
+	int from;
+	int to;
+	int moved = layout_sensor(link, pin, train, time, &from, &to);
+	uint64_t latency = journal_time() - bus.rx_time;
+	bus.sensors++;
+	if ( latency > bus.sensor_latency ) {
+		bus.sensor_latency = latency;
+	}
+	if ( moved ) {
+		state_set(train, STATE_BLOCK, to);
+		interlock_moved(train, to);
+		speed_moved(train, from, to, time);
+		dispatch_moved(train, to);
+	}
+	journal_write(time, JOURNAL_SENSOR, link, 0, train, pin);
+	memset(&ev, 0, sizeof(ev));
+	ev.type = BUS_EV_SENSOR;
+	ev.link = link;
+	ev.sensor = train;
+	ev.pin = pin;
+	bus_broadcast(&ev);
+	if ( moved ) {
+		ev.type = BUS_EV_BLOCK;
+		ev.packet.uid = train;
+		ev.packet.cmd = from;
+		ev.packet.arg = to;
+		bus_broadcast(&ev);
+	}
+}
+
+// Asks the master for a rate, or to confirm the one it has
+static void bus_speed_ask(int link, int speed) {
+	bus_link_t *l = &bus.links[link];
+	char frame[LINK_ENCODED_MAX];
+	uint8_t body = speed;
+	l->speed_asked = speed;
+	l->last_tx = bus_now();
+	io_send(bus.io, l->fd, frame, uart_frame(frame, LINK_SPEED, 0, &body, 1));
+}
+
+// The master switches after its answer, the new rate is confirmed before anything else goes out
+static void bus_speed_answered(int link, int speed) {
+	bus_link_t *l = &bus.links[link];
+	l->speed_asked = -1;
+	if ( speed != l->speed ) {
+		uart_baud(link, bus_bauds[speed]);
+		printf("Link %d: %d baud\n", link, bus_bauds[speed]);
+		l->speed = speed;
+		bus_speed_ask(link, speed);
+	}
+}
+
+// No answer: both ends fall back to the first rate, the master once it heard nothing for
+// LINK_SPEED_TIMEOUT, so nothing is sent for a while
+static void bus_speed_failed(int link, uint64_t now) {
+	bus_link_t *l = &bus.links[link];
+	int failed = l->speed_asked > l->speed ? l->speed_asked : l->speed;
+	printf("Link %d: no answer at %d baud, back to %d\n", link, bus_bauds[failed], bus_bauds[0]);
+	if ( failed > 0 ) {
+		l->speed_max = failed - 1;
+		l->speed_failed = now;
+	}
+	uart_baud(link, bus_bauds[0]);
+	l->speed = 0;
+	l->speed_asked = -1;
+	l->speed_hold = now + BUS_SPEED_HOLD;
+}
+
+// Rate of a link: up to speed_max, one slower after too many bad frames, kept alive when idle
+static void bus_speed_check(int link, uint64_t now) {
+	bus_link_t *l = &bus.links[link];
+	int want = -1;
+	if ( l->speed_asked >= 0 ) {
+		if ( now - l->last_tx > BUS_SPEED_WAIT ) {
+			bus_speed_failed(link, now);
+		}
+		return;
+	} else if ( l->speed_hold != 0 && now < l->speed_hold ) {
+		return;
+	}
+	l->speed_hold = 0;
+	if ( now - l->speed_window > BUS_SPEED_WINDOW ) {
+		l->speed_window = now;
+		l->speed_errors = 0;
+	}
+	if ( l->speed_max < l->speed_top && now - l->speed_failed > BUS_SPEED_RETRY ) {
+		l->speed_max = l->speed_top;
+	}
+	if ( l->speed > 0 && l->speed_errors >= BUS_SPEED_ERRORS ) {
+		want = l->speed - 1;
+	} else if ( l->speed < l->speed_max ) {
+		want = l->speed_max;
+	}
+	l->speed_drain = want >= 0;
+	if ( l->inflight > 0 ) {
+		return;
+	} else if ( want >= 0 && want < l->speed ) {
+		printf("Link %d: %d bad frames at %d baud\n", link, l->speed_errors, bus_bauds[l->speed]);
+		l->speed_max = want;
+		l->speed_failed = now;
+		l->speed_errors = 0;
+		bus_speed_ask(link, want);
+	} else if ( want >= 0 ) {
+		bus_speed_ask(link, want);
+	} else if ( l->speed > 0 && now - l->last_tx > BUS_SPEED_KEEPALIVE ) {
+		bus_speed_ask(link, l->speed);
+	} else {
+		bus_pump(link);
+	}
+}
+
+// Master output: frames of link_def.h, a bad one is only counted, what it carried shows up missing
+static void bus_parse(int link, char c) {
+	bus_link_t *l = &bus.links[link];
+	bus_event_t ev;
+	uart_frame_t f;
+	int result = uart_unframe(&l->reader, c, &f);
+	if ( result < 0 ) {
+		l->errors++;
+		l->speed_errors++;
+		journal_write(journal_time(), JOURNAL_ERROR, link, 0, 0, 0);
+		return;
+	} else if ( result == 0 ) {
+		return;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.link = link;
+	if ( f.type == LINK_REPLY && f.len == sizeof(twpc_packet_t) ) {
+		ev.type = BUS_EV_REPLY;
+		memcpy(&ev.packet, f.body, sizeof(twpc_packet_t));
+		journal_write(journal_time(), JOURNAL_REPLY, link, 0, 0, ev.packet.data_raw);
+		bus_broadcast(&ev);
+		l->replies++;
+		bus_answered(link, f.seq, &ev.packet);
+	} else if ( f.type == LINK_LOST ) {
+		bus_answered(link, f.seq, NULL);
+	} else if ( f.type == LINK_SENT ) {
+		memset(&ev.packet, 0, sizeof(twpc_packet_t));
+		journal_write(journal_time(), JOURNAL_SENT, link, 0, 0, 0);
+		bus_answered(link, f.seq, &ev.packet);
+	} else if ( f.type == LINK_SENSOR && f.len == 4 ) {
+		bus_sensor(link, f.body[0], f.body[1], f.body[2] | f.body[3] << 8);
+	} else if ( f.type == LINK_STATS && f.len == 10 ) {
+		for ( int i = 0; i < 5; i++ ) {
+			l->master_stats[i] = f.body[2 * i] | f.body[2 * i + 1] << 8;
+		}
+	} else if ( f.type == LINK_SPEED && f.len == 1 && f.body[0] == l->speed_asked ) {
+		bus_speed_answered(link, f.body[0]);
+	}
+}
+
+static void bus_timeouts(void) {
+	uint64_t now = bus_now();
+	for ( int i = 0; i < bus.links_n; i++ ) {
+		bus_link_t *l = &bus.links[i];
+		if ( l->inflight > 0 && now - l->last > BUS_LINK_TIMEOUT ) {
+			l->timeouts++;
+			journal_write(journal_time(), JOURNAL_TIMEOUT, i, 0, 0, 0);
+			for ( ; l->inflight > 0; l->inflight-- ) { // lost, discovery is tried again once for all of them
+				bus_error(i, &l->inflight_queue[(uint16_t)( l->inflight_head - l->inflight ) % BUS_LINK_INFLIGHT]);
+			}
+			discovery_abort(i);
+			bus_pump(i);
+		}
+		bus_speed_check(i, now);
+	}
+	confirm_tick(now);
+}
+
+static void bus_command(bus_cmd_t *cmd) {
+	bus.commands++;
+	journal_write(cmd->time, JOURNAL_CMD, 0, cmd->worker, 0, cmd->packet.data_raw);
+	if ( cmd->packet.cmd == TWPC_CMD_DISCOVER && cmd->packet.arg == DISCOVERY_ALL ) {
+		for ( int i = 0; i < bus.links_n; i++ ) {
+			discovery_start(i);
+		}
+	} else if ( cmd->packet.cmd >= DISPATCH_CMD && cmd->packet.cmd < DISPATCH_CMD + DISPATCH_ROUTES ) {
+		dispatch_request(cmd->packet.uid, cmd->packet.cmd - DISPATCH_CMD, cmd->packet.arg * SPEED_UNIT);
+	} else if ( cmd->packet.cmd == SPEED_CMD || cmd->packet.cmd == SPEED_CMD + 1 ) {
+		speed_set(cmd->packet.uid, cmd->packet.cmd - SPEED_CMD, cmd->packet.arg * SPEED_UNIT);
+	} else {
+		bus_dispatch(&cmd->packet);
+	}
+}
+
+static void *bus_thread(void *arg) {
+	io_event_t events[IO_MAX_EVENTS];
+	bus_cmd_t cmd;
+	discovery_init(bus_queue, bus_device_changed);
+	for ( int i = 0; i < bus.links_n; i++ ) {
+		if ( !bus.links[i].adopted ) {
+			discovery_start(i);
+		}
+	}
+	while ( bus.running ) {
+		int timeout = state_timeout(bus_now());
+		int n = io_wait(bus.io, events, IO_MAX_EVENTS, timeout >= 0 && timeout < 100 ? timeout : 100);
+		for ( int i = 0; i < n; i++ ) {
+			io_event_t *ev = &events[i];
+			int link = uart_link(ev->fd);
+			if ( ev->fd == bus.cmds.fd ) {
+				queue_rearm(&bus.cmds);
+				bus.batch = 1; // all of them queued first, so that bus_collapse sees them together
+				while ( queue_pop(&bus.cmds, &cmd) ) {
+					bus_command(&cmd);
+				}
+				bus.batch = 0;
+				for ( int j = 0; j < bus.links_n; j++ ) {
+					bus_pump(j);
+				}
+			} else if ( link >= 0 && ev->type == IO_EV_CLOSE ) {
+				printf("UART %s closed\n", uart_path(link));
+			} else if ( link >= 0 ) {
+				bus.rx_time = journal_time();
+				bus.links[link].received += ev->len;
+				for ( int j = 0; j < ev->len; j++ ) {
+					bus_parse(link, ev->data[j]);
+				}
+				bus.links[link].last = bus_now();
+				bus_pump(link);
+			}
+		}
+		bus_timeouts();
+		dispatch_tick(bus_now());
+		uint32_t version = state_tick(bus_now());
+		if ( version != 0 ) {
+			bus_event_t ev;
+			memset(&ev, 0, sizeof(ev));
+			ev.type = BUS_EV_STATE;
+			ev.packet.data_raw = version;
+			bus_broadcast(&ev);
+		}
+	}
+	return NULL;
+}
+
+// Trains of the previous server, only if it ran the same layout
+static void bus_adopt(void) {
+	handover_record_t *r = handover_find(HANDOVER_STATE, "layout");
+	if ( r == NULL || layout_restore(r->data, r->len) < 0 ) {
+		return;
+	}
+	if ( ( r = handover_find(HANDOVER_STATE, "interlock") ) != NULL ) {
+		interlock_restore(r->data, r->len);
+	}
+	if ( ( r = handover_find(HANDOVER_STATE, "speed") ) != NULL ) {
+		speed_restore(r->data, r->len);
+	}
+	if ( ( r = handover_find(HANDOVER_STATE, "dispatch") ) != NULL ) {
+		dispatch_restore(r->data, r->len);
+	}
+}
+
+int bus_start(void) {
+	interlock_init(bus_urgent);
+	speed_init(bus_dispatch, bus_speed_measured);
+	rate_init();
+	confirm_init(bus_dispatch, bus_urgent);
+	group_init(bus_dispatch);
+	dispatch_init(bus_dispatch, bus_route_changed, bus_now());
+	bus_adopt();
+	state_init();
+	for ( int uid = 1; uid < 255; uid++ ) {
+		bus_device_state(uid);
+		state_set(uid, STATE_BLOCK, layout_position(uid));
+	}
+	bus.running = 1;
+	if ( pthread_create(&bus.thread, NULL, bus_thread, NULL) != 0 ) {
+		bus.running = 0;
+		return -1;
+	}
+	return 0;
+}
+
+// Counters of the running bus thread, for the c message
+void bus_counters(uint64_t *syscalls, uint64_t *idle, uint64_t *commands) {
+	*syscalls = __atomic_load_n(&bus.io->stats.syscalls, __ATOMIC_RELAXED);
+	*idle = __atomic_load_n(&bus.io->stats.idle, __ATOMIC_RELAXED);
+	*commands = __atomic_load_n(&bus.commands, __ATOMIC_RELAXED);
+}
+
+void bus_stop(void) {
+	if ( bus.running ) {
+		bus.running = 0;
+		queue_wake(&bus.cmds);
+		pthread_join(bus.thread, NULL);
+	}
+	printf("bus: %llu syscalls, %llu commands, %llu events, %llu dropped\n", (unsigned long long)bus.io->stats.syscalls,
+		(unsigned long long)bus.commands, (unsigned long long)bus.events, (unsigned long long)bus.dropped);
+	if ( bus.sensors > 0 ) {
+		printf("bus: %llu sensor events, worst %.1f us from uart read to occupancy\n", (unsigned long long)bus.sensors, bus.sensor_latency / 1000.0);
+	}
+	interlock_report();
+	dispatch_report();
+	speed_report();
+	rate_report();
+	confirm_report();
+	group_report();
+	for ( int i = 0; i < bus.links_n; i++ ) {
+		bus_link_t *l = &bus.links[i];
+		printf("link %d (%s) at %d baud: %llu sent, %llu replies, %llu errors, %llu timeouts, %llu overflows, %llu bytes received\n", i, uart_path(i),
+			bus_bauds[l->speed], (unsigned long long)l->sent, (unsigned long long)l->replies, (unsigned long long)l->errors,
+			(unsigned long long)l->timeouts, (unsigned long long)l->overflows, (unsigned long long)l->received);
+		if ( l->master_stats[0] || l->master_stats[1] ) {
+			printf("link %d master: %u frames, %u bad frames, %u bus faults, %u bytes dropped, %u overruns\n", i, l->master_stats[0],
+				l->master_stats[1], l->master_stats[2], l->master_stats[3], l->master_stats[4]);
+		}
+	}
+}
+
+// Passes the links of the stopped bus thread and the trains to the next server,
+// simulated masters live in this process and end with it
+int bus_export(int sock) {
+	static uint64_t data[HANDOVER_RECORD_SIZE / 8];
+	bus_cmd_t cmd;
+	int result = 0;
+	uint64_t end = journal_time() + HANDOVER_DRAIN_MS * 1000000ULL;
+	// submitted by the workers before they stopped
+	while ( queue_pop(&bus.cmds, &cmd) ) {
+		bus_command(&cmd);
+	}
+	for ( int i = 0; i < bus.links_n; i++ ) {
+		if ( strcmp(uart_path(i), "sim") != 0 ) {
+			uint64_t now = journal_time();
+			if ( io_drain(bus.io, bus.links[i].fd, now < end ? ( end - now ) / 1000000 : 0) < 0 ) {
+				printf("link %d: frames not sent before the handover\n", i); // the master drops the cut one
+				result = -1;
+			}
+			bus_link_export(&bus.links[i], (bus_link_state_t *)data);
+			result |= handover_send(sock, HANDOVER_LINK, bus.links[i].fd, uart_path(i), data, sizeof(bus_link_state_t));
+		}
+	}
+	result |= handover_send(sock, HANDOVER_STATE, -1, "layout", data, layout_save(data));
+	result |= handover_send(sock, HANDOVER_STATE, -1, "interlock", data, interlock_save(data));
+	result |= handover_send(sock, HANDOVER_STATE, -1, "speed", data, speed_save(data));
+	result |= handover_send(sock, HANDOVER_STATE, -1, "dispatch", data, dispatch_save(data));
+	return result;
+}
+
+void bus_free(void) {
+	io_destroy(bus.io);
+	queue_free(&bus.cmds);
+}
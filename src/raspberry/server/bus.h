@@ -0,0 +1,70 @@
+#ifndef BUS_H
+#define BUS_H
+
+/*
+ * Bus owner thread: the only thread talking to the master board
+ * Workers submit commands, bus events are fanned out to every worker
+ * Every master board has its own uart link, devices are routed by uid
+ * Links and their packets in flight can be handed over to the next server process
+ * A link is switched to the fastest rate its master answers at (link_def.h)
+ * Packets go out at the TWPC rate of their device (rate.h)
+ * The same light or motor packet queued for every member of a group goes as one group packet (group.h)
+ */
+
+#include <stdint.h>
+#include "queue.h"
+#include "../../twpc_def.h"
+
+#define BUS_MAX_WORKERS 16
+#define BUS_QUEUE_SIZE 1024
+#define BUS_LINK_QUEUE 256 // packets waiting per link
+#define BUS_LINK_WINDOW 4 // packets handed to a master at once, per district it drives
+#define BUS_LINK_URGENT 8 // interlocking commands per link, sent even with a full window
+#define BUS_LINK_INFLIGHT 32 // packets in a master at most, windows of LINK_DISTRICTS_MAX + urgent
+#define BUS_LINK_TIMEOUT 500 // ms without a reply before the window is reset
+#define BUS_SPEED_WAIT 100 // ms for the master to answer a LINK_SPEED
+#define BUS_SPEED_KEEPALIVE 500 // ms without a frame to the master after which a faster rate is confirmed
+#define BUS_SPEED_HOLD 2500 // ms nothing is sent after a fall back, until the master fell back too
+#define BUS_SPEED_ERRORS 8 // bad frames within BUS_SPEED_WINDOW ms that make a link one rate slower
+#define BUS_SPEED_WINDOW 1000
+#define BUS_SPEED_RETRY 60000 // ms after a rate failed before it is tried again
+#define BUS_RATE_PROBE 0x80 // rate of a packet in flight trying the next rate of its device
+#define BUS_TICK_NS 496000 // timer tick of the master, sensor events carry it
+#define BUS_TICK_RESYNC 30000 // ms between sensor events of a link after which its tick count may have wrapped
+
+#define BUS_EV_REPLY 1 // reply of a device (or echo of the master)
+#define BUS_EV_SENSOR 2 // onewire beacon passed a sensor
+#define BUS_EV_ERROR 3 // master reported a checksum error
+#define BUS_EV_DEVICE 4 // registry entry of packet.uid changed
+#define BUS_EV_BLOCK 5 // train packet.uid moved from block packet.cmd to packet.arg
+#define BUS_EV_REFUSED 6 // packet not sent by the interlocking
+#define BUS_EV_ROUTE 7 // dispatch of train packet.uid on route packet.cmd is in state packet.arg
+#define BUS_EV_SPEED 8 // train packet.uid measured at packet.cmd << 8 | packet.arg mm/s
+#define BUS_EV_STATE 9 // state batch of version packet.data_raw published
+
+typedef struct {
+	uint64_t time; // journal_time() when the command was received
+	twpc_packet_t packet;
+	uint16_t worker;
+} bus_cmd_t;
+
+typedef struct {
+	uint8_t type;
+	uint8_t link;
+	uint8_t sensor; // train seen by the sensor
+	uint8_t pin; // onewire pin of the sensor
+	twpc_packet_t packet;
+} bus_event_t;
+
+int bus_init(int);
+int bus_route(int, int, int, int);
+int bus_attach(queue_t *);
+int bus_start(void);
+void bus_stop(void);
+void bus_counters(uint64_t *, uint64_t *, uint64_t *);
+int bus_export(int);
+void bus_free(void);
+
+int bus_submit(const bus_cmd_t *);
+
+#endif
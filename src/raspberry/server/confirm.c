@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <string.h>
+#include "rate.h"
+#include "confirm.h"
+
+/*
+Only a device answering above rate 0 has the firmware which knows
+TWPC_NO_REPLY, the others drop such a packet as a bad one. The last quiet
+packet of each kind is kept, CONFIRM_DELAY after the first one the device
+is asked for its status (arg 0: light and direction, arg 1: speed). What
+does not match is sent again with a reply, ahead of the queue. Commands
+of the interlocking always have a reply, they go out before this.
+*/
+
+#define CONFIRM_LIGHT 0
+#define CONFIRM_MOTOR 1
+
+typedef struct {
+	uint8_t pending; // kinds (bits) sent quietly, not read back yet
+	uint8_t reading; // kinds being read back
+	twpc_packet_t last[2]; // last quiet packet of each kind
+	uint64_t since; // bus_now() of the first pending one, or of the read
+} confirm_device_t;
+
+static confirm_device_t devices[256];
+static confirm_send_t confirm_read;
+static confirm_send_t confirm_again;
+static uint64_t sent;
+static uint64_t reads;
+static uint64_t again;
+
+void confirm_init(confirm_send_t read, confirm_send_t send_again) {
+	memset(devices, 0, sizeof(devices));
+	confirm_read = read;
+	confirm_again = send_again;
+	sent = 0;
+	reads = 0;
+	again = 0;
+}
+
+static int confirm_kind(const twpc_packet_t *packet) {
+	if ( packet->cmd == TWPC_CMD_LIGHT_ON || packet->cmd == TWPC_CMD_LIGHT_OFF ) {
+		return CONFIRM_LIGHT;
+	} else if ( packet->cmd == TWPC_CMD_MOTOR_A || packet->cmd == TWPC_CMD_MOTOR_B ) {
+		return CONFIRM_MOTOR;
+	}
+	return -1;
+}
+
+// A packet which may go without a reply
+int confirm_quiet(const twpc_packet_t *packet) {
+	return confirm_kind(packet) >= 0 && rate_get(packet->uid) > 0;
+}
+
+void confirm_sent(const twpc_packet_t *packet, uint64_t now) {
+	int kind = confirm_kind(packet);
+	if ( kind < 0 || packet->uid == 0 || packet->uid == 255 ) {
+		return;
+	}
+	confirm_device_t *d = &devices[packet->uid];
+	if ( d->pending == 0 && d->reading == 0 ) {
+		d->since = now;
+	}
+	d->pending |= 1 << kind;
+	d->last[kind] = *packet;
+	d->last[kind].checksum = TWPC_CHECKSUM(*packet);
+	sent++;
+}
+
+static void confirm_status(int uid, int arg) {
+	twpc_packet_t packet;
+	packet.uid = uid;
+	packet.cmd = TWPC_CMD_STATUS;
+	packet.arg = arg;
+	packet.checksum = TWPC_CHECKSUM(packet);
+	confirm_read(&packet);
+	reads++;
+}
+
+// Reads the devices which are due
+void confirm_tick(uint64_t now) {
+	for ( int uid = 1; uid < 255; uid++ ) {
+		confirm_device_t *d = &devices[uid];
+		if ( ( d->pending | d->reading ) == 0 || now - d->since < CONFIRM_DELAY ) {
+			continue;
+		}
+		d->reading |= d->pending;
+		d->pending = 0;
+		d->since = now;
+		confirm_status(uid, 0);
+		if ( d->reading & ( 1 << CONFIRM_MOTOR ) ) {
+			confirm_status(uid, 1);
+		}
+	}
+}
+
+static void confirm_check(confirm_device_t *d, int kind, int ok) {
+	if ( !ok ) {
+		confirm_again(&d->last[kind]);
+		again++;
+	}
+	d->reading &= ~( 1 << kind );
+}
+
+// Answer to a status packet, the ones of the reads are compared with the last quiet packets
+void confirm_reply(const twpc_packet_t *request, const twpc_packet_t *reply) {
+	if ( request->cmd != TWPC_CMD_STATUS || request->uid == 0 || request->uid == 255 ) {
+		return;
+	}
+	confirm_device_t *d = &devices[request->uid];
+	if ( reply->data_raw == 0 ) {
+		d->reading = 0; // gone, the registry knows
+	} else if ( request->arg == 0 ) {
+		if ( d->reading & ( 1 << CONFIRM_LIGHT ) ) {
+			confirm_check(d, CONFIRM_LIGHT, ( reply->arg & 1 ) == ( d->last[CONFIRM_LIGHT].cmd == TWPC_CMD_LIGHT_ON ));
+		}
+		if ( ( d->reading & ( 1 << CONFIRM_MOTOR ) ) && ( reply->arg >> 1 & 1 ) != ( d->last[CONFIRM_MOTOR].cmd == TWPC_CMD_MOTOR_A ) ) {
+			confirm_check(d, CONFIRM_MOTOR, 0);
+		}
+	} else if ( request->arg == 1 && ( d->reading & ( 1 << CONFIRM_MOTOR ) ) ) {
+		confirm_check(d, CONFIRM_MOTOR, reply->arg == d->last[CONFIRM_MOTOR].arg);
+	}
+}
+
+void confirm_report(void) {
+	printf("confirm: %llu packets without reply, %llu status reads, %llu sent again\n", (unsigned long long)sent,
+		(unsigned long long)reads, (unsigned long long)again);
+}
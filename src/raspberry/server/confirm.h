@@ -0,0 +1,24 @@
+#ifndef CONFIRM_H
+#define CONFIRM_H
+
+/*
+ * Light and motor commands sent without a reply (TWPC_NO_REPLY),
+ * the state of the device is read back in a batch a while later
+ * runs in the bus thread
+ */
+
+#include <stdint.h>
+#include "../../twpc_def.h"
+
+#define CONFIRM_DELAY 250 // ms after the first unconfirmed command before the device is read, again if no read came back
+
+typedef void (*confirm_send_t)(twpc_packet_t *);
+
+void confirm_init(confirm_send_t, confirm_send_t);
+int confirm_quiet(const twpc_packet_t *);
+void confirm_sent(const twpc_packet_t *, uint64_t);
+void confirm_tick(uint64_t);
+void confirm_reply(const twpc_packet_t *, const twpc_packet_t *);
+void confirm_report(void);
+
+#endif
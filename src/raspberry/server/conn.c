@@ -0,0 +1,131 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "websocket.h"
+#include "http.h"
+#include "conn.h"
+
+conn_t *conn_open(slab_t *pool, int fd) {
+	conn_t *c = (conn_t *)slab_alloc(pool);
+	if ( c == NULL ) {
+		return NULL;
+	}
+	c->fd = fd;
+	c->state = CONN_STATE_HANDSHAKE;
+	c->version = 0;
+	c->rx_len = 0;
+	return c;
+}
+
+// Connection of an fd handed over by the previous server, data from conn_save()
+conn_t *conn_restore(slab_t *pool, int fd, const char *data, int len) {
+	if ( len < 5 || len > CONN_SAVE_SIZE ) { // rx keeps its terminating 0
+		return NULL;
+	}
+	conn_t *c = conn_open(pool, fd);
+	if ( c != NULL ) {
+		c->state = data[0];
+		memcpy(&c->version, &data[1], 4);
+		c->rx_len = len - 5;
+		memcpy(c->rx, &data[5], c->rx_len);
+		c->rx[c->rx_len] = '\0';
+	}
+	return c;
+}
+
+// State, stream version and unparsed input, at most CONN_SAVE_SIZE bytes
+int conn_save(conn_t *c, char *data) {
+	data[0] = c->state;
+	memcpy(&data[1], &c->version, 4);
+	memcpy(&data[5], c->rx, c->rx_len);
+	return c->rx_len + 5;
+}
+
+void conn_free(slab_t *pool, conn_t *c) {
+	slab_release(pool, c);
+}
+
+static void conn_consume(conn_t *c, int n) {
+	c->rx_len -= n;
+	memmove(c->rx, &c->rx[n], c->rx_len);
+	c->rx[c->rx_len] = '\0';
+}
+
+int conn_feed(conn_t *c, const char *data, int len) {
+	if ( c->rx_len + len > CONN_BUF_SIZE - 1 ) {
+		return -1;
+	}
+	memcpy(&c->rx[c->rx_len], data, len);
+	c->rx_len += len;
+	c->rx[c->rx_len] = '\0';
+	return 0;
+}
+
+// Returns the length of the next text message, 0 if there is none yet, -1 if the connection should be closed
+int conn_recv(conn_t *c, io_t *io, char *msg) {
+	while ( c->state == CONN_STATE_HANDSHAKE ) {
+		char *end = strstr(c->rx, "\r\n\r\n");
+		if ( end == NULL ) {
+			return 0;
+		}
+		if ( !http_is_upgrade(c->rx) ) {
+			// plain http request for the UI, the connection stays in this state
+			*end = '\0';
+			int result = http_request(c->rx, io, c->fd);
+			conn_consume(c, end + 4 - c->rx);
+			if ( result < 0 ) {
+				return -1;
+			}
+			continue;
+		}
+		char response[256];
+		int len = websocket_handshake(c->rx, response);
+		if ( len < 0 || io_send(io, c->fd, response, len) < 0 ) {
+			printf("Accept failed\n");
+			return -1;
+		}
+		conn_consume(c, end + 4 - c->rx);
+		c->state = CONN_STATE_OPEN;
+	}
+	while ( c->rx_len > 0 ) {
+		int opcode;
+		int len = websocket_decode(c->rx, c->rx_len, msg, CONN_MSG_SIZE, &opcode);
+		if ( len <= 0 ) {
+			return len;
+		}
+		conn_consume(c, len);
+		if ( opcode == WEBSOCKET_OP_TEXT ) {
+			return strlen(msg);
+		} else if ( opcode == WEBSOCKET_OP_CLOSE ) {
+			return -1;
+		} else if ( opcode == WEBSOCKET_OP_PING ) {
+			char frame[CONN_MSG_SIZE + WEBSOCKET_HEADROOM];
+			io_send(io, c->fd, frame, websocket_frame(frame, WEBSOCKET_OP_PONG, msg, strlen(msg)));
+		}
+	}
+	return 0;
+}
+
+int conn_send(conn_t *c, io_t *io, const char *msg) {
+	if ( c->state != CONN_STATE_OPEN ) {
+		return 0;
+	}
+	char frame[CONN_MSG_SIZE + WEBSOCKET_HEADROOM];
+	return io_send(io, c->fd, frame, websocket_frame(frame, WEBSOCKET_OP_TEXT, msg, strlen(msg)));
+}
+
+// Websocket frames made once for many connections
+int conn_send_frames(conn_t *c, io_t *io, const char *frames, int len) {
+	if ( c->state != CONN_STATE_OPEN || len <= 0 ) {
+		return 0;
+	}
+	return io_send(io, c->fd, frames, len);
+}
+
+// Frames in a shared buffer, sent to every connection without a copy of their own
+int conn_send_shared(conn_t *c, io_t *io, io_shared_t *b) {
+	if ( c->state != CONN_STATE_OPEN || b->len <= 0 ) {
+		return 0;
+	}
+	return io_send_shared(io, c->fd, b);
+}
@@ -0,0 +1,39 @@
+#ifndef CONN_H
+#define CONN_H
+
+/*
+ * Client connection: handshake state and receive buffer
+ * independent from the I/O backend
+ */
+
+#include <stdint.h>
+#include "io.h"
+#include "slab.h"
+
+#define CONN_STATE_HANDSHAKE 0
+#define CONN_STATE_OPEN 1
+
+#define CONN_BUF_SIZE 4096
+#define CONN_MSG_SIZE 512
+#define CONN_SAVE_SIZE ( CONN_BUF_SIZE + 4 ) // conn_save() at most, rx_len stays below CONN_BUF_SIZE
+
+typedef struct {
+	int fd;
+	int state;
+	uint32_t version; // of the state stream sent last, 0 if not subscribed
+	int rx_len;
+	char rx[CONN_BUF_SIZE];
+} conn_t;
+
+conn_t *conn_open(slab_t *, int);
+conn_t *conn_restore(slab_t *, int, const char *, int);
+int conn_save(conn_t *, char *);
+void conn_free(slab_t *, conn_t *);
+
+int conn_feed(conn_t *, const char *, int);
+int conn_recv(conn_t *, io_t *, char *);
+int conn_send(conn_t *, io_t *, const char *);
+int conn_send_frames(conn_t *, io_t *, const char *, int);
+int conn_send_shared(conn_t *, io_t *, io_shared_t *);
+
+#endif
@@ -1,3 +1,8 @@
+#include <stdio.h>
+#include "registry.h"
+#include "discovery.h"
+#include "dispatch.h"
+#include "speed.h"
 #include "control.h"
 
 /*
@@ -5,11 +10,36 @@ Packet format: cmd + args (1 byte hex each)
 Commads:
 l[uid][state] - set light
 m[uid][dir][speed] - set motor speed
+v[uid][dir][speed] - hold a train at speed * 4 mm/s (00 stops)
 s[uid1][uid2][state] - state: 0 - straight, 1 - fork
+f - discover the devices of every link
+q - list the known devices
+q[type] - list the known devices of a type (00 - train, 01 - switch)
+o - occupancy of the blocks
+p - memory of the server and the pools of the worker
+g[uid][route][speed] - run a train along a route of the layout (route: index in the layout file, speed * 4 mm/s)
+y[version] - subscribe to the state stream from a version (4 bytes hex, 0 for a snapshot), b, d and v events stop then
+
+Events sent to clients:
+r[packet] - reply of a device (4 bytes hex, uid in the lowest byte)
+w[uid][link][pin] - onewire beacon of a train seen by a sensor
+b[uid][from][to] - train moved to another block (ff - unknown)
+e - bus error
+x[packet] - command refused by the interlocking (4 bytes hex, uid in the lowest byte)
+d[uid][type][caps][link][present][state][speed][name] - registry entry, on change and for q
+q[count] - end of a device list
+o[uid]... - train in every block of the layout (00 - free)
+p[rss][used][allocated][peak]... - resident kB (4 bytes hex), then the conns and frames pools of the worker (2 bytes hex each)
+g[uid][route][state] - dispatch of a train: 00 - waiting, 01 - running, 02 - arrived, 03 - aborted
+v[uid][speed] - speed of a train measured over a block (mm/s, 2 bytes hex)
+Y[version] - state stream: forget the state, a snapshot follows
+u[version][uid][field][value]... - state stream: changed fields (field: 1 hex digit, value: 2 bytes hex), more of the version follow
+U[version][uid][field][value]... - state stream: the same, the client is at version now
+  fields: 0 - present, 1 - state bits, 2 - motor speed, 3 - block (ff - unknown), 4 - measured mm/s
 */
 
-int hex_to_int(char *hex, int l) {
-	int n = 0;
+uint32_t hex_to_int(char *hex, int l) {
+	uint32_t n = 0;
 	for ( int i = 0; hex[i] && i < l; i++ ) {
 		n <<= 4;
 		if ( hex[i] >= '0' && hex[i] <= '9' ) {
@@ -45,8 +75,66 @@ int control_handle(char *msg, twpc_packet_t *packet) {
 		packet->uid = uid;
 		packet->arg = s_id;
 		packet->cmd = s ? TWPC_CMD_SW_FORK : TWPC_CMD_SW_STRAIGHT;
+	} else if ( c == 'g' ) {
+		int route = hex_to_int(&msg[3], 2);
+		if ( route >= DISPATCH_ROUTES ) {
+			return -1;
+		}
+		packet->uid = hex_to_int(&msg[1], 2);
+		packet->cmd = DISPATCH_CMD + route;
+		packet->arg = hex_to_int(&msg[5], 2);
+	} else if ( c == 'v' ) {
+		packet->uid = hex_to_int(&msg[1], 2);
+		packet->cmd = SPEED_CMD + ( hex_to_int(&msg[3], 2) ? 1 : 0 );
+		packet->arg = hex_to_int(&msg[5], 2);
+	} else if ( c == 'f' ) {
+		packet->uid = 255;
+		packet->cmd = TWPC_CMD_DISCOVER;
+		packet->arg = DISCOVERY_ALL;
 	} else {
 		return -1;
 	}
 	return 0;
 }
+
+// Client command that produces the packet (inverse of control_handle)
+int control_format(char *msg, twpc_packet_t *packet) {
+	if ( packet->cmd == TWPC_CMD_LIGHT_ON || packet->cmd == TWPC_CMD_LIGHT_OFF ) {
+		return sprintf(msg, "l%02x%02x", packet->uid, packet->cmd == TWPC_CMD_LIGHT_ON);
+	} else if ( packet->cmd == TWPC_CMD_MOTOR_A || packet->cmd == TWPC_CMD_MOTOR_B ) {
+		return sprintf(msg, "m%02x%02x%02x", packet->uid, packet->cmd == TWPC_CMD_MOTOR_B, packet->arg);
+	} else if ( packet->cmd == TWPC_CMD_SW_STRAIGHT || packet->cmd == TWPC_CMD_SW_FORK ) {
+		return sprintf(msg, "s%02x%02x%c", packet->uid, packet->arg, packet->cmd == TWPC_CMD_SW_FORK ? '1' : '0');
+	} else if ( packet->cmd == TWPC_CMD_DISCOVER && packet->arg == DISCOVERY_ALL ) {
+		return sprintf(msg, "f");
+	} else if ( packet->cmd >= DISPATCH_CMD && packet->cmd < DISPATCH_CMD + DISPATCH_ROUTES ) {
+		return sprintf(msg, "g%02x%02x%02x", packet->uid, packet->cmd - DISPATCH_CMD, packet->arg);
+	} else if ( packet->cmd == SPEED_CMD || packet->cmd == SPEED_CMD + 1 ) {
+		return sprintf(msg, "v%02x%02x%02x", packet->uid, packet->cmd - SPEED_CMD, packet->arg);
+	}
+	return -1;
+}
+
+int control_event(char *msg, bus_event_t *ev) {
+	if ( ev->type == BUS_EV_REPLY ) {
+		return sprintf(msg, "r%08x", ev->packet.data_raw);
+	} else if ( ev->type == BUS_EV_SENSOR ) {
+		return sprintf(msg, "w%02x%02x%02x", ev->sensor, ev->link, ev->pin);
+	} else if ( ev->type == BUS_EV_BLOCK ) {
+		return sprintf(msg, "b%02x%02x%02x", ev->packet.uid, ev->packet.cmd, ev->packet.arg);
+	} else if ( ev->type == BUS_EV_SPEED ) {
+		return sprintf(msg, "v%02x%02x%02x", ev->packet.uid, ev->packet.cmd, ev->packet.arg);
+	} else if ( ev->type == BUS_EV_ROUTE ) {
+		return sprintf(msg, "g%02x%02x%02x", ev->packet.uid, ev->packet.cmd, ev->packet.arg);
+	} else if ( ev->type == BUS_EV_REFUSED ) {
+		return sprintf(msg, "x%08x", ev->packet.data_raw);
+	} else if ( ev->type == BUS_EV_ERROR ) {
+		return sprintf(msg, "e");
+	} else if ( ev->type == BUS_EV_DEVICE ) {
+		registry_device_t d;
+		if ( registry_get(ev->packet.uid, &d) == 0 ) {
+			return registry_format(msg, &d);
+		}
+	}
+	return 0;
+}
@@ -2,8 +2,11 @@
 #define CONTROL_H
 
 #include "../../twpc_def.h"
+#include "bus.h"
 
-int hex_to_int(char *, int);
+uint32_t hex_to_int(char *, int);
 int control_handle(char *, twpc_packet_t *);
+int control_format(char *, twpc_packet_t *);
+int control_event(char *, bus_event_t *);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "uart.h"
+#include "registry.h"
+#include "discovery.h"
+
+/*
+One probe per block tells which uids of the block are present. Blocks holding
+devices of the registry are probed first, so a restart confirms the known
+devices before looking for new ones. A block with devices the registry does
+not know gets a second probe asking only switches, which gives their type.
+*/
+
+typedef struct {
+	int active;
+	uint16_t waiting; // blocks without a presence answer yet
+	uint16_t typing; // blocks without a type answer yet
+	int retries;
+	int found;
+	int transactions;
+	uint64_t started;
+	uint32_t present[DISCOVERY_BLOCKS];
+	uint8_t typed[DISCOVERY_BLOCKS];
+} discovery_link_t;
+
+static discovery_link_t links[UART_MAX_LINKS];
+static discovery_send_t discovery_send;
+static discovery_changed_t discovery_changed;
+
+static uint64_t discovery_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+void discovery_init(discovery_send_t send, discovery_changed_t changed) {
+	memset(links, 0, sizeof(links));
+	discovery_send = send;
+	discovery_changed = changed;
+}
+
+static void discovery_probe(int link, int arg) {
+	twpc_packet_t packet;
+	packet.uid = 255;
+	packet.cmd = TWPC_CMD_DISCOVER;
+	packet.arg = arg;
+	packet.checksum = TWPC_CHECKSUM(packet);
+	links[link].transactions++;
+	discovery_send(link, &packet);
+}
+
+void discovery_start(int link) {
+	if ( link < 0 || link >= UART_MAX_LINKS || links[link].active ) {
+		return;
+	}
+	discovery_link_t *d = &links[link];
+	uint8_t known[DISCOVERY_BLOCKS];
+	memset(known, 0, sizeof(known));
+	for ( int uid = 1; uid < 255; uid++ ) {
+		if ( registry_link(uid) == link ) {
+			known[uid / TWPC_DISCOVER_SLOTS] = 1;
+		}
+	}
+	d->active = 1;
+	d->waiting = ( 1 << DISCOVERY_BLOCKS ) - 1;
+	d->typing = 0;
+	d->found = 0;
+	d->transactions = 0;
+	d->started = discovery_now();
+	memset(d->typed, 0, sizeof(d->typed));
+	for ( int pass = 1; pass >= 0; pass-- ) {
+		for ( int block = 0; block < DISCOVERY_BLOCKS; block++ ) {
+			if ( known[block] == pass ) {
+				discovery_probe(link, block);
+			}
+		}
+	}
+}
+
+// Tells the registry about every uid of a finished block
+static void discovery_block(int link, int block, uint32_t switches) {
+	discovery_link_t *d = &links[link];
+	for ( int slot = 0; slot < TWPC_DISCOVER_SLOTS; slot++ ) {
+		int uid = block * TWPC_DISCOVER_SLOTS + slot;
+		int changed = 0;
+		if ( uid == 0 || uid >= 255 ) {
+			continue;
+		}
+		if ( d->present[block] & ( 1UL << slot ) ) {
+			int type = -1;
+			if ( d->typed[block] ) {
+				type = switches & ( 1UL << slot ) ? REGISTRY_SWITCH : REGISTRY_TRAIN;
+			}
+			changed = registry_found(uid, link, type);
+			d->found++;
+		} else if ( registry_link(uid) == link ) {
+			changed = registry_lost(uid);
+		}
+		if ( changed ) {
+			discovery_changed(uid, link);
+		}
+	}
+}
+
+// Returns 1 if the reply belonged to a probe
+int discovery_reply(int link, const twpc_packet_t *request, const twpc_packet_t *reply) {
+	if ( request->uid != 255 || request->cmd != TWPC_CMD_DISCOVER ) {
+		return 0;
+	}
+	discovery_link_t *d = &links[link];
+	if ( !d->active ) {
+		return 1;
+	}
+	int block = request->arg & 0x0F;
+	uint32_t bitmap = reply->data_raw == 0 ? 0 : ~reply->data_raw & TWPC_DISCOVER_MASK;
+	if ( block >= DISCOVERY_BLOCKS ) {
+		return 1;
+	} else if ( request->arg >> 4 ) {
+		if ( d->typing & ( 1 << block ) ) {
+			d->typing &= ~( 1 << block );
+			discovery_block(link, block, bitmap);
+		}
+	} else if ( d->waiting & ( 1 << block ) ) {
+		d->waiting &= ~( 1 << block );
+		d->present[block] = bitmap;
+		for ( int slot = 0; slot < TWPC_DISCOVER_SLOTS && !d->typed[block]; slot++ ) {
+			int uid = block * TWPC_DISCOVER_SLOTS + slot;
+			if ( ( bitmap & ( 1UL << slot ) ) && registry_link(uid) < 0 ) {
+				d->typed[block] = 1;
+			}
+		}
+		if ( d->typed[block] ) {
+			d->typing |= 1 << block;
+			discovery_probe(link, TWPC_DISCOVER_ARG(block, REGISTRY_SWITCH));
+		} else {
+			discovery_block(link, block, 0);
+		}
+	}
+	if ( d->waiting == 0 && d->typing == 0 ) {
+		d->active = 0;
+		d->retries = 0;
+		printf("Discovery on link %d: %d devices in %llu ms, %d transactions\n", link, d->found,
+			(unsigned long long)( discovery_now() - d->started ), d->transactions);
+	}
+	return 1;
+}
+
+// The master lost the probes in flight (checksum error or timeout), ask again what is missing
+void discovery_abort(int link) {
+	discovery_link_t *d = &links[link];
+	if ( !d->active ) {
+		return;
+	}
+	if ( ++d->retries > DISCOVERY_RETRIES ) {
+		printf("Discovery on link %d failed\n", link);
+		d->active = 0;
+		d->retries = 0;
+		return;
+	}
+	for ( int block = 0; block < DISCOVERY_BLOCKS; block++ ) {
+		if ( d->waiting & ( 1 << block ) ) {
+			discovery_probe(link, block);
+		} else if ( d->typing & ( 1 << block ) ) {
+			discovery_probe(link, TWPC_DISCOVER_ARG(block, REGISTRY_SWITCH));
+		}
+	}
+}
@@ -0,0 +1,25 @@
+#ifndef DISCOVERY_H
+#define DISCOVERY_H
+
+/*
+ * Bus discovery: finds the devices of a link with one TWPC_CMD_DISCOVER
+ * probe per block of TWPC_DISCOVER_SLOTS uids instead of one poll per uid
+ * runs in the bus thread
+ */
+
+#include <stdint.h>
+#include "../../twpc_def.h"
+
+#define DISCOVERY_BLOCKS ( 255 / TWPC_DISCOVER_SLOTS + 1 )
+#define DISCOVERY_ALL 0xFF // arg of a client request for a full discovery
+#define DISCOVERY_RETRIES 3
+
+typedef void (*discovery_send_t)(int, twpc_packet_t *);
+typedef void (*discovery_changed_t)(int, int);
+
+void discovery_init(discovery_send_t, discovery_changed_t);
+void discovery_start(int);
+int discovery_reply(int, const twpc_packet_t *, const twpc_packet_t *);
+void discovery_abort(int);
+
+#endif
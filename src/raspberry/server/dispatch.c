@@ -0,0 +1,407 @@
+#include <stdio.h>
+#include <string.h>
+#include "layout.h"
+#include "interlock.h"
+#include "speed.h"
+#include "dispatch.h"
+
+/*
+Timetable file, one item per line, # starts a comment:
+at [seconds] [train uid] [route] [mm/s] - dispatch request, in order of time
+repeat [seconds] - the timetable starts over this long after its start
+
+Requests wait in order of arrival. One starts once the requests of its train
+before it are done and every block of its route is free: the blocks are then
+reserved together and the switches not in position yet are sent back to back.
+The train starts when every switch has answered. A switch which did not take
+its command, or no answer in DISPATCH_SWITCH_TIMEOUT, aborts the route, as
+does a train not in the first block of the route or moving before its start.
+
+Speed profile: the requested speed, DISPATCH_APPROACH from the block before
+the last one, stop on entering the last one. Speeds are held in mm/s by the
+speed controller. A train the interlocking has not seen running yet starts in
+motor direction 0, with the block behind it held too; if that takes it out of
+the route backwards it is turned around once. Any other block off the route
+stops the train and releases the route.
+
+Everything runs on the bus thread from requests, sensor events and the
+timetable clock, so the same inputs always give the same bus traffic.
+*/
+
+typedef struct {
+	uint32_t at; // ms from the start of the timetable
+	uint8_t train;
+	uint8_t route;
+	uint16_t speed; // mm/s
+} dispatch_entry_t;
+
+typedef struct {
+	uint8_t train;
+	uint8_t route;
+	uint16_t speed;
+	uint8_t state;
+	uint8_t pos; // index of the block of the train in the route
+	uint8_t dir;
+	uint8_t guessed; // dir was not known
+	uint8_t behind; // block behind the train held until it leaves the first one, LAYOUT_NONE if none
+	uint8_t held; // the train waits for its switches, 2: one did not take its command
+	uint16_t switching; // route blocks whose switch has not answered yet, a bit each
+	uint64_t switched_at; // ms when they were sent
+} dispatch_t;
+
+// What runs, handed over to the next server process
+typedef struct {
+	dispatch_t dispatches[DISPATCH_MAX];
+	int dispatches_n;
+	int timetable_next;
+	uint64_t timetable_start;
+} dispatch_state_t;
+
+static dispatch_entry_t timetable[DISPATCH_TIMETABLE];
+static int timetable_n;
+static uint32_t timetable_repeat; // ms, 0: once
+static int timetable_next;
+static uint64_t timetable_start;
+
+static dispatch_t dispatches[DISPATCH_MAX]; // in order of arrival
+static int dispatches_n;
+static dispatch_send_t dispatch_send;
+static dispatch_changed_t dispatch_changed;
+static uint64_t started;
+static uint64_t arrived;
+static uint64_t aborted;
+static uint64_t switched;
+static uint64_t in_position;
+static uint64_t switch_failed;
+static uint64_t now_ms; // of the last dispatch_tick()
+
+int dispatch_load(const char *path) {
+	timetable_n = 0;
+	timetable_repeat = 0;
+	if ( path == NULL ) {
+		return 0;
+	}
+	FILE *f = fopen(path, "r");
+	if ( f == NULL ) {
+		printf("Cannot open timetable %s\n", path);
+		return -1;
+	}
+	char line[256];
+	int n = 0;
+	while ( fgets(line, sizeof(line), f) != NULL ) {
+		char word[16];
+		char route[16];
+		double seconds;
+		int train;
+		int speed;
+		int ok = 0;
+		n++;
+		if ( sscanf(line, "%15s", word) != 1 || word[0] == '#' ) {
+			continue;
+		}
+		if ( strcmp(word, "at") == 0 && sscanf(line, "%*s %lf %i %15s %i", &seconds, &train, route, &speed) == 4 ) {
+			dispatch_entry_t *e = &timetable[timetable_n];
+			e->at = seconds * 1000;
+			e->train = train;
+			e->route = layout_route(route);
+			e->speed = speed;
+			ok = timetable_n < DISPATCH_TIMETABLE && layout_route(route) >= 0 && train > 0 && train < 255
+				&& speed > 0 && speed <= 65535 && ( timetable_n == 0 || e->at >= timetable[timetable_n - 1].at );
+			timetable_n += ok;
+		} else if ( strcmp(word, "repeat") == 0 && sscanf(line, "%*s %lf", &seconds) == 1 ) {
+			timetable_repeat = seconds * 1000;
+			ok = 1;
+		}
+		if ( !ok ) {
+			printf("Timetable %s:%d: invalid line: %s", path, n, line);
+			fclose(f);
+			return -1;
+		}
+	}
+	fclose(f);
+	if ( timetable_n > 0 && timetable_repeat > 0 && timetable_repeat <= timetable[timetable_n - 1].at ) {
+		printf("Timetable %s: repeat before the last entry\n", path);
+		return -1;
+	}
+	printf("Timetable %s: %d entries\n", path, timetable_n);
+	return 0;
+}
+
+void dispatch_init(dispatch_send_t send, dispatch_changed_t changed, uint64_t now) {
+	dispatch_send = send;
+	dispatch_changed = changed;
+	dispatches_n = 0;
+	timetable_next = 0;
+	timetable_start = now;
+	started = 0;
+	arrived = 0;
+	aborted = 0;
+	switched = 0;
+	in_position = 0;
+	switch_failed = 0;
+	now_ms = now;
+}
+
+static void dispatch_packet(int uid, int cmd, int arg) {
+	twpc_packet_t packet;
+	packet.uid = uid;
+	packet.cmd = cmd;
+	packet.arg = arg;
+	packet.checksum = TWPC_CHECKSUM(packet);
+	dispatch_send(&packet);
+}
+
+static void dispatch_motor(dispatch_t *d, int speed) {
+	speed_set(d->train, d->dir, speed);
+}
+
+// Speed out of the first block
+static void dispatch_go(dispatch_t *d) {
+	dispatch_motor(d, layout.routes[d->route].blocks_n == 2 && d->speed > DISPATCH_APPROACH ? DISPATCH_APPROACH : d->speed);
+}
+
+// Releases the blocks of the route before index pos
+static void dispatch_release(dispatch_t *d, int pos) {
+	layout_route_t *r = &layout.routes[d->route];
+	for ( int i = 0; i < pos; i++ ) {
+		if ( layout.reserved[r->blocks[i]] == d->train ) {
+			layout.reserved[r->blocks[i]] = 0;
+			layout.reserved_state[r->blocks[i]] = LAYOUT_NONE;
+		}
+	}
+	if ( pos > 0 && d->behind != LAYOUT_NONE && layout.reserved[d->behind] == d->train ) {
+		layout.reserved[d->behind] = 0;
+		d->behind = LAYOUT_NONE;
+	}
+}
+
+static void dispatch_finish(dispatch_t *d, int state) {
+	dispatch_release(d, layout.routes[d->route].blocks_n);
+	d->state = state;
+	if ( state == DISPATCH_ARRIVED ) {
+		arrived++;
+	} else {
+		aborted++;
+	}
+	dispatch_changed(d->train, d->route, state);
+}
+
+static int dispatch_reservable(dispatch_t *d) {
+	layout_route_t *r = &layout.routes[d->route];
+	for ( int i = 0; i < r->blocks_n; i++ ) {
+		if ( !interlock_clear(d->train, r->blocks[i]) ) {
+			return 0;
+		}
+	}
+	return interlock_heading(d->train, r->blocks[1]) >= 0 || interlock_clear(d->train, layout.previous[d->train]);
+}
+
+static void dispatch_start(dispatch_t *d) {
+	layout_route_t *r = &layout.routes[d->route];
+	for ( int i = 0; i < r->blocks_n; i++ ) {
+		layout.reserved[r->blocks[i]] = d->train;
+		layout.reserved_state[r->blocks[i]] = r->states[i];
+	}
+	int dir = interlock_heading(d->train, r->blocks[1]);
+	d->behind = LAYOUT_NONE;
+	if ( dir < 0 && layout.previous[d->train] != LAYOUT_NONE && layout.reserved[layout.previous[d->train]] == 0 ) {
+		d->behind = layout.previous[d->train];
+		layout.reserved[d->behind] = d->train;
+	}
+	d->guessed = dir < 0;
+	d->dir = dir < 0 ? 0 : dir;
+	d->pos = 0;
+	d->state = DISPATCH_RUNNING;
+	d->held = 1;
+	d->switching = 0;
+	d->switched_at = now_ms;
+	started++;
+	dispatch_changed(d->train, d->route, DISPATCH_RUNNING);
+	// one burst of the switches not in position yet, the train starts on their answers
+	for ( int i = 0; i < r->blocks_n; i++ ) {
+		int sw = layout.blocks[r->blocks[i]].sw;
+		if ( r->states[i] == LAYOUT_NONE ) {
+			continue;
+		} else if ( layout.switches[sw].state == r->states[i] ) {
+			in_position++;
+			continue;
+		}
+		d->switching |= 1 << i;
+		dispatch_packet(layout.switches[sw].uid, r->states[i] ? TWPC_CMD_SW_FORK : TWPC_CMD_SW_STRAIGHT, layout.switches[sw].arg);
+		switched++;
+	}
+	if ( d->held == 1 && d->switching == 0 ) {
+		d->held = 0;
+		dispatch_go(d);
+	}
+}
+
+// Starts what can be started, in order, and drops the finished requests
+static void dispatch_run(void) {
+	uint8_t busy[256];
+	memset(busy, 0, sizeof(busy));
+	for ( int i = 0; i < dispatches_n; i++ ) {
+		dispatch_t *d = &dispatches[i];
+		if ( d->state == DISPATCH_WAITING && !busy[d->train] ) {
+			if ( layout_position(d->train) != layout.routes[d->route].blocks[0] ) {
+				dispatch_finish(d, DISPATCH_ABORTED);
+			} else if ( dispatch_reservable(d) ) {
+				dispatch_start(d);
+			}
+		}
+		if ( d->state == DISPATCH_WAITING || d->state == DISPATCH_RUNNING ) {
+			busy[d->train] = 1;
+		}
+	}
+	int n = 0;
+	for ( int i = 0; i < dispatches_n; i++ ) {
+		if ( dispatches[i].state == DISPATCH_WAITING || dispatches[i].state == DISPATCH_RUNNING ) {
+			dispatches[n++] = dispatches[i];
+		}
+	}
+	dispatches_n = n;
+}
+
+int dispatch_request(int train, int route, int speed) {
+	if ( dispatches_n == DISPATCH_MAX || train <= 0 || train >= 255 || route < 0 || route >= layout.routes_n ) {
+		return -1;
+	}
+	dispatch_t *d = &dispatches[dispatches_n++];
+	memset(d, 0, sizeof(dispatch_t));
+	d->train = train;
+	d->route = route;
+	d->speed = speed;
+	d->state = DISPATCH_WAITING;
+	d->behind = LAYOUT_NONE;
+	dispatch_changed(train, route, DISPATCH_WAITING);
+	dispatch_run();
+	return 0;
+}
+
+// Train entered block
+void dispatch_moved(int train, int block) {
+	dispatch_t *d = NULL;
+	for ( int i = 0; i < dispatches_n && d == NULL; i++ ) {
+		if ( dispatches[i].train == train && dispatches[i].state == DISPATCH_RUNNING ) {
+			d = &dispatches[i];
+		}
+	}
+	if ( d == NULL ) {
+		return;
+	}
+	layout_route_t *r = &layout.routes[d->route];
+	if ( block == r->blocks[d->pos] ) {
+		return;
+	} else if ( d->held ) { // not started yet
+		dispatch_motor(d, 0);
+		dispatch_finish(d, DISPATCH_ABORTED);
+	} else if ( block == r->blocks[d->pos + 1] ) {
+		d->pos++;
+		dispatch_release(d, d->pos);
+		if ( d->pos == r->blocks_n - 1 ) {
+			dispatch_motor(d, 0);
+			dispatch_finish(d, DISPATCH_ARRIVED);
+		} else if ( d->pos == r->blocks_n - 2 && d->speed > DISPATCH_APPROACH ) {
+			dispatch_motor(d, DISPATCH_APPROACH);
+		}
+	} else if ( d->guessed && block == d->behind ) {
+		// started the wrong way, back into the first block
+		d->guessed = 0;
+		d->dir = !d->dir;
+		dispatch_go(d);
+	} else {
+		dispatch_motor(d, 0);
+		dispatch_finish(d, DISPATCH_ABORTED);
+	}
+	dispatch_run();
+}
+
+// Answer to a packet sent on the bus, good: 0 if the device did not take it or it was lost.
+// Only records it, the train starts on the next dispatch_tick()
+void dispatch_reply(const twpc_packet_t *request, int good) {
+	int sw = layout_switch(request->uid, request->arg);
+	if ( ( request->cmd != TWPC_CMD_SW_STRAIGHT && request->cmd != TWPC_CMD_SW_FORK ) || sw < 0 ) {
+		return;
+	}
+	for ( int i = 0; i < dispatches_n; i++ ) {
+		dispatch_t *d = &dispatches[i];
+		layout_route_t *r = &layout.routes[d->route];
+		for ( int j = 0; j < r->blocks_n && d->switching != 0; j++ ) {
+			if ( ( d->switching & ( 1 << j ) ) && layout.blocks[r->blocks[j]].sw == sw
+				&& r->states[j] == ( request->cmd == TWPC_CMD_SW_FORK ) ) {
+				d->switching &= ~( 1 << j );
+				d->held = good ? d->held : 2;
+				return;
+			}
+		}
+	}
+}
+
+// Starts the trains whose switches have all answered, aborts the routes with one which did not
+static void dispatch_switches(void) {
+	int aborts = 0;
+	for ( int i = 0; i < dispatches_n; i++ ) {
+		dispatch_t *d = &dispatches[i];
+		if ( d->state != DISPATCH_RUNNING || !d->held ) {
+			continue;
+		} else if ( d->held == 2 || now_ms - d->switched_at >= DISPATCH_SWITCH_TIMEOUT ) {
+			switch_failed++;
+			dispatch_finish(d, DISPATCH_ABORTED);
+			aborts++;
+		} else if ( d->switching == 0 ) {
+			d->held = 0;
+			dispatch_go(d);
+		}
+	}
+	if ( aborts > 0 ) {
+		dispatch_run();
+	}
+}
+
+void dispatch_tick(uint64_t now) {
+	now_ms = now;
+	dispatch_switches();
+	if ( timetable_n == 0 ) {
+		return;
+	}
+	if ( timetable_next == timetable_n && timetable_repeat > 0 && now - timetable_start >= timetable_repeat ) {
+		timetable_start += timetable_repeat;
+		timetable_next = 0;
+	}
+	while ( timetable_next < timetable_n && now - timetable_start >= timetable[timetable_next].at ) {
+		dispatch_entry_t *e = &timetable[timetable_next++];
+		if ( dispatch_request(e->train, e->route, e->speed) < 0 ) {
+			printf("Timetable: no room for train %d on %s\n", e->train, layout.routes[e->route].name);
+		}
+	}
+}
+
+int dispatch_save(void *data) {
+	dispatch_state_t *state = (dispatch_state_t *)data;
+	memcpy(state->dispatches, dispatches, sizeof(dispatches));
+	state->dispatches_n = dispatches_n;
+	state->timetable_next = timetable_next;
+	state->timetable_start = timetable_start;
+	return sizeof(dispatch_state_t);
+}
+
+// Routes of the previous server, and its place in the timetable if it still fits
+int dispatch_restore(const void *data, int len) {
+	const dispatch_state_t *state = (const dispatch_state_t *)data;
+	if ( len != sizeof(dispatch_state_t) ) {
+		return -1;
+	}
+	memcpy(dispatches, state->dispatches, sizeof(dispatches));
+	dispatches_n = state->dispatches_n;
+	if ( state->timetable_next <= timetable_n ) {
+		timetable_next = state->timetable_next;
+		timetable_start = state->timetable_start;
+	}
+	return 0;
+}
+
+void dispatch_report(void) {
+	printf("dispatch: %llu started, %llu arrived, %llu aborted, %llu switch commands, %llu switches already set, %llu switch failures\n",
+		(unsigned long long)started, (unsigned long long)arrived, (unsigned long long)aborted,
+		(unsigned long long)switched, (unsigned long long)in_position, (unsigned long long)switch_failed);
+}
@@ -0,0 +1,40 @@
+#ifndef DISPATCH_H
+#define DISPATCH_H
+
+/*
+ * Dispatcher: runs trains along the routes of the layout, on request or from a timetable
+ * a route is reserved as a whole and its switches are set in one burst, the train starts once they answered,
+ * blocks are released behind the train as it passes the sensors
+ * runs in the bus thread
+ */
+
+#include <stdint.h>
+#include "../../twpc_def.h"
+
+#define DISPATCH_MAX 64 // dispatches waiting or running
+#define DISPATCH_TIMETABLE 256
+#define DISPATCH_APPROACH 50 // mm/s at most in the block before the last one
+#define DISPATCH_SWITCH_TIMEOUT 2000 // ms for the switches of a route to answer
+#define DISPATCH_CMD 0x80 // pseudo command of a client request: cmd - DISPATCH_CMD is the route, arg the speed in SPEED_UNIT
+#define DISPATCH_ROUTES 0x40 // routes a client can request
+
+#define DISPATCH_WAITING 0
+#define DISPATCH_RUNNING 1
+#define DISPATCH_ARRIVED 2
+#define DISPATCH_ABORTED 3
+
+typedef void (*dispatch_send_t)(twpc_packet_t *);
+typedef void (*dispatch_changed_t)(int, int, int);
+
+int dispatch_load(const char *);
+void dispatch_init(dispatch_send_t, dispatch_changed_t, uint64_t);
+
+int dispatch_request(int, int, int);
+void dispatch_moved(int, int);
+void dispatch_reply(const twpc_packet_t *, int);
+void dispatch_tick(uint64_t);
+int dispatch_save(void *);
+int dispatch_restore(const void *, int);
+void dispatch_report(void);
+
+#endif
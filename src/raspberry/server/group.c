@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <string.h>
+#include "layout.h"
+#include "rate.h"
+#include "group.h"
+
+/*
+A device is asked for its groups the first time it answers above rate 0,
+the rate every device with the firmware knowing TWPC_NO_REPLY and groups
+reaches. Then it is told to join or leave one group at a time, until it is
+in the ones the layout has for it. Only the groups a device answered with
+count: a group packet stands for a device only if it is sure to hear it,
+the others keep getting their own packets.
+*/
+
+typedef struct {
+	uint8_t known; // groups answered at least once
+	uint8_t unable; // echoed the request, its firmware has no groups
+	uint8_t groups; // as last answered
+	uint64_t asked; // bus_now() of the TWPC_CMD_GROUP without an answer yet, 0 if none
+} group_device_t;
+
+static group_device_t devices[256];
+static group_send_t group_send;
+static uint64_t commands;
+static uint64_t packets;
+static uint64_t stood_for;
+
+void group_init(group_send_t send) {
+	memset(devices, 0, sizeof(devices));
+	group_send = send;
+	commands = 0;
+	packets = 0;
+	stood_for = 0;
+}
+
+// Next TWPC_CMD_GROUP arg for a device, 0 if it is in its groups
+static int group_next(int uid) {
+	group_device_t *d = &devices[uid];
+	uint8_t differ = d->groups ^ layout.groups[uid];
+	if ( !d->known ) {
+		return TWPC_GROUP_ASK;
+	}
+	for ( int group = 0; group < TWPC_GROUPS; group++ ) {
+		if ( differ & ( 1 << group ) ) {
+			return group | ( layout.groups[uid] & ( 1 << group ) ? TWPC_GROUP_JOIN : TWPC_GROUP_LEAVE );
+		}
+	}
+	return 0;
+}
+
+// Every good answer of a device
+void group_reply(const twpc_packet_t *request, const twpc_packet_t *reply, uint64_t now) {
+	int uid = request->uid;
+	if ( uid == 0 || uid >= TWPC_GROUP_FIRST ) {
+		return;
+	}
+	group_device_t *d = &devices[uid];
+	if ( request->cmd == TWPC_CMD_GROUP && reply->cmd == TWPC_CMD_GROUP ) {
+		d->unable = reply->arg & 0x80;
+		d->known = !d->unable;
+		d->groups = reply->arg;
+		d->asked = 0;
+	}
+	if ( d->unable || rate_get(uid) == 0 || ( d->asked != 0 && now - d->asked < GROUP_RETRY ) ) {
+		return;
+	}
+	int arg = group_next(uid);
+	if ( arg != 0 ) {
+		twpc_packet_t packet;
+		packet.uid = uid;
+		packet.cmd = TWPC_CMD_GROUP;
+		packet.arg = arg;
+		packet.checksum = TWPC_CHECKSUM(packet);
+		d->asked = now;
+		group_send(&packet);
+		commands++;
+	}
+}
+
+// Devices which answered being in the group
+int group_members(int group, uint8_t *uids) {
+	int n = 0;
+	for ( int uid = 1; uid < TWPC_GROUP_FIRST; uid++ ) {
+		if ( devices[uid].known && ( devices[uid].groups & ( 1 << group ) ) ) {
+			uids[n++] = uid;
+		}
+	}
+	return n;
+}
+
+// A group packet went out in place of the packets of members devices
+void group_sent(int members) {
+	packets++;
+	stood_for += members;
+}
+
+void group_report(void) {
+	int members = 0;
+	for ( int uid = 1; uid < TWPC_GROUP_FIRST; uid++ ) {
+		members += __builtin_popcount(devices[uid].groups);
+	}
+	printf("group: %llu group commands, %d memberships, %llu group packets for %llu device packets\n", (unsigned long long)commands,
+		members, (unsigned long long)packets, (unsigned long long)stood_for);
+}
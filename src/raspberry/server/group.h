@@ -0,0 +1,23 @@
+#ifndef GROUP_H
+#define GROUP_H
+
+/*
+ * Multicast groups (TWPC_GROUP_UID): the layout tells which devices belong
+ * in a group, the devices are told and their answers are kept
+ * runs in the bus thread
+ */
+
+#include <stdint.h>
+#include "../../twpc_def.h"
+
+#define GROUP_RETRY 5000 // ms before a TWPC_CMD_GROUP without an answer is sent again
+
+typedef void (*group_send_t)(twpc_packet_t *);
+
+void group_init(group_send_t);
+void group_reply(const twpc_packet_t *, const twpc_packet_t *, uint64_t);
+int group_members(int, uint8_t *);
+void group_sent(int);
+void group_report(void);
+
+#endif
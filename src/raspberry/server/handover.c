@@ -0,0 +1,220 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "handover.h"
+
+/*
+The new process connects to the socket of the running one and receives
+records until HANDOVER_DONE, one sendmsg() each (SOCK_SEQPACKET keeps the
+boundaries), the fd of a record travels with it as SCM_RIGHTS. The old
+process stops its threads before it sends anything, so nothing is read
+from a passed fd twice. What was written to an fd goes out before it is
+passed (HANDOVER_DRAIN_MS), a client which does not take it in time is
+closed rather than passed in the middle of a frame.
+
+Received records are kept until handover_done(), the parts of the new
+process take what they know, the fds nobody took are closed then.
+*/
+
+typedef struct {
+	uint32_t type;
+	uint32_t len;
+	char name[HANDOVER_NAME];
+} handover_header_t;
+
+static handover_record_t records[HANDOVER_MAX_RECORDS];
+static int records_n = 0;
+
+static int handover_address(struct sockaddr_un *address, const char *path) {
+	memset(address, 0, sizeof(struct sockaddr_un));
+	address->sun_family = AF_UNIX;
+	if ( strlen(path) >= sizeof(address->sun_path) ) {
+		return -1;
+	}
+	strcpy(address->sun_path, path);
+	return 0;
+}
+
+static int handover_recv(int sock, char *buffer, int *fd) {
+	char control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { buffer, sizeof(handover_header_t) + HANDOVER_RECORD_SIZE };
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	int len = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	*fd = -1;
+	for ( struct cmsghdr *c = CMSG_FIRSTHDR(&msg); len > 0 && c != NULL; c = CMSG_NXTHDR(&msg, c) ) {
+		if ( c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS ) {
+			memcpy(fd, CMSG_DATA(c), sizeof(int));
+		}
+	}
+	return len;
+}
+
+// Takes over from the server listening on path: 1 if it handed over (maybe not all), 0 if none runs, -1 on error
+int handover_receive(const char *path) {
+	struct sockaddr_un address;
+	if ( handover_address(&address, path) < 0 ) {
+		return -1;
+	}
+	int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if ( sock < 0 ) {
+		return -1;
+	}
+	if ( connect(sock, (struct sockaddr *)&address, sizeof(address)) < 0 ) {
+		close(sock);
+		return errno == ENOENT || errno == ECONNREFUSED ? 0 : -1;
+	}
+	char *buffer = (char *)malloc(sizeof(handover_header_t) + HANDOVER_RECORD_SIZE);
+	int result = -1;
+	while ( buffer != NULL ) {
+		int fd;
+		int len = handover_recv(sock, buffer, &fd);
+		handover_header_t *h = (handover_header_t *)buffer;
+		if ( len < (int)sizeof(handover_header_t) || h->len != len - sizeof(handover_header_t) ) {
+			if ( fd >= 0 ) {
+				close(fd);
+			}
+			break;
+		} else if ( h->type == HANDOVER_DONE ) {
+			result = 1;
+			break;
+		} else if ( records_n == HANDOVER_MAX_RECORDS ) {
+			if ( fd >= 0 ) {
+				close(fd);
+			}
+			continue;
+		}
+		handover_record_t *r = &records[records_n];
+		r->type = h->type;
+		r->fd = fd;
+		memcpy(r->name, h->name, HANDOVER_NAME);
+		r->name[HANDOVER_NAME - 1] = '\0';
+		r->len = h->len;
+		r->data = (char *)malloc(h->len + 1);
+		r->taken = 0;
+		if ( r->data == NULL ) {
+			if ( fd >= 0 ) {
+				close(fd);
+			}
+			continue;
+		}
+		memcpy(r->data, &buffer[sizeof(handover_header_t)], h->len);
+		records_n++;
+	}
+	free(buffer);
+	close(sock);
+	if ( result < 0 && records_n == 0 ) {
+		return -1; // refused, the old server still runs
+	}
+	printf("Handover from %s: %d records%s\n", path, records_n, result < 0 ? ", incomplete" : "");
+	return 1;
+}
+
+// Record of type (and name if not NULL), taken or not
+handover_record_t *handover_find(int type, const char *name) {
+	for ( int i = 0; i < records_n; i++ ) {
+		if ( records[i].type == type && ( name == NULL || strcmp(records[i].name, name) == 0 ) ) {
+			return &records[i];
+		}
+	}
+	return NULL;
+}
+
+// Next record of type (and name if not NULL) nobody took yet, the fd belongs to the caller from now
+handover_record_t *handover_take(int type, const char *name) {
+	for ( int i = 0; i < records_n; i++ ) {
+		handover_record_t *r = &records[i];
+		if ( !r->taken && r->type == type && ( name == NULL || strcmp(r->name, name) == 0 ) ) {
+			r->taken = 1;
+			return r;
+		}
+	}
+	return NULL;
+}
+
+void handover_done(void) {
+	for ( int i = 0; i < records_n; i++ ) {
+		if ( !records[i].taken && records[i].fd >= 0 ) {
+			close(records[i].fd);
+		}
+		free(records[i].data);
+	}
+	records_n = 0;
+}
+
+// Socket the next server takes over through, a stale one of a crashed server is replaced
+int handover_listen(const char *path) {
+	struct sockaddr_un address;
+	if ( handover_address(&address, path) < 0 ) {
+		return -1;
+	}
+	int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if ( sock < 0 ) {
+		return -1;
+	}
+	unlink(path);
+	if ( bind(sock, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(sock, 1) < 0 ) {
+		printf("Cannot listen for a handover on %s\n", path);
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+int handover_accept(int sock) {
+	return accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+}
+
+int handover_send(int sock, int type, int fd, const char *name, const void *data, int len) {
+	static char buffer[sizeof(handover_header_t) + HANDOVER_RECORD_SIZE];
+	handover_header_t *h = (handover_header_t *)buffer;
+	if ( len > HANDOVER_RECORD_SIZE ) {
+		return -1;
+	}
+	memset(h, 0, sizeof(handover_header_t));
+	h->type = type;
+	h->len = len;
+	if ( name != NULL ) {
+		strncpy(h->name, name, HANDOVER_NAME - 1);
+	}
+	if ( len > 0 ) {
+		memcpy(&buffer[sizeof(handover_header_t)], data, len);
+	}
+	struct iovec iov = { buffer, sizeof(handover_header_t) + len };
+	char control[CMSG_SPACE(sizeof(int))];
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if ( fd >= 0 ) {
+		memset(control, 0, sizeof(control));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+		c->cmsg_level = SOL_SOCKET;
+		c->cmsg_type = SCM_RIGHTS;
+		c->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(c), &fd, sizeof(int));
+	}
+	return sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t)iov.iov_len ? 0 : -1;
+}
+
+// The path stays if the socket was handed over, it belongs to the new process then
+void handover_close(int sock, const char *path, int handed) {
+	if ( sock >= 0 ) {
+		close(sock);
+		if ( !handed ) {
+			unlink(path);
+		}
+	}
+}
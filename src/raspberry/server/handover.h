@@ -0,0 +1,41 @@
+#ifndef HANDOVER_H
+#define HANDOVER_H
+
+/*
+ * Handover between two server processes over a unix socket
+ * the running server passes its sockets, uarts and state to a new one
+ * (SCM_RIGHTS) and exits, clients and masters do not see a disconnect,
+ * only a client which does not take what was sent to it in time is closed
+ */
+
+#define HANDOVER_LISTEN 1 // listening socket of a worker
+#define HANDOVER_LINK 2 // uart of a master, name: path, data: state of the bus link
+#define HANDOVER_CONN 3 // client connection, data: conn_save()
+#define HANDOVER_STATE 4 // state of a module, name: module
+#define HANDOVER_DONE 5 // last record, the old process is about to exit
+
+#define HANDOVER_NAME 64
+#define HANDOVER_RECORD_SIZE 65536 // data of a record at most
+#define HANDOVER_MAX_RECORDS ( 1024 + 64 )
+#define HANDOVER_DRAIN_MS 1000 // for what was sent to the fds of a worker or the bus before they are passed
+
+typedef struct {
+	int type;
+	int fd; // -1 if none
+	char name[HANDOVER_NAME];
+	char *data;
+	int len;
+	int taken;
+} handover_record_t;
+
+int handover_receive(const char *);
+handover_record_t *handover_find(int, const char *);
+handover_record_t *handover_take(int, const char *);
+void handover_done(void);
+
+int handover_listen(const char *);
+int handover_accept(int);
+int handover_send(int, int, int, const char *, const void *, int);
+void handover_close(int, const char *, int);
+
+#endif
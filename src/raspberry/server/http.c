@@ -0,0 +1,301 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <zlib.h>
+#include <brotli/encode.h>
+#include "registry.h"
+#include "http.h"
+
+/*
+Every file of the web directory is kept in memory with a gzip and a brotli
+variant (only when they are smaller). The ETag is a hash of the content, a
+matching If-None-Match gets 304 without a body.
+/devices is generated from the registry on every request.
+*/
+
+typedef struct {
+	char path[64];
+	const char *type;
+	uint32_t hash;
+	char *data[HTTP_ENCODINGS];
+	int len[HTTP_ENCODINGS];
+} http_asset_t;
+
+static http_asset_t assets[HTTP_MAX_ASSETS];
+static int assets_n = 0;
+
+static const char *encoding_names[HTTP_ENCODINGS] = { NULL, "gzip", "br" };
+static const char *etag_suffix[HTTP_ENCODINGS] = { "", "-gz", "-br" };
+
+static const char *http_type(const char *name) {
+	const char *ext = strrchr(name, '.');
+	if ( ext == NULL ) {
+		return "application/octet-stream";
+	} else if ( strcmp(ext, ".html") == 0 ) {
+		return "text/html; charset=utf-8";
+	} else if ( strcmp(ext, ".js") == 0 ) {
+		return "application/javascript";
+	} else if ( strcmp(ext, ".css") == 0 ) {
+		return "text/css";
+	} else if ( strcmp(ext, ".png") == 0 ) {
+		return "image/png";
+	} else if ( strcmp(ext, ".ico") == 0 ) {
+		return "image/x-icon";
+	} else if ( strcmp(ext, ".svg") == 0 ) {
+		return "image/svg+xml";
+	} else if ( strcmp(ext, ".txt") == 0 ) {
+		return "text/plain";
+	}
+	return NULL;
+}
+
+// FNV-1a
+static uint32_t http_hash(const char *data, int len) {
+	uint32_t hash = 2166136261u;
+	for ( int i = 0; i < len; i++ ) {
+		hash = ( hash ^ (uint8_t)data[i] ) * 16777619u;
+	}
+	return hash;
+}
+
+static int http_gzip(const char *in, int len, char *out, int size) {
+	z_stream z;
+	memset(&z, 0, sizeof(z));
+	if ( deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK ) {
+		return -1;
+	}
+	z.next_in = (Bytef *)in;
+	z.avail_in = len;
+	z.next_out = (Bytef *)out;
+	z.avail_out = size;
+	int result = deflate(&z, Z_FINISH);
+	int total = z.total_out;
+	deflateEnd(&z);
+	return result == Z_STREAM_END ? total : -1;
+}
+
+static int http_brotli(const char *in, int len, char *out, int size) {
+	size_t total = size;
+	if ( !BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, len, (const uint8_t *)in, &total, (uint8_t *)out) ) {
+		return -1;
+	}
+	return total;
+}
+
+// Reads and compresses a file, 0 if it is served or not a type of asset, -1 if it cannot be served
+static int http_load(const char *dir, const char *name) {
+	char path[512];
+	const char *type = http_type(name);
+	if ( type == NULL ) {
+		return 0;
+	}
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	if ( assets_n == HTTP_MAX_ASSETS || strlen(name) > sizeof(assets[0].path) - 2 ) {
+		printf("%s does not fit in the assets\n", path);
+		return -1;
+	}
+	FILE *f = fopen(path, "rb");
+	if ( f == NULL ) {
+		printf("Cannot read %s\n", path);
+		return -1;
+	}
+	http_asset_t *a = &assets[assets_n];
+	memset(a, 0, sizeof(http_asset_t));
+	a->data[HTTP_IDENTITY] = (char *)malloc(HTTP_MAX_ASSET_SIZE);
+	a->len[HTTP_IDENTITY] = fread(a->data[HTTP_IDENTITY], 1, HTTP_MAX_ASSET_SIZE, f);
+	int truncated = !feof(f);
+	fclose(f);
+	if ( truncated ) {
+		printf("%s is too large\n", path);
+		free(a->data[HTTP_IDENTITY]);
+		return -1;
+	}
+	sprintf(a->path, "/%s", name);
+	a->type = type;
+	a->hash = http_hash(a->data[HTTP_IDENTITY], a->len[HTTP_IDENTITY]);
+	for ( int e = HTTP_GZIP; e < HTTP_ENCODINGS; e++ ) {
+		char *buf = (char *)malloc(a->len[HTTP_IDENTITY] + 64);
+		int len = e == HTTP_GZIP ? http_gzip(a->data[HTTP_IDENTITY], a->len[HTTP_IDENTITY], buf, a->len[HTTP_IDENTITY] + 64)
+			: http_brotli(a->data[HTTP_IDENTITY], a->len[HTTP_IDENTITY], buf, a->len[HTTP_IDENTITY] + 64);
+		if ( len > 0 && len < a->len[HTTP_IDENTITY] ) {
+			a->data[e] = (char *)realloc(buf, len);
+			a->len[e] = len;
+		} else {
+			free(buf);
+		}
+	}
+	a->data[HTTP_IDENTITY] = (char *)realloc(a->data[HTTP_IDENTITY], a->len[HTTP_IDENTITY] + 1);
+	printf("Asset %s: %d bytes, gzip %d, br %d\n", a->path, a->len[HTTP_IDENTITY], a->len[HTTP_GZIP], a->len[HTTP_BROTLI]);
+	assets_n++;
+	return 0;
+}
+
+int http_init(const char *dir) {
+	DIR *d = opendir(dir);
+	if ( d == NULL ) {
+		printf("Cannot open web directory %s\n", dir);
+		return -1;
+	}
+	struct dirent *entry;
+	int result = 0;
+	while ( result == 0 && ( entry = readdir(d) ) != NULL ) {
+		if ( entry->d_name[0] != '.' ) {
+			result = http_load(dir, entry->d_name);
+		}
+	}
+	closedir(d);
+	return result;
+}
+
+void http_free(void) {
+	for ( int i = 0; i < assets_n; i++ ) {
+		for ( int e = 0; e < HTTP_ENCODINGS; e++ ) {
+			free(assets[i].data[e]);
+		}
+	}
+	assets_n = 0;
+}
+
+// Value of a request header, up to the end of the line
+static const char *http_header(const char *request, const char *name, int *len) {
+	const char *line = request;
+	int n = strlen(name);
+	while ( ( line = strstr(line, "\r\n") ) != NULL ) {
+		line += 2;
+		if ( strncasecmp(line, name, n) == 0 && line[n] == ':' ) {
+			const char *value = line + n + 1;
+			while ( *value == ' ' ) {
+				value++;
+			}
+			const char *end = strstr(value, "\r\n");
+			*len = end != NULL ? end - value : strlen(value);
+			return value;
+		}
+	}
+	return NULL;
+}
+
+// One of the comma separated tokens of a header is token, not counting the ones with q=0
+static int http_has_token(const char *request, const char *name, const char *token) {
+	int len;
+	const char *value = http_header(request, name, &len);
+	if ( value == NULL ) {
+		return 0;
+	}
+	char copy[256];
+	if ( len > sizeof(copy) - 1 ) {
+		len = sizeof(copy) - 1;
+	}
+	memcpy(copy, value, len);
+	copy[len] = '\0';
+	char *rest = copy;
+	char *item;
+	while ( ( item = strsep(&rest, ",") ) != NULL ) {
+		char *params = item;
+		char *word = strsep(&params, ";");
+		while ( *word == ' ' || *word == '\t' ) {
+			word++;
+		}
+		int n = strlen(word);
+		while ( n > 0 && ( word[n - 1] == ' ' || word[n - 1] == '\t' ) ) {
+			word[--n] = '\0';
+		}
+		if ( strcasecmp(word, token) != 0 ) {
+			continue;
+		}
+		char *param;
+		int refused = 0;
+		while ( params != NULL && ( param = strsep(&params, ";") ) != NULL ) {
+			while ( *param == ' ' || *param == '\t' ) {
+				param++;
+			}
+			if ( ( param[0] == 'q' || param[0] == 'Q' ) && param[1] == '=' && strtod(&param[2], NULL) == 0 ) {
+				refused = 1;
+			}
+		}
+		if ( !refused ) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int http_is_upgrade(const char *request) {
+	return http_has_token(request, "Upgrade", "websocket");
+}
+
+static int http_respond(io_t *io, int fd, const char *status, const char *headers, const char *body, int len, int head) {
+	char response[512];
+	int n;
+	if ( strncmp(status, "304", 3) == 0 ) {
+		n = snprintf(response, sizeof(response), "HTTP/1.1 %s\r\n%s\r\n", status, headers);
+	} else {
+		n = snprintf(response, sizeof(response), "HTTP/1.1 %s\r\n%sContent-Length: %d\r\n\r\n", status, headers, len);
+	}
+	if ( !head && len > 0 && n + len <= sizeof(response) ) {
+		memcpy(&response[n], body, len);
+		return io_send(io, fd, response, n + len);
+	}
+	if ( io_send(io, fd, response, n) < 0 ) {
+		return -1;
+	}
+	return head || len == 0 ? 0 : io_send(io, fd, body, len);
+}
+
+// Answers one request, returns -1 if the connection should be closed
+int http_request(const char *request, io_t *io, int fd) {
+	char path[64];
+	int head = strncmp(request, "HEAD ", 5) == 0;
+	if ( !head && strncmp(request, "GET ", 4) != 0 ) {
+		http_respond(io, fd, "405 Method Not Allowed", "Allow: GET, HEAD\r\nConnection: close\r\n", NULL, 0, 0);
+		return -1;
+	}
+	const char *start = request + ( head ? 5 : 4 );
+	int len = strcspn(start, " ?\r\n");
+	if ( len == 0 || len > sizeof(path) - 1 ) {
+		http_respond(io, fd, "404 Not Found", "", NULL, 0, head);
+		return 0;
+	}
+	memcpy(path, start, len);
+	path[len] = '\0';
+	int last = http_has_token(request, "Connection", "close");
+	if ( strcmp(path, "/devices") == 0 ) {
+		char body[2048];
+		len = registry_devlist(body, sizeof(body));
+		return http_respond(io, fd, "200 OK", "Content-Type: text/plain\r\nCache-Control: no-store\r\n", body, len, head) < 0 || last ? -1 : 0;
+	}
+	if ( strcmp(path, "/") == 0 ) {
+		strcpy(path, "/index.html");
+	}
+	http_asset_t *a = NULL;
+	for ( int i = 0; i < assets_n; i++ ) {
+		if ( strcmp(assets[i].path, path) == 0 ) {
+			a = &assets[i];
+			break;
+		}
+	}
+	if ( a == NULL ) {
+		return http_respond(io, fd, "404 Not Found", "", NULL, 0, head) < 0 || last ? -1 : 0;
+	}
+	int e = HTTP_IDENTITY;
+	if ( a->data[HTTP_BROTLI] != NULL && http_has_token(request, "Accept-Encoding", "br") ) {
+		e = HTTP_BROTLI;
+	} else if ( a->data[HTTP_GZIP] != NULL && http_has_token(request, "Accept-Encoding", "gzip") ) {
+		e = HTTP_GZIP;
+	}
+	char etag[32];
+	char headers[256];
+	sprintf(etag, "\"%08x%s\"", a->hash, etag_suffix[e]);
+	len = sprintf(headers, "ETag: %s\r\nCache-Control: no-cache\r\nVary: Accept-Encoding\r\n", etag);
+	if ( http_has_token(request, "If-None-Match", etag) ) {
+		return http_respond(io, fd, "304 Not Modified", headers, NULL, 0, 1) < 0 || last ? -1 : 0;
+	}
+	len += sprintf(&headers[len], "Content-Type: %s\r\n", a->type);
+	if ( e != HTTP_IDENTITY ) {
+		sprintf(&headers[len], "Content-Encoding: %s\r\n", encoding_names[e]);
+	}
+	return http_respond(io, fd, "200 OK", headers, a->data[e], a->len[e], head) < 0 || last ? -1 : 0;
+}
@@ -0,0 +1,26 @@
+#ifndef HTTP_H
+#define HTTP_H
+
+/*
+ * Static file server for the control UI, on the websocket port
+ * assets are loaded and compressed once at startup
+ */
+
+#include "io.h"
+
+#define HTTP_DEFAULT_ROOT "../web"
+#define HTTP_MAX_ASSETS 32
+#define HTTP_MAX_ASSET_SIZE ( 256 * 1024 )
+
+#define HTTP_IDENTITY 0
+#define HTTP_GZIP 1
+#define HTTP_BROTLI 2
+#define HTTP_ENCODINGS 3
+
+int http_init(const char *);
+void http_free(void);
+
+int http_is_upgrade(const char *);
+int http_request(const char *, io_t *, int);
+
+#endif
@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <string.h>
+#include "layout.h"
+#include "interlock.h"
+
+/*
+Checked on every packet right before it goes to a master, so a command queued
+while it was safe is not sent once it is not:
+- a train is not started towards a block that is occupied or another train runs into
+- a train is not started towards a block a route holds for another train
+- a switch is not moved under a train or in front of a train running into its block,
+  nor away from the position a route holding its block needs
+Checked when a train enters a block:
+- the train is stopped if the block ahead is occupied or another train runs into it,
+  slowed down to INTERLOCK_SLOW if the block after that is occupied
+- other trains running into the block are stopped
+
+Which motor direction keeps the heading of a train is learnt from its block
+changes, until then the blocks on both sides have to be free. Stop and slow
+commands are sent through the urgent path of the bus, ahead of the queues.
+Trains not seen by a sensor yet are not known to the rules.
+*/
+
+typedef struct {
+	uint8_t speed; // last sent
+	uint8_t dir; // last sent, 1: TWPC_CMD_MOTOR_B
+	uint8_t forward; // dir keeping the heading, LAYOUT_NONE if not known yet
+} interlock_train_t;
+
+static interlock_train_t trains[256];
+static uint8_t neighbors[LAYOUT_MAX_BLOCKS][8];
+static uint8_t neighbors_n[LAYOUT_MAX_BLOCKS];
+static interlock_send_t interlock_send;
+static uint64_t refused;
+static uint64_t stopped;
+static uint64_t slowed;
+
+void interlock_init(interlock_send_t send) {
+	memset(trains, 0, sizeof(trains));
+	for ( int i = 0; i < 256; i++ ) {
+		trains[i].forward = LAYOUT_NONE;
+	}
+	memset(neighbors_n, 0, sizeof(neighbors_n));
+	for ( int block = 0; block < layout.blocks_n; block++ ) {
+		layout_block_t *b = &layout.blocks[block];
+		for ( int i = 0; i < b->sensors_n; i++ ) {
+			layout_sensor_t *s = &layout.sensors[b->sensors[i]];
+			neighbors[block][neighbors_n[block]++] = s->a == block ? s->b : s->a;
+		}
+	}
+	interlock_send = send;
+	refused = 0;
+	stopped = 0;
+	slowed = 0;
+}
+
+// Block may be entered by a train running with dir (either side if the heading is not known)
+static int interlock_towards(int train, int dir, int block) {
+	if ( layout_position(train) == LAYOUT_NONE ) {
+		return 0;
+	}
+	int forward = trains[train].forward;
+	int ahead = forward == LAYOUT_NONE || dir == forward;
+	int behind = forward == LAYOUT_NONE || dir != forward;
+	return ( ahead && layout_ahead(train) == block ) || ( behind && layout.previous[train] == block );
+}
+
+// Block free of other trains, and no other train running into it
+static int interlock_free(int train, int block) {
+	int occupant = layout_occupant(block);
+	if ( occupant != 0 && occupant != train ) {
+		return 0;
+	}
+	for ( int i = 0; i < neighbors_n[block]; i++ ) {
+		int other = layout_occupant(neighbors[block][i]);
+		if ( other != 0 && other != train && trains[other].speed > 0 && interlock_towards(other, trains[other].dir, block) ) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Free, and not held by the route of another train
+int interlock_clear(int train, int block) {
+	if ( block == LAYOUT_NONE ) {
+		return 1;
+	}
+	int holder = layout.reserved[block];
+	return ( holder == 0 || holder == train ) && interlock_free(train, block);
+}
+
+static int interlock_may_run(int train, int dir) {
+	if ( layout_position(train) == LAYOUT_NONE ) {
+		return 1;
+	}
+	int forward = trains[train].forward;
+	int ahead = forward == LAYOUT_NONE || dir == forward;
+	int behind = forward == LAYOUT_NONE || dir != forward;
+	return ( !ahead || interlock_clear(train, layout_ahead(train)) ) && ( !behind || interlock_clear(train, layout.previous[train]) );
+}
+
+// Second block ahead of a train keeping its heading
+static int interlock_beyond(int train) {
+	int block = layout_position(train);
+	int ahead = layout_ahead(train);
+	if ( ahead == LAYOUT_NONE ) {
+		return LAYOUT_NONE;
+	}
+	int sw = layout.blocks[ahead].sw;
+	return layout_exit(block, ahead, sw == LAYOUT_NONE ? 0 : layout.switches[sw].state);
+}
+
+static void interlock_motor(int train, int speed) {
+	twpc_packet_t packet;
+	packet.uid = train;
+	packet.cmd = trains[train].dir ? TWPC_CMD_MOTOR_B : TWPC_CMD_MOTOR_A;
+	packet.arg = speed;
+	packet.checksum = TWPC_CHECKSUM(packet);
+	interlock_send(&packet);
+}
+
+// 1 if interlock_check passes the packet as it is, a group packet may stand for it then
+int interlock_unchanged(const twpc_packet_t *packet) {
+	if ( packet->cmd == TWPC_CMD_MOTOR_A || packet->cmd == TWPC_CMD_MOTOR_B ) {
+		int dir = packet->cmd == TWPC_CMD_MOTOR_B;
+		return packet->arg == 0 || ( interlock_may_run(packet->uid, dir) && !( packet->arg > INTERLOCK_SLOW
+			&& dir == trains[packet->uid].forward && layout_occupant(interlock_beyond(packet->uid)) != 0 ) );
+	}
+	return packet->cmd != TWPC_CMD_SW_STRAIGHT && packet->cmd != TWPC_CMD_SW_FORK;
+}
+
+// Returns -1 if the packet must not be sent, a motor command may be slowed down
+int interlock_check(twpc_packet_t *packet) {
+	if ( packet->cmd == TWPC_CMD_MOTOR_A || packet->cmd == TWPC_CMD_MOTOR_B ) {
+		int dir = packet->cmd == TWPC_CMD_MOTOR_B;
+		int lo = packet->uid == 255 ? 1 : packet->uid;
+		int hi = packet->uid == 255 ? 254 : packet->uid;
+		for ( int train = lo; train <= hi && packet->arg > 0; train++ ) {
+			if ( !interlock_may_run(train, dir) ) {
+				refused++;
+				return -1;
+			}
+		}
+		if ( packet->uid != 255 && packet->arg > INTERLOCK_SLOW && dir == trains[packet->uid].forward
+			&& layout_occupant(interlock_beyond(packet->uid)) != 0 ) {
+			packet->arg = INTERLOCK_SLOW;
+			packet->checksum = TWPC_CHECKSUM(*packet);
+			slowed++;
+		}
+		for ( int train = lo; train <= hi; train++ ) {
+			trains[train].speed = packet->arg;
+			trains[train].dir = dir;
+		}
+	} else if ( packet->cmd == TWPC_CMD_SW_STRAIGHT || packet->cmd == TWPC_CMD_SW_FORK ) {
+		int sw = layout_switch(packet->uid, packet->arg);
+		if ( sw >= 0 ) {
+			int block = layout.switches[sw].block;
+			int state = packet->cmd == TWPC_CMD_SW_FORK;
+			int needed = layout.reserved_state[block];
+			if ( !interlock_free(0, block) || ( needed != LAYOUT_NONE && needed != state ) ) {
+				refused++;
+				return -1;
+			}
+			layout_set_switch(sw, state);
+		}
+	}
+	return 0;
+}
+
+// Motor direction running train into a block next to it, -1 if not known
+int interlock_heading(int train, int block) {
+	int forward = trains[train].forward;
+	if ( forward == LAYOUT_NONE || layout_position(train) == LAYOUT_NONE ) {
+		return -1;
+	} else if ( layout_ahead(train) == block ) {
+		return forward;
+	} else if ( layout.previous[train] == block ) {
+		return !forward;
+	}
+	return -1;
+}
+
+// Train entered block
+void interlock_moved(int train, int block) {
+	interlock_train_t *t = &trains[train];
+	if ( t->speed > 0 ) {
+		t->forward = t->dir;
+	}
+	for ( int i = 0; i < neighbors_n[block]; i++ ) {
+		int other = layout_occupant(neighbors[block][i]);
+		if ( other != 0 && other != train && trains[other].speed > 0 && interlock_towards(other, trains[other].dir, block) ) {
+			interlock_motor(other, 0);
+			stopped++;
+		}
+	}
+	if ( t->speed == 0 ) {
+		return;
+	}
+	if ( !interlock_clear(train, layout_ahead(train)) ) {
+		interlock_motor(train, 0);
+		stopped++;
+	} else if ( t->speed > INTERLOCK_SLOW && layout_occupant(interlock_beyond(train)) != 0 ) {
+		interlock_motor(train, INTERLOCK_SLOW);
+		slowed++;
+	}
+}
+
+void interlock_report(void) {
+	printf("interlock: %llu refused, %llu stopped, %llu slowed\n", (unsigned long long)refused,
+		(unsigned long long)stopped, (unsigned long long)slowed);
+}
+
+int interlock_save(void *data) {
+	memcpy(data, trains, sizeof(trains));
+	return sizeof(trains);
+}
+
+int interlock_restore(const void *data, int len) {
+	if ( len != sizeof(trains) ) {
+		return -1;
+	}
+	memcpy(trains, data, sizeof(trains));
+	return 0;
+}
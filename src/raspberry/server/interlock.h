@@ -0,0 +1,28 @@
+#ifndef INTERLOCK_H
+#define INTERLOCK_H
+
+/*
+ * Interlocking: safety rules between the layout and the bus
+ * every packet is checked right before it is written to a master,
+ * block changes stop or slow the trains running into an occupied block
+ * runs in the bus thread
+ */
+
+#include <stdint.h>
+#include "../../twpc_def.h"
+
+#define INTERLOCK_SLOW 64 // speed limit with an occupied block two ahead
+
+typedef void (*interlock_send_t)(twpc_packet_t *);
+
+void interlock_init(interlock_send_t);
+int interlock_unchanged(const twpc_packet_t *);
+int interlock_check(twpc_packet_t *);
+void interlock_moved(int, int);
+int interlock_heading(int, int);
+int interlock_clear(int, int);
+int interlock_save(void *);
+int interlock_restore(const void *, int);
+void interlock_report(void);
+
+#endif
@@ -0,0 +1,139 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "io.h"
+
+int io_backend(const char *name) {
+	if ( strcmp(name, "epoll") == 0 ) {
+		return IO_BACKEND_EPOLL;
+	} else if ( strcmp(name, "uring") == 0 || strcmp(name, "io_uring") == 0 ) {
+		return IO_BACKEND_URING;
+	}
+	return -1;
+}
+
+const char *io_backend_name(int backend) {
+	return backend == IO_BACKEND_URING ? io_uring_ops.name : io_epoll_ops.name;
+}
+
+io_t *io_create(int backend) {
+	io_t *io = (io_t *)malloc(sizeof(io_t));
+	if ( io == NULL ) {
+		return NULL;
+	}
+	memset(io, 0, sizeof(io_t));
+	slab_init(&io->shared, "frames", sizeof(io_shared_t), 8, IO_SHARED_BUFS / 8);
+	io->ops = backend == IO_BACKEND_URING ? &io_uring_ops : &io_epoll_ops;
+	if ( io->ops->init(io) < 0 ) {
+		printf("Failed to initialize %s backend\n", io->ops->name);
+		free(io);
+		return NULL;
+	}
+	return io;
+}
+
+void io_destroy(io_t *io) {
+	io->ops->close(io);
+	slab_destroy(&io->shared);
+	free(io);
+}
+
+int io_add(io_t *io, int fd, int kind) {
+	if ( fd < 0 || fd >= IO_MAX_FDS ) {
+		return -1;
+	}
+	return io->ops->add(io, fd, kind);
+}
+
+void io_del(io_t *io, int fd) {
+	if ( fd >= 0 && fd < IO_MAX_FDS ) {
+		io->ops->del(io, fd);
+	}
+}
+
+int io_send(io_t *io, int fd, const char *data, int len) {
+	io->stats.sends++;
+	return io->ops->send(io, fd, data, len);
+}
+
+// Shared buffer referenced once by the caller, NULL if all are still being sent
+io_shared_t *io_shared_get(io_t *io) {
+	io_shared_t *b = (io_shared_t *)slab_alloc(&io->shared);
+	if ( b != NULL ) {
+		b->pool = &io->shared;
+		b->refs = 1;
+		b->data = b->buffer;
+		b->len = 0;
+	}
+	return b;
+}
+
+void io_shared_put(io_shared_t *b) {
+	if ( --b->refs == 0 ) {
+		slab_release(b->pool, b);
+	}
+}
+
+// Sends b without copying it where the backend can, b stays referenced until the send completed
+int io_send_shared(io_t *io, int fd, io_shared_t *b) {
+	io->stats.sends++;
+	return io->ops->send_shared(io, fd, b);
+}
+
+// Blocks until the bytes queued for fd are out, at most timeout_ms, -1 if some are left
+int io_drain(io_t *io, int fd, int timeout_ms) {
+	if ( fd < 0 || fd >= IO_MAX_FDS ) {
+		return -1;
+	}
+	return io->ops->drain(io, fd, timeout_ms);
+}
+
+int io_wait(io_t *io, io_event_t *events, int max, int timeout_ms) {
+	int n = io->ops->wait(io, events, max, timeout_ms);
+	if ( n > 0 ) {
+		io->stats.events += n;
+	} else if ( n == 0 ) {
+		io->stats.idle++;
+	}
+	return n;
+}
+
+// Queues bytes behind the ones waiting, -1 if the fd would have more than IO_PENDING_MAX waiting
+int io_pending_add(io_pending_t *p, const char *data, int len) {
+	if ( p->len - p->off + len > IO_PENDING_MAX ) {
+		return -1;
+	}
+	if ( p->len + len > p->size ) {
+		memmove(p->data, p->data + p->off, p->len - p->off);
+		p->len -= p->off;
+		p->off = 0;
+	}
+	if ( p->len + len > p->size ) {
+		int size = p->size > 0 ? p->size : IO_BUF_SIZE;
+		while ( size < p->len + len ) {
+			size *= 2;
+		}
+		char *data = (char *)realloc(p->data, size);
+		if ( data == NULL ) {
+			return -1;
+		}
+		p->data = data;
+		p->size = size;
+	}
+	memcpy(p->data + p->len, data, len);
+	p->len += len;
+	return 0;
+}
+
+// n bytes of the front went out, the buffer is given back once all of them did
+void io_pending_take(io_pending_t *p, int n) {
+	p->off += n;
+	if ( p->off >= p->len ) {
+		io_pending_free(p);
+	}
+}
+
+void io_pending_free(io_pending_t *p) {
+	free(p->data);
+	memset(p, 0, sizeof(io_pending_t));
+}
@@ -0,0 +1,105 @@
+#ifndef IO_H
+#define IO_H
+
+/*
+ * Event driven I/O layer for the server
+ * Backends: epoll (readiness) and io_uring (completion)
+ */
+
+#include <stdint.h>
+#include "slab.h"
+
+#define IO_BACKEND_EPOLL 0
+#define IO_BACKEND_URING 1
+
+// what a registered fd is used for
+#define IO_FD_LISTEN 1 // listening socket, produces IO_EV_ACCEPT
+#define IO_FD_SOCKET 2 // client connection, produces IO_EV_DATA / IO_EV_CLOSE
+#define IO_FD_STREAM 3 // uart, eventfd etc., produces IO_EV_DATA, IO_EV_CLOSE on hangup
+
+#define IO_EV_ACCEPT 1
+#define IO_EV_DATA 2
+#define IO_EV_CLOSE 3
+
+#define IO_MAX_FDS 1024
+#define IO_MAX_EVENTS 64
+#define IO_BUF_SIZE 2048
+#define IO_SHARED_BUFS 64 // at most, in slabs of 8
+#define IO_SHARED_SIZE 4096
+#define IO_PENDING_MAX ( 1024 * 1024 ) // bytes waiting for a slow fd before it counts as gone
+
+typedef struct {
+	int type;
+	int fd;
+	char *data; // valid until the next io_wait()
+	int len;
+} io_event_t;
+
+typedef struct {
+	uint64_t syscalls;
+	uint64_t idle; // waits which timed out with nothing, a syscall each
+	uint64_t events;
+	uint64_t sends;
+} io_stats_t;
+
+// Bytes of an fd which did not fit into the socket (epoll) or the send slots (io_uring) yet
+typedef struct {
+	char *data;
+	int size;
+	int off; // sent already
+	int len;
+} io_pending_t;
+
+// Data sent as it is to many fds, back in the pool when the last send of it is done
+typedef struct {
+	slab_t *pool;
+	int refs;
+	char *data; // set by the owner, inside buffer
+	int len;
+	char buffer[IO_SHARED_SIZE];
+} io_shared_t;
+
+typedef struct io_s io_t;
+
+typedef struct {
+	const char *name;
+	int (*init)(io_t *);
+	void (*close)(io_t *);
+	int (*add)(io_t *, int, int);
+	void (*del)(io_t *, int);
+	int (*send)(io_t *, int, const char *, int);
+	int (*send_shared)(io_t *, int, io_shared_t *);
+	int (*drain)(io_t *, int, int);
+	int (*wait)(io_t *, io_event_t *, int, int);
+} io_ops_t;
+
+struct io_s {
+	const io_ops_t *ops;
+	io_stats_t stats;
+	void *priv;
+	slab_t shared;
+};
+
+extern const io_ops_t io_epoll_ops;
+extern const io_ops_t io_uring_ops;
+
+int io_backend(const char *);
+const char *io_backend_name(int);
+
+io_t *io_create(int);
+void io_destroy(io_t *);
+
+int io_add(io_t *, int, int);
+void io_del(io_t *, int);
+int io_send(io_t *, int, const char *, int);
+io_shared_t *io_shared_get(io_t *);
+void io_shared_put(io_shared_t *);
+int io_send_shared(io_t *, int, io_shared_t *);
+int io_drain(io_t *, int, int);
+int io_wait(io_t *, io_event_t *, int, int);
+
+int io_pending_add(io_pending_t *, const char *, int);
+void io_pending_take(io_pending_t *, int);
+void io_pending_free(io_pending_t *);
+
+#endif
@@ -0,0 +1,250 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include "io.h"
+
+/*
+ * epoll backend
+ * one epoll_wait per loop, then one accept/recv/read per ready fd
+ * what a full socket did not take waits in the pending bytes of its fd,
+ * the fd is watched for EPOLLOUT until they are out
+ */
+
+typedef struct {
+	int epfd;
+	int kind[IO_MAX_FDS];
+	io_pending_t pending[IO_MAX_FDS];
+	char buffer[IO_MAX_EVENTS][IO_BUF_SIZE];
+} io_epoll_t;
+
+static int io_epoll_init(io_t *io) {
+	io_epoll_t *e = (io_epoll_t *)malloc(sizeof(io_epoll_t));
+	if ( e == NULL ) {
+		return -1;
+	}
+	memset(e, 0, sizeof(io_epoll_t));
+	e->epfd = epoll_create1(EPOLL_CLOEXEC);
+	io->stats.syscalls++;
+	if ( e->epfd < 0 ) {
+		free(e);
+		return -1;
+	}
+	io->priv = e;
+	return 0;
+}
+
+static void io_epoll_close(io_t *io) {
+	io_epoll_t *e = (io_epoll_t *)io->priv;
+	for ( int fd = 0; fd < IO_MAX_FDS; fd++ ) {
+		io_pending_free(&e->pending[fd]);
+	}
+	close(e->epfd);
+	free(e);
+}
+
+// Watches the fd for EPOLLOUT too while it has pending bytes
+static int io_epoll_watch(io_t *io, int fd, int out) {
+	io_epoll_t *e = (io_epoll_t *)io->priv;
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | ( out ? EPOLLOUT : 0 );
+	ev.data.fd = fd;
+	io->stats.syscalls++;
+	return epoll_ctl(e->epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+static int io_epoll_add(io_t *io, int fd, int kind) {
+	io_epoll_t *e = (io_epoll_t *)io->priv;
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	io->stats.syscalls++;
+	if ( epoll_ctl(e->epfd, EPOLL_CTL_ADD, fd, &ev) < 0 ) {
+		return -1;
+	}
+	e->kind[fd] = kind;
+	return 0;
+}
+
+static void io_epoll_del(io_t *io, int fd) {
+	io_epoll_t *e = (io_epoll_t *)io->priv;
+	if ( e->kind[fd] ) {
+		io->stats.syscalls++;
+		epoll_ctl(e->epfd, EPOLL_CTL_DEL, fd, NULL);
+		e->kind[fd] = 0;
+	}
+	io_pending_free(&e->pending[fd]);
+}
+
+// Bytes the fd took, 0 if it is full, -1 on an error
+static int io_epoll_write(io_t *io, int fd, const char *data, int len) {
+	io_epoll_t *e = (io_epoll_t *)io->priv;
+	int result;
+	io->stats.syscalls++;
+	if ( e->kind[fd] == IO_FD_SOCKET ) {
+		result = send(fd, data, len, MSG_NOSIGNAL);
+	} else {
+		result = write(fd, data, len);
+	}
+	if ( result < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ) ) {
+		return 0;
+	}
+	return result;
+}
+
+// What the fd does not take now goes out when it is writable, -1 only on an error or a client too slow
+static int io_epoll_send(io_t *io, int fd, const char *data, int len) {
+	io_epoll_t *e = (io_epoll_t *)io->priv;
+	io_pending_t *p = &e->pending[fd];
+	if ( !e->kind[fd] ) {
+		return -1;
+	}
+	if ( p->len > 0 ) {
+		return io_pending_add(p, data, len); // behind the ones waiting, EPOLLOUT is on
+	}
+	int n = io_epoll_write(io, fd, data, len);
+	if ( n < 0 ) {
+		return -1;
+	}
+	if ( n == len ) {
+		return 0;
+	}
+	if ( io_pending_add(p, data + n, len - n) < 0 || io_epoll_watch(io, fd, 1) < 0 ) {
+		return -1;
+	}
+	return 0;
+}
+
+// The fd is writable: the pending bytes it takes, -1 if it failed
+static int io_epoll_flush(io_t *io, int fd) {
+	io_epoll_t *e = (io_epoll_t *)io->priv;
+	io_pending_t *p = &e->pending[fd];
+	if ( p->len == 0 ) {
+		return 0;
+	}
+	int n = io_epoll_write(io, fd, p->data + p->off, p->len - p->off);
+	if ( n < 0 ) {
+		return -1;
+	}
+	io_pending_take(p, n);
+	if ( p->len == 0 ) {
+		return io_epoll_watch(io, fd, 0);
+	}
+	return 0;
+}
+
+// send() is done with the data when it returns, what it did not take is copied, nothing to keep referenced
+static int io_epoll_send_shared(io_t *io, int fd, io_shared_t *b) {
+	return io_epoll_send(io, fd, b->data, b->len);
+}
+
+static int io_epoll_wait(io_t *io, io_event_t *events, int max, int timeout_ms) {
+	io_epoll_t *e = (io_epoll_t *)io->priv;
+	struct epoll_event ready[IO_MAX_EVENTS];
+	if ( max > IO_MAX_EVENTS ) {
+		max = IO_MAX_EVENTS;
+	}
+	io->stats.syscalls++;
+	int n = epoll_wait(e->epfd, ready, max, timeout_ms);
+	if ( n < 0 ) {
+		return errno == EINTR ? 0 : -1;
+	}
+	int count = 0;
+	for ( int i = 0; i < n && count < max; i++ ) {
+		int fd = ready[i].data.fd;
+		io_event_t *ev = &events[count];
+		ev->fd = fd;
+		ev->data = e->buffer[count];
+		ev->len = 0;
+		if ( ( ready[i].events & EPOLLOUT ) && io_epoll_flush(io, fd) < 0 ) {
+			if ( e->kind[fd] == IO_FD_STREAM ) {
+				io_epoll_del(io, fd);
+			} else {
+				io_pending_free(&e->pending[fd]); // the owner closes it
+			}
+			ev->type = IO_EV_CLOSE;
+			count++;
+			continue;
+		}
+		if ( !( ready[i].events & ( EPOLLIN | EPOLLHUP | EPOLLERR ) ) ) {
+			continue;
+		}
+		if ( e->kind[fd] == IO_FD_LISTEN ) {
+			// level triggered: anything left in the backlog is reported again
+			io->stats.syscalls++;
+			int sock = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+			if ( sock >= 0 ) {
+				ev->type = IO_EV_ACCEPT;
+				ev->fd = sock;
+				count++;
+			}
+		} else if ( e->kind[fd] == IO_FD_SOCKET ) {
+			io->stats.syscalls++;
+			int len = recv(fd, ev->data, IO_BUF_SIZE, 0);
+			if ( len > 0 ) {
+				ev->type = IO_EV_DATA;
+				ev->len = len;
+				count++;
+			} else if ( len == 0 || ( errno != EAGAIN && errno != EWOULDBLOCK ) ) {
+				ev->type = IO_EV_CLOSE;
+				count++;
+			}
+		} else if ( e->kind[fd] == IO_FD_STREAM ) {
+			io->stats.syscalls++;
+			int len = read(fd, ev->data, IO_BUF_SIZE);
+			if ( len > 0 ) {
+				ev->type = IO_EV_DATA;
+				ev->len = len;
+				count++;
+			} else if ( len == 0 || ( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR ) ) {
+				// hangup (unplugged adapter), stop polling it
+				io_epoll_del(io, fd);
+				ev->type = IO_EV_CLOSE;
+				count++;
+			}
+		}
+	}
+	return count;
+}
+
+static int64_t io_epoll_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// Waits for the fd to take its pending bytes, the fd stays non-blocking
+static int io_epoll_drain(io_t *io, int fd, int timeout_ms) {
+	io_epoll_t *e = (io_epoll_t *)io->priv;
+	struct pollfd pfd;
+	int64_t end = io_epoll_ms() + timeout_ms;
+	pfd.fd = fd;
+	pfd.events = POLLOUT;
+	while ( e->pending[fd].len > 0 ) {
+		int left = (int)( end - io_epoll_ms() );
+		io->stats.syscalls++;
+		if ( left <= 0 || poll(&pfd, 1, left) <= 0 || ( pfd.revents & ( POLLERR | POLLHUP ) ) || io_epoll_flush(io, fd) < 0 ) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+const io_ops_t io_epoll_ops = {
+	"epoll",
+	io_epoll_init,
+	io_epoll_close,
+	io_epoll_add,
+	io_epoll_del,
+	io_epoll_send,
+	io_epoll_send_shared,
+	io_epoll_drain,
+	io_epoll_wait
+};
@@ -0,0 +1,602 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "io.h"
+
+/*
+ * io_uring backend (raw syscalls, no liburing on the Pi)
+ * - multishot accept on listening sockets
+ * - multishot recv into a provided buffer ring
+ * - sends are copied into slots and submitted together with the wait,
+ *   so a whole loop iteration costs a single io_uring_enter
+ * - shared buffers are not copied, their slot only refers to them
+ * - what finds no free slot waits in the pending bytes of its fd and goes
+ *   into slots as they come back, a short send goes again from where it ended
+ */
+
+#define IO_URING_ENTRIES 256
+#define IO_URING_BUFS 64 // power of two
+#define IO_URING_BGID 0
+#define IO_URING_SLOTS 128
+
+#define IO_OP_ACCEPT 1
+#define IO_OP_RECV 2
+#define IO_OP_READ 3
+#define IO_OP_SEND 4
+#define IO_OP_CANCEL 5
+
+// user_data: op (8) | gen (16) | fd (16) | slot (16)
+#define IO_UDATA(op, gen, fd, slot) ( ( (uint64_t)(op) << 56 ) | ( (uint64_t)(gen) << 40 ) | ( (uint64_t)(fd) << 16 ) | (uint64_t)(slot) )
+#define IO_UDATA_OP(u) ( (int)( (u) >> 56 ) )
+#define IO_UDATA_GEN(u) ( (uint16_t)( (u) >> 40 ) )
+#define IO_UDATA_FD(u) ( (int)( ( (u) >> 16 ) & 0xFFFF ) )
+#define IO_UDATA_SLOT(u) ( (int)( (u) & 0xFFFF ) )
+
+typedef struct {
+	int fd;
+	int len;
+	int off; // sent already
+	int next;
+	io_shared_t *shared; // sent instead of data if set
+	char data[IO_BUF_SIZE];
+} io_uring_slot_t;
+
+typedef struct {
+	int ring_fd;
+	unsigned sq_entries;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned sq_local;
+	unsigned sq_pending;
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_map;
+	size_t sq_map_size;
+	void *cq_map;
+	size_t cq_map_size;
+	size_t sqes_size;
+	// provided buffers
+	struct io_uring_buf_ring *br;
+	char *bufs;
+	uint16_t br_tail;
+	int recycle[IO_URING_BUFS];
+	int recycle_n;
+	// registered fds
+	int kind[IO_MAX_FDS];
+	uint16_t gen[IO_MAX_FDS];
+	uint64_t armed[IO_MAX_FDS];
+	// send queues, one chain of slots per fd
+	int send_head[IO_MAX_FDS];
+	int send_tail[IO_MAX_FDS];
+	int send_busy[IO_MAX_FDS];
+	io_pending_t pending[IO_MAX_FDS]; // behind the slots
+	int dirty[IO_MAX_FDS];
+	int dirty_n;
+	int slot_free;
+	io_uring_slot_t slots[IO_URING_SLOTS];
+} io_uring_t;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned submit, unsigned min, unsigned flags, void *arg, size_t size) {
+	return (int)syscall(__NR_io_uring_enter, fd, submit, min, flags, arg, size);
+}
+
+static int sys_io_uring_register(int fd, unsigned op, void *arg, unsigned n) {
+	return (int)syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+static int io_uring_submit(io_t *io, unsigned min, int timeout_ms) {
+	io_uring_t *r = (io_uring_t *)io->priv;
+	__atomic_store_n(r->sq_tail, r->sq_local, __ATOMIC_RELEASE);
+	unsigned flags = min ? IORING_ENTER_GETEVENTS : 0;
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg;
+	memset(&arg, 0, sizeof(arg));
+	arg.sigmask_sz = _NSIG / 8;
+	if ( min && timeout_ms >= 0 ) {
+		ts.tv_sec = timeout_ms / 1000;
+		ts.tv_nsec = ( timeout_ms % 1000 ) * 1000000L;
+		arg.ts = (uint64_t)(uintptr_t)&ts;
+	}
+	io->stats.syscalls++;
+	int result = sys_io_uring_enter(r->ring_fd, r->sq_pending, min, flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+	if ( result >= 0 ) {
+		r->sq_pending -= result < (int)r->sq_pending ? result : r->sq_pending;
+	} else if ( errno == ETIME || errno == EINTR || errno == EBUSY ) {
+		result = 0;
+	}
+	return result;
+}
+
+static struct io_uring_sqe *io_uring_sqe(io_t *io) {
+	io_uring_t *r = (io_uring_t *)io->priv;
+	if ( r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries ) {
+		io_uring_submit(io, 0, 0); // ring full, hand it over early
+	}
+	unsigned idx = r->sq_local & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	r->sq_array[idx] = idx;
+	r->sq_local++;
+	r->sq_pending++;
+	return sqe;
+}
+
+static void io_uring_buf_put(io_uring_t *r, int bid) {
+	struct io_uring_buf *buf = &r->br->bufs[r->br_tail & ( IO_URING_BUFS - 1 )];
+	buf->addr = (uint64_t)(uintptr_t)( r->bufs + bid * IO_BUF_SIZE );
+	buf->len = IO_BUF_SIZE;
+	buf->bid = bid;
+	r->br_tail++;
+}
+
+static void io_uring_arm(io_t *io, int fd) {
+	io_uring_t *r = (io_uring_t *)io->priv;
+	struct io_uring_sqe *sqe = io_uring_sqe(io);
+	sqe->fd = fd;
+	if ( r->kind[fd] == IO_FD_LISTEN ) {
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+		sqe->accept_flags = SOCK_CLOEXEC;
+		sqe->user_data = IO_UDATA(IO_OP_ACCEPT, r->gen[fd], fd, 0);
+	} else if ( r->kind[fd] == IO_FD_SOCKET ) {
+		sqe->opcode = IORING_OP_RECV;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = IO_URING_BGID;
+		sqe->user_data = IO_UDATA(IO_OP_RECV, r->gen[fd], fd, 0);
+	} else {
+		sqe->opcode = IORING_OP_READ;
+		sqe->off = (uint64_t)-1;
+		sqe->len = IO_BUF_SIZE;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = IO_URING_BGID;
+		sqe->user_data = IO_UDATA(IO_OP_READ, r->gen[fd], fd, 0);
+	}
+	r->armed[fd] = sqe->user_data;
+}
+
+static int io_uring_slot_alloc(io_uring_t *r) {
+	int s = r->slot_free;
+	if ( s >= 0 ) {
+		r->slot_free = r->slots[s].next;
+		r->slots[s].len = 0;
+		r->slots[s].off = 0;
+		r->slots[s].next = -1;
+		r->slots[s].shared = NULL;
+	}
+	return s;
+}
+
+static void io_uring_slot_release(io_uring_t *r, int s) {
+	if ( r->slots[s].shared != NULL ) {
+		io_shared_put(r->slots[s].shared);
+		r->slots[s].shared = NULL;
+	}
+	r->slots[s].fd = -1;
+	r->slots[s].next = r->slot_free;
+	r->slot_free = s;
+}
+
+static void io_uring_mark_dirty(io_uring_t *r, int fd) {
+	for ( int i = 0; i < r->dirty_n; i++ ) {
+		if ( r->dirty[i] == fd ) {
+			return;
+		}
+	}
+	r->dirty[r->dirty_n++] = fd;
+}
+
+// Copies data into the slots of the fd, returns how much of it found a slot
+static int io_uring_copy(io_uring_t *r, int fd, const char *data, int len) {
+	int done = 0;
+	while ( done < len ) {
+		int t = r->send_tail[fd];
+		if ( t < 0 || t == r->send_busy[fd] || r->slots[t].shared != NULL || r->slots[t].len == IO_BUF_SIZE ) {
+			int s = io_uring_slot_alloc(r);
+			if ( s < 0 ) {
+				break;
+			}
+			r->slots[s].fd = fd;
+			if ( t < 0 ) {
+				r->send_head[fd] = s;
+			} else {
+				r->slots[t].next = s;
+			}
+			r->send_tail[fd] = s;
+			t = s;
+		}
+		int n = IO_BUF_SIZE - r->slots[t].len;
+		if ( n > len - done ) {
+			n = len - done;
+		}
+		memcpy(r->slots[t].data + r->slots[t].len, data + done, n);
+		r->slots[t].len += n;
+		done += n;
+	}
+	return done;
+}
+
+static void io_uring_flush(io_t *io) {
+	io_uring_t *r = (io_uring_t *)io->priv;
+	int waiting = 0; // fds with pending bytes still, dirty again
+	for ( int i = 0; i < r->dirty_n; i++ ) {
+		int fd = r->dirty[i];
+		io_pending_t *p = &r->pending[fd];
+		if ( p->len > 0 ) {
+			io_pending_take(p, io_uring_copy(r, fd, p->data + p->off, p->len - p->off));
+			if ( p->len > 0 ) {
+				r->dirty[waiting++] = fd;
+			}
+		}
+		int s = r->send_head[fd];
+		if ( s < 0 || r->send_busy[fd] >= 0 ) {
+			continue;
+		}
+		struct io_uring_sqe *sqe = io_uring_sqe(io);
+		sqe->fd = fd;
+		if ( r->slots[s].shared != NULL ) {
+			sqe->addr = (uint64_t)(uintptr_t)( r->slots[s].shared->data + r->slots[s].off );
+			sqe->len = r->slots[s].shared->len - r->slots[s].off;
+		} else {
+			sqe->addr = (uint64_t)(uintptr_t)( r->slots[s].data + r->slots[s].off );
+			sqe->len = r->slots[s].len - r->slots[s].off;
+		}
+		if ( r->kind[fd] == IO_FD_SOCKET ) {
+			sqe->opcode = IORING_OP_SEND;
+			sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+		} else {
+			sqe->opcode = IORING_OP_WRITE;
+			sqe->off = (uint64_t)-1;
+		}
+		sqe->user_data = IO_UDATA(IO_OP_SEND, r->gen[fd], fd, s);
+		r->send_busy[fd] = s;
+	}
+	r->dirty_n = waiting;
+}
+
+static void io_uring_unmap(io_uring_t *r) {
+	if ( r->br != NULL ) {
+		munmap(r->br, IO_URING_BUFS * sizeof(struct io_uring_buf));
+	}
+	if ( r->sqes != NULL ) {
+		munmap(r->sqes, r->sqes_size);
+	}
+	if ( r->cq_map != NULL && r->cq_map != r->sq_map ) {
+		munmap(r->cq_map, r->cq_map_size);
+	}
+	if ( r->sq_map != NULL ) {
+		munmap(r->sq_map, r->sq_map_size);
+	}
+	free(r->bufs);
+	for ( int fd = 0; fd < IO_MAX_FDS; fd++ ) {
+		io_pending_free(&r->pending[fd]);
+	}
+	if ( r->ring_fd >= 0 ) {
+		close(r->ring_fd);
+	}
+	free(r);
+}
+
+static int io_uring_init(io_t *io) {
+	io_uring_t *r = (io_uring_t *)malloc(sizeof(io_uring_t));
+	if ( r == NULL ) {
+		return -1;
+	}
+	memset(r, 0, sizeof(io_uring_t));
+	for ( int i = 0; i < IO_MAX_FDS; i++ ) {
+		r->send_head[i] = -1;
+		r->send_tail[i] = -1;
+		r->send_busy[i] = -1;
+	}
+	r->slot_free = -1;
+	for ( int i = IO_URING_SLOTS - 1; i >= 0; i-- ) {
+		io_uring_slot_release(r, i);
+	}
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	io->stats.syscalls++;
+	r->ring_fd = sys_io_uring_setup(IO_URING_ENTRIES, &p);
+	if ( r->ring_fd < 0 || !( p.features & IORING_FEAT_EXT_ARG ) ) {
+		io_uring_unmap(r);
+		return -1;
+	}
+	r->sq_entries = p.sq_entries;
+	r->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if ( p.features & IORING_FEAT_SINGLE_MMAP ) {
+		if ( r->cq_map_size > r->sq_map_size ) {
+			r->sq_map_size = r->cq_map_size;
+		}
+		r->cq_map_size = r->sq_map_size;
+	}
+	r->sq_map = mmap(NULL, r->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->ring_fd, IORING_OFF_SQ_RING);
+	if ( r->sq_map == MAP_FAILED ) {
+		r->sq_map = NULL;
+		io_uring_unmap(r);
+		return -1;
+	}
+	if ( p.features & IORING_FEAT_SINGLE_MMAP ) {
+		r->cq_map = r->sq_map;
+	} else {
+		r->cq_map = mmap(NULL, r->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->ring_fd, IORING_OFF_CQ_RING);
+		if ( r->cq_map == MAP_FAILED ) {
+			r->cq_map = NULL;
+			io_uring_unmap(r);
+			return -1;
+		}
+	}
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = (struct io_uring_sqe *)mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->ring_fd, IORING_OFF_SQES);
+	if ( r->sqes == MAP_FAILED ) {
+		r->sqes = NULL;
+		io_uring_unmap(r);
+		return -1;
+	}
+	char *sq = (char *)r->sq_map;
+	char *cq = (char *)r->cq_map;
+	r->sq_head = (unsigned *)( sq + p.sq_off.head );
+	r->sq_tail = (unsigned *)( sq + p.sq_off.tail );
+	r->sq_mask = (unsigned *)( sq + p.sq_off.ring_mask );
+	r->sq_array = (unsigned *)( sq + p.sq_off.array );
+	r->sq_local = *r->sq_tail;
+	r->cq_head = (unsigned *)( cq + p.cq_off.head );
+	r->cq_tail = (unsigned *)( cq + p.cq_off.tail );
+	r->cq_mask = (unsigned *)( cq + p.cq_off.ring_mask );
+	r->cqes = (struct io_uring_cqe *)( cq + p.cq_off.cqes );
+	// provided buffer ring for recv/read
+	r->bufs = (char *)malloc(IO_URING_BUFS * IO_BUF_SIZE);
+	r->br = (struct io_uring_buf_ring *)mmap(NULL, IO_URING_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if ( r->bufs == NULL || r->br == MAP_FAILED ) {
+		if ( r->br == MAP_FAILED ) {
+			r->br = NULL;
+		}
+		io_uring_unmap(r);
+		return -1;
+	}
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)r->br;
+	reg.ring_entries = IO_URING_BUFS;
+	reg.bgid = IO_URING_BGID;
+	io->stats.syscalls++;
+	if ( sys_io_uring_register(r->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0 ) {
+		io_uring_unmap(r);
+		return -1;
+	}
+	for ( int i = 0; i < IO_URING_BUFS; i++ ) {
+		io_uring_buf_put(r, i);
+	}
+	__atomic_store_n(&r->br->tail, r->br_tail, __ATOMIC_RELEASE);
+	io->priv = r;
+	return 0;
+}
+
+static void io_uring_close(io_t *io) {
+	io_uring_unmap((io_uring_t *)io->priv);
+}
+
+static int io_uring_add(io_t *io, int fd, int kind) {
+	io_uring_t *r = (io_uring_t *)io->priv;
+	if ( kind == IO_FD_STREAM ) {
+		// reads are asynchronous anyway, a non-blocking fd would only complete with -EAGAIN
+		io->stats.syscalls += 2;
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+	}
+	r->kind[fd] = kind;
+	io_uring_arm(io, fd);
+	return 0;
+}
+
+static void io_uring_del(io_t *io, int fd) {
+	io_uring_t *r = (io_uring_t *)io->priv;
+	if ( !r->kind[fd] ) {
+		return;
+	}
+	struct io_uring_sqe *sqe = io_uring_sqe(io);
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = r->armed[fd];
+	sqe->user_data = IO_UDATA(IO_OP_CANCEL, 0, 0, 0);
+	// the slot in flight is released by its (now stale) completion
+	for ( int s = r->send_head[fd]; s >= 0; ) {
+		int next = r->slots[s].next;
+		if ( s != r->send_busy[fd] ) {
+			io_uring_slot_release(r, s);
+		}
+		s = next;
+	}
+	r->send_head[fd] = -1;
+	r->send_tail[fd] = -1;
+	r->send_busy[fd] = -1;
+	io_pending_free(&r->pending[fd]);
+	r->kind[fd] = 0;
+	r->gen[fd]++;
+}
+
+// -1 only if the fd is gone or has more than IO_PENDING_MAX waiting (client is too slow)
+static int io_uring_send(io_t *io, int fd, const char *data, int len) {
+	io_uring_t *r = (io_uring_t *)io->priv;
+	if ( !r->kind[fd] ) {
+		return -1;
+	}
+	int n = r->pending[fd].len > 0 ? 0 : io_uring_copy(r, fd, data, len); // keeps the order
+	io_uring_mark_dirty(r, fd);
+	return n < len ? io_pending_add(&r->pending[fd], data + n, len - n) : 0;
+}
+
+// The slot keeps b until the send completed or the fd is removed, copied if it has to wait for a slot
+static int io_uring_send_shared(io_t *io, int fd, io_shared_t *b) {
+	io_uring_t *r = (io_uring_t *)io->priv;
+	if ( !r->kind[fd] ) {
+		return -1;
+	}
+	int s = r->pending[fd].len > 0 ? -1 : io_uring_slot_alloc(r);
+	if ( s < 0 ) {
+		io_uring_mark_dirty(r, fd);
+		return io_pending_add(&r->pending[fd], b->data, b->len);
+	}
+	int t = r->send_tail[fd];
+	r->slots[s].fd = fd;
+	r->slots[s].shared = b;
+	b->refs++;
+	if ( t < 0 ) {
+		r->send_head[fd] = s;
+	} else {
+		r->slots[t].next = s;
+	}
+	r->send_tail[fd] = s;
+	io_uring_mark_dirty(r, fd);
+	return 0;
+}
+
+// Completion of a send of res bytes: the rest of a short one goes again, returns -1 if the fd failed
+static int io_uring_sent(io_uring_t *r, uint64_t u, int res) {
+	int fd = IO_UDATA_FD(u);
+	int s = IO_UDATA_SLOT(u);
+	if ( !r->kind[fd] || r->gen[fd] != IO_UDATA_GEN(u) || r->send_busy[fd] != s ) {
+		io_uring_slot_release(r, s); // the fd was removed meanwhile
+		return 0;
+	}
+	io_uring_slot_t *slot = &r->slots[s];
+	int len = slot->shared != NULL ? slot->shared->len : slot->len;
+	r->send_busy[fd] = -1;
+	if ( res == -EINTR || res == -EAGAIN ) {
+		res = 0;
+	} else if ( res <= 0 ) {
+		return -1; // the slots go when the owner removes the fd
+	}
+	slot->off += res;
+	if ( slot->off < len ) {
+		io_uring_mark_dirty(r, fd);
+		return 0;
+	}
+	r->send_head[fd] = slot->next;
+	if ( r->send_head[fd] < 0 ) {
+		r->send_tail[fd] = -1;
+	}
+	if ( r->send_head[fd] >= 0 || r->pending[fd].len > 0 ) {
+		io_uring_mark_dirty(r, fd);
+	}
+	io_uring_slot_release(r, s);
+	return 0;
+}
+
+static int io_uring_wait(io_t *io, io_event_t *events, int max, int timeout_ms) {
+	io_uring_t *r = (io_uring_t *)io->priv;
+	if ( max > IO_MAX_EVENTS ) {
+		max = IO_MAX_EVENTS;
+	}
+	// buffers handed out by the previous wait go back to the kernel
+	for ( int i = 0; i < r->recycle_n; i++ ) {
+		io_uring_buf_put(r, r->recycle[i]);
+	}
+	r->recycle_n = 0;
+	__atomic_store_n(&r->br->tail, r->br_tail, __ATOMIC_RELEASE);
+	io_uring_flush(io);
+	unsigned head = *r->cq_head;
+	int ready = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE) != head;
+	if ( ( !ready || r->sq_pending ) && io_uring_submit(io, ready ? 0 : 1, timeout_ms) < 0 ) {
+		return -1;
+	}
+	int count = 0;
+	unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+	while ( head != tail && count < max ) {
+		struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+		head++;
+		uint64_t u = cqe->user_data;
+		int op = IO_UDATA_OP(u);
+		int fd = IO_UDATA_FD(u);
+		int res = cqe->res;
+		int more = cqe->flags & IORING_CQE_F_MORE;
+		int bid = cqe->flags & IORING_CQE_F_BUFFER ? (int)( cqe->flags >> IORING_CQE_BUFFER_SHIFT ) : -1;
+		if ( bid >= 0 ) {
+			r->recycle[r->recycle_n++] = bid;
+		}
+		if ( op == IO_OP_SEND ) {
+			if ( io_uring_sent(r, u, res) < 0 ) {
+				if ( r->kind[fd] == IO_FD_STREAM ) {
+					io_uring_del(io, fd);
+				}
+				events[count].type = IO_EV_CLOSE;
+				events[count].fd = fd;
+				events[count].data = NULL;
+				events[count].len = 0;
+				count++;
+			}
+			continue;
+		} else if ( op == IO_OP_CANCEL || !r->kind[fd] || r->gen[fd] != IO_UDATA_GEN(u) ) {
+			continue; // stale completion of a removed fd
+		}
+		io_event_t *ev = &events[count];
+		ev->fd = fd;
+		ev->data = bid >= 0 ? r->bufs + bid * IO_BUF_SIZE : NULL;
+		ev->len = 0;
+		if ( op == IO_OP_ACCEPT ) {
+			if ( res >= 0 ) {
+				ev->type = IO_EV_ACCEPT;
+				ev->fd = res;
+				count++;
+			}
+		} else if ( op == IO_OP_RECV ) {
+			if ( res > 0 ) {
+				ev->type = IO_EV_DATA;
+				ev->len = res;
+				count++;
+			} else if ( res != -ENOBUFS ) { // out of buffers: armed again, they are back by the next submit
+				ev->type = IO_EV_CLOSE;
+				count++;
+				continue; // not rearmed, owner removes the fd
+			}
+		} else if ( op == IO_OP_READ ) {
+			if ( res > 0 ) {
+				ev->type = IO_EV_DATA;
+				ev->len = res;
+				count++;
+			} else if ( res != -EAGAIN && res != -EINTR && res != -ENOBUFS ) {
+				io_uring_del(io, fd); // broken stream, not rearmed
+				ev->type = IO_EV_CLOSE;
+				count++;
+				continue;
+			}
+		}
+		if ( !more ) {
+			io_uring_arm(io, fd);
+		}
+	}
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+	return count;
+}
+
+// Handover is epoll only (wait_exit()), sends in flight are not reaped outside io_uring_wait()
+static int io_uring_drain(io_t *io, int fd, int timeout_ms) {
+	io_uring_t *r = (io_uring_t *)io->priv;
+	return r->send_head[fd] >= 0 || r->pending[fd].len > 0 ? -1 : 0;
+}
+
+const io_ops_t io_uring_ops = {
+	"io_uring",
+	io_uring_init,
+	io_uring_close,
+	io_uring_add,
+	io_uring_del,
+	io_uring_send,
+	io_uring_send_shared,
+	io_uring_drain,
+	io_uring_wait
+};
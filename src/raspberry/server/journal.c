@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "journal.h"
+
+static const char *journal_path = NULL;
+static uint32_t journal_size = 0;
+static int journal_fd = -1;
+static journal_header_t *journal_map = NULL;
+static journal_entry_t *journal_entries = NULL;
+
+static const char *journal_names[] = { "?", "cmd", "tx", "reply", "sensor", "error", "timeout", "sent" };
+
+uint64_t journal_time(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+const char *journal_type_name(int type) {
+	return type > 0 && type <= JOURNAL_SENT ? journal_names[type] : journal_names[0];
+}
+
+static int journal_map_file(void) {
+	journal_fd = open(journal_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if ( journal_fd < 0 ) {
+		printf("Error opening journal %s\n", journal_path);
+		return -1;
+	}
+	if ( ftruncate(journal_fd, journal_size) < 0 ) {
+		close(journal_fd);
+		journal_fd = -1;
+		return -1;
+	}
+	journal_map = (journal_header_t *)mmap(NULL, journal_size, PROT_READ | PROT_WRITE, MAP_SHARED, journal_fd, 0);
+	if ( journal_map == MAP_FAILED ) {
+		journal_map = NULL;
+		close(journal_fd);
+		journal_fd = -1;
+		return -1;
+	}
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	memcpy(journal_map->magic, JOURNAL_MAGIC, 4);
+	journal_map->version = JOURNAL_VERSION;
+	journal_map->entry_size = sizeof(journal_entry_t);
+	journal_map->count = 0;
+	journal_map->capacity = ( journal_size - sizeof(journal_header_t) ) / sizeof(journal_entry_t);
+	journal_map->wall = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	journal_map->start = journal_time();
+	journal_entries = (journal_entry_t *)( journal_map + 1 );
+	return 0;
+}
+
+static void journal_unmap_file(void) {
+	if ( journal_map != NULL ) {
+		// keep only what was written
+		uint32_t used = sizeof(journal_header_t) + journal_map->count * sizeof(journal_entry_t);
+		munmap(journal_map, journal_size);
+		if ( ftruncate(journal_fd, used) < 0 ) {
+			printf("Error truncating journal\n");
+		}
+		close(journal_fd);
+		journal_map = NULL;
+		journal_fd = -1;
+	}
+}
+
+static void journal_rotate(void) {
+	char from[256];
+	char to[256];
+	journal_unmap_file();
+	for ( int i = JOURNAL_KEEP; i > 0; i-- ) {
+		snprintf(to, sizeof(to), "%s.%d", journal_path, i);
+		if ( i > 1 ) {
+			snprintf(from, sizeof(from), "%s.%d", journal_path, i - 1);
+		} else {
+			snprintf(from, sizeof(from), "%s", journal_path);
+		}
+		rename(from, to);
+	}
+	journal_map_file();
+}
+
+int journal_open(const char *path, uint32_t size) {
+	journal_path = path;
+	journal_size = size < 4096 ? 4096 : size;
+	return journal_map_file();
+}
+
+void journal_close(void) {
+	journal_unmap_file();
+}
+
+void journal_write(uint64_t time, int type, int link, int source, int arg, uint32_t data) {
+	if ( journal_map == NULL ) {
+		return;
+	}
+	if ( journal_map->count == journal_map->capacity ) {
+		journal_rotate();
+		if ( journal_map == NULL ) {
+			return;
+		}
+	}
+	journal_entry_t *e = &journal_entries[journal_map->count];
+	e->time = time;
+	e->type = type;
+	e->link = link;
+	e->source = source;
+	e->arg = arg;
+	e->data = data;
+	__atomic_store_n(&journal_map->count, journal_map->count + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,52 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+/*
+ * Append-only binary journal of the bus traffic
+ * fixed size entries in a memory mapped file, rotated by size
+ * written by the bus thread only
+ */
+
+#include <stdint.h>
+
+#define JOURNAL_MAGIC "TWPJ"
+#define JOURNAL_VERSION 1
+#define JOURNAL_DEFAULT_SIZE ( 4 * 1024 * 1024 )
+#define JOURNAL_KEEP 4 // rotated files kept: path.1 ... path.4
+
+#define JOURNAL_CMD 1 // command of a client (source: worker)
+#define JOURNAL_TX 2 // packet sent to a master (arg: TWPC rate)
+#define JOURNAL_REPLY 3 // reply from a master
+#define JOURNAL_SENSOR 4 // onewire event (arg: uid of the train)
+#define JOURNAL_ERROR 5 // a packet was lost (data: the packet) or a bad frame came from the master (data: 0)
+#define JOURNAL_TIMEOUT 6 // no reply from a master
+#define JOURNAL_SENT 7 // a master sent a packet which has no reply (TWPC_NO_REPLY)
+
+typedef struct {
+	char magic[4];
+	uint16_t version;
+	uint16_t entry_size;
+	uint32_t count;
+	uint32_t capacity;
+	uint64_t wall; // CLOCK_REALTIME ns when the file was started
+	uint64_t start; // CLOCK_MONOTONIC ns at the same moment
+} journal_header_t;
+
+typedef struct {
+	uint64_t time; // CLOCK_MONOTONIC ns
+	uint8_t type;
+	uint8_t link;
+	uint8_t source;
+	uint8_t arg;
+	uint32_t data; // twpc_packet_t data_raw
+} journal_entry_t;
+
+uint64_t journal_time(void);
+
+int journal_open(const char *, uint32_t);
+void journal_close(void);
+void journal_write(uint64_t, int, int, int, int, uint32_t);
+
+const char *journal_type_name(int);
+
+#endif
@@ -0,0 +1,405 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "layout.h"
+
+/*
+Layout file, one item per line, # starts a comment:
+block [name] [length] - length in mm between the sensors of the block is optional
+sensor [link] [pin] [block] [block] - onewire pin of a master between two blocks
+switch [uid] [arg] [block] [from] [straight] [fork] - switch of the s command inside a block
+route [name] [block] [block]... - blocks a train runs through, the switch positions follow from them
+group [name] [uid] [uid]... - devices a single multicast packet reaches, at most TWPC_GROUPS
+
+A train passing a sensor moves to the other side of it. Where the train was
+not known yet it is put on the second side.
+
+A train entering a block leaves it on the far side: through the other sensor
+of a block with two, or by the switch of the block. The way out is compiled
+into a table for every entry and switch state once the file is read.
+*/
+
+layout_t layout;
+
+// What the bus thread changes, handed over to the next server process
+typedef struct {
+	uint32_t signature;
+	uint8_t occupant[LAYOUT_MAX_BLOCKS];
+	uint8_t position[256];
+	uint8_t previous[256];
+	uint8_t reserved[LAYOUT_MAX_BLOCKS];
+	uint8_t reserved_state[LAYOUT_MAX_BLOCKS];
+	uint8_t switches[LAYOUT_MAX_SWITCHES];
+	uint8_t trains[LAYOUT_MAX_SENSORS];
+	uint64_t times[LAYOUT_MAX_SENSORS];
+} layout_state_t;
+
+int layout_block(const char *name) {
+	for ( int i = 0; i < layout.blocks_n; i++ ) {
+		if ( strcmp(layout.blocks[i].name, name) == 0 ) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+int layout_route(const char *name) {
+	for ( int i = 0; i < layout.routes_n; i++ ) {
+		if ( strcmp(layout.routes[i].name, name) == 0 ) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+int layout_group(const char *name) {
+	for ( int i = 0; i < layout.groups_n; i++ ) {
+		if ( strcmp(layout.group_names[i], name) == 0 ) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int layout_group_line(char *line) {
+	char *save;
+	char *name = strtok_r(line, " \t\r\n", &save);
+	if ( name == NULL || strlen(name) > 15 || layout_group(name) >= 0 || layout.groups_n == TWPC_GROUPS ) {
+		return -1;
+	}
+	int group = layout.groups_n;
+	for ( char *word = strtok_r(NULL, " \t\r\n", &save); word != NULL; word = strtok_r(NULL, " \t\r\n", &save) ) {
+		char *end;
+		long uid = strtol(word, &end, 0);
+		if ( *end != '\0' || uid <= 0 || uid >= TWPC_GROUP_FIRST ) {
+			return -1;
+		}
+		layout.groups[uid] |= 1 << group;
+	}
+	strcpy(layout.group_names[group], name);
+	layout.groups_n++;
+	return 0;
+}
+
+static int layout_route_line(char *line) {
+	char *save;
+	char *name = strtok_r(line, " \t\r\n", &save);
+	if ( name == NULL || strlen(name) > 15 || layout_route(name) >= 0 || layout.routes_n == LAYOUT_MAX_ROUTES ) {
+		return -1;
+	}
+	layout_route_t *r = &layout.routes[layout.routes_n];
+	memset(r, 0, sizeof(layout_route_t));
+	strcpy(r->name, name);
+	for ( char *word = strtok_r(NULL, " \t\r\n", &save); word != NULL; word = strtok_r(NULL, " \t\r\n", &save) ) {
+		int block = layout_block(word);
+		if ( block < 0 || r->blocks_n == LAYOUT_ROUTE_BLOCKS ) {
+			return -1;
+		}
+		r->blocks[r->blocks_n++] = block;
+	}
+	if ( r->blocks_n < 2 ) {
+		return -1;
+	}
+	layout.routes_n++;
+	return 0;
+}
+
+static int layout_line(char *line) {
+	char word[16];
+	char names[4][16];
+	int link;
+	int pin;
+	int uid;
+	int arg;
+	if ( sscanf(line, "%15s", word) != 1 || word[0] == '#' ) {
+		return 0;
+	}
+	if ( strcmp(word, "route") == 0 ) {
+		return layout_route_line(strstr(line, "route") + 5);
+	}
+	if ( strcmp(word, "group") == 0 ) {
+		return layout_group_line(strstr(line, "group") + 5);
+	}
+	if ( strcmp(word, "block") == 0 && sscanf(line, "%*s %15s", names[0]) == 1 ) {
+		int length = 0;
+		if ( layout.blocks_n == LAYOUT_MAX_BLOCKS || layout_block(names[0]) >= 0
+			|| ( sscanf(line, "%*s %*s %i", &length) == 1 && ( length <= 0 || length > 65535 ) ) ) {
+			return -1;
+		}
+		layout_block_t *b = &layout.blocks[layout.blocks_n++];
+		strcpy(b->name, names[0]);
+		b->sw = LAYOUT_NONE;
+		b->length = length;
+		return 0;
+	}
+	if ( strcmp(word, "sensor") == 0 && sscanf(line, "%*s %d %d %15s %15s", &link, &pin, names[0], names[1]) == 4 ) {
+		int a = layout_block(names[0]);
+		int b = layout_block(names[1]);
+		if ( a < 0 || b < 0 || link < 0 || link >= UART_MAX_LINKS || pin < 0 || pin >= LAYOUT_MAX_PINS
+			|| layout.sensors_n == LAYOUT_MAX_SENSORS || layout.sensor_index[link][pin] != LAYOUT_NONE
+			|| layout.blocks[a].sensors_n == 8 || layout.blocks[b].sensors_n == 8 ) {
+			return -1;
+		}
+		int s = layout.sensors_n++;
+		layout.sensors[s].link = link;
+		layout.sensors[s].pin = pin;
+		layout.sensors[s].a = a;
+		layout.sensors[s].b = b;
+		layout.sensor_index[link][pin] = s;
+		layout.blocks[a].sensors[layout.blocks[a].sensors_n++] = s;
+		layout.blocks[b].sensors[layout.blocks[b].sensors_n++] = s;
+		return 0;
+	}
+	if ( strcmp(word, "switch") == 0 && sscanf(line, "%*s %i %i %15s %15s %15s %15s", &uid, &arg, names[0], names[1], names[2], names[3]) == 6 ) {
+		int blocks[4];
+		for ( int i = 0; i < 4; i++ ) {
+			blocks[i] = layout_block(names[i]);
+			if ( blocks[i] < 0 ) {
+				return -1;
+			}
+		}
+		if ( layout.switches_n == LAYOUT_MAX_SWITCHES || layout.blocks[blocks[0]].sw != LAYOUT_NONE ) {
+			return -1;
+		}
+		int i = layout.switches_n++;
+		layout_switch_t *sw = &layout.switches[i];
+		sw->uid = uid;
+		sw->arg = arg;
+		sw->block = blocks[0];
+		sw->from = blocks[1];
+		sw->straight = blocks[2];
+		sw->fork = blocks[3];
+		layout.blocks[blocks[0]].sw = i;
+		return 0;
+	}
+	return -1;
+}
+
+static int layout_other(int s, int block) {
+	return layout.sensors[s].a == block ? layout.sensors[s].b : layout.sensors[s].a;
+}
+
+static void layout_compile(void) {
+	for ( int i = 0; i < layout.switches_n; i++ ) {
+		layout.switch_index[layout.switches[i].uid][layout.switches[i].arg] = i;
+	}
+	for ( int s = 0; s < layout.sensors_n; s++ ) {
+		layout.joins[layout.sensors[s].a][layout.sensors[s].b] = s;
+		layout.joins[layout.sensors[s].b][layout.sensors[s].a] = s;
+	}
+	for ( int block = 0; block < layout.blocks_n; block++ ) {
+		layout_block_t *b = &layout.blocks[block];
+		for ( int i = 0; i < b->sensors_n; i++ ) {
+			int from = layout_other(b->sensors[i], block);
+			if ( b->sw != LAYOUT_NONE ) {
+				layout_switch_t *sw = &layout.switches[b->sw];
+				if ( from == sw->from ) {
+					layout.exits[from][block][0] = sw->straight;
+					layout.exits[from][block][1] = sw->fork;
+				} else if ( from == sw->straight || from == sw->fork ) {
+					layout.exits[from][block][0] = sw->from;
+					layout.exits[from][block][1] = sw->from;
+				}
+			} else if ( b->sensors_n == 2 ) {
+				layout.exits[from][block][0] = layout_other(b->sensors[1 - i], block);
+				layout.exits[from][block][1] = layout.exits[from][block][0];
+			}
+		}
+	}
+}
+
+// Switch positions of a route, -1 if a train cannot run through it
+static int layout_route_states(layout_route_t *r) {
+	for ( int i = 0; i < r->blocks_n; i++ ) {
+		int block = r->blocks[i];
+		int from = i > 0 ? r->blocks[i - 1] : LAYOUT_NONE;
+		int next = i + 1 < r->blocks_n ? r->blocks[i + 1] : LAYOUT_NONE;
+		layout_switch_t *sw = layout.blocks[block].sw == LAYOUT_NONE ? NULL : &layout.switches[layout.blocks[block].sw];
+		r->states[i] = LAYOUT_NONE;
+		if ( next != LAYOUT_NONE && layout.joins[block][next] == LAYOUT_NONE ) {
+			return -1;
+		}
+		if ( from == LAYOUT_NONE ) {
+			continue; // the train is already in the first block
+		}
+		if ( sw != NULL && from == sw->from ) {
+			r->states[i] = next == LAYOUT_NONE ? LAYOUT_NONE : next == sw->fork;
+		} else if ( sw != NULL ) {
+			r->states[i] = from == sw->fork;
+		}
+		if ( next != LAYOUT_NONE && layout_exit(from, block, r->states[i] == LAYOUT_NONE ? 0 : r->states[i]) != next ) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int layout_load(const char *path) {
+	memset(&layout, 0, sizeof(layout_t));
+	memset(layout.sensor_index, LAYOUT_NONE, sizeof(layout.sensor_index));
+	memset(layout.position, LAYOUT_NONE, sizeof(layout.position));
+	memset(layout.previous, LAYOUT_NONE, sizeof(layout.previous));
+	memset(layout.exits, LAYOUT_NONE, sizeof(layout.exits));
+	memset(layout.joins, LAYOUT_NONE, sizeof(layout.joins));
+	memset(layout.switch_index, LAYOUT_NONE, sizeof(layout.switch_index));
+	memset(layout.reserved_state, LAYOUT_NONE, sizeof(layout.reserved_state));
+	if ( path == NULL ) {
+		return 0;
+	}
+	FILE *f = fopen(path, "r");
+	if ( f == NULL ) {
+		printf("Cannot open layout %s\n", path);
+		return -1;
+	}
+	char line[256];
+	int n = 0;
+	while ( fgets(line, sizeof(line), f) != NULL ) {
+		n++;
+		if ( layout_line(line) < 0 ) {
+			printf("Layout %s:%d: invalid line: %s", path, n, line);
+			fclose(f);
+			return -1;
+		}
+	}
+	fclose(f);
+	layout_compile();
+	for ( int i = 0; i < layout.routes_n; i++ ) {
+		if ( layout_route_states(&layout.routes[i]) < 0 ) {
+			printf("Layout %s: no way through route %s\n", path, layout.routes[i].name);
+			return -1;
+		}
+	}
+	printf("Layout %s: %d blocks, %d sensors, %d switches, %d routes, %d groups\n", path, layout.blocks_n, layout.sensors_n,
+		layout.switches_n, layout.routes_n, layout.groups_n);
+	return 0;
+}
+
+// A train passed the sensor on pin of link, returns 1 with the blocks if it changed block
+int layout_sensor(int link, int pin, int train, uint64_t time, int *from, int *to) {
+	if ( link >= UART_MAX_LINKS || pin >= LAYOUT_MAX_PINS || train == 0 ) {
+		return 0;
+	}
+	int s = layout.sensor_index[link][pin];
+	if ( s == LAYOUT_NONE ) {
+		return 0;
+	}
+	layout_sensor_t *sensor = &layout.sensors[s];
+	sensor->time = time;
+	sensor->train = train;
+	int old = layout.position[train];
+	int new = old == sensor->b ? sensor->a : sensor->b;
+	if ( old == new ) {
+		return 0;
+	}
+	if ( old != LAYOUT_NONE && layout.occupant[old] == train ) {
+		__atomic_store_n(&layout.occupant[old], 0, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&layout.occupant[new], train, __ATOMIC_RELAXED);
+	__atomic_store_n(&layout.position[train], new, __ATOMIC_RELAXED);
+	layout.previous[train] = layout_other(s, new);
+	*from = old;
+	*to = new;
+	return 1;
+}
+
+int layout_switch(int uid, int arg) {
+	int sw = layout.switch_index[uid & 0xFF][arg & 0xFF];
+	return sw == LAYOUT_NONE ? -1 : sw;
+}
+
+void layout_set_switch(int sw, int state) {
+	layout.switches[sw].state = state;
+}
+
+// Train in a block, 0 if free
+int layout_occupant(int block) {
+	return block >= 0 && block < LAYOUT_MAX_BLOCKS ? __atomic_load_n(&layout.occupant[block], __ATOMIC_RELAXED) : 0;
+}
+
+// Block of a train, LAYOUT_NONE if not seen yet
+int layout_position(int train) {
+	return train > 0 && train < 256 ? __atomic_load_n(&layout.position[train], __ATOMIC_RELAXED) : LAYOUT_NONE;
+}
+
+// Block after block when coming from, LAYOUT_NONE at a dead end
+int layout_exit(int from, int block, int state) {
+	if ( from >= LAYOUT_MAX_BLOCKS || block >= LAYOUT_MAX_BLOCKS ) {
+		return LAYOUT_NONE;
+	}
+	return layout.exits[from][block][state];
+}
+
+// Next block of a train keeping its heading, with the switches as last commanded
+int layout_ahead(int train) {
+	int block = layout.position[train];
+	if ( block == LAYOUT_NONE ) {
+		return LAYOUT_NONE;
+	}
+	int sw = layout.blocks[block].sw;
+	return layout_exit(layout.previous[train], block, sw == LAYOUT_NONE ? 0 : layout.switches[sw].state);
+}
+
+static uint32_t layout_hash(uint32_t hash, const void *data, int len) {
+	for ( int i = 0; i < len; i++ ) {
+		hash = ( hash ^ ( (const uint8_t *)data )[i] ) * 16777619;
+	}
+	return hash;
+}
+
+// Same for the same layout file only
+static uint32_t layout_signature(void) {
+	uint32_t hash = layout_hash(2166136261U, layout.blocks, layout.blocks_n * sizeof(layout_block_t));
+	hash = layout_hash(hash, layout.routes, layout.routes_n * sizeof(layout_route_t));
+	for ( int i = 0; i < layout.sensors_n; i++ ) {
+		layout_sensor_t *s = &layout.sensors[i];
+		uint8_t key[4] = { s->link, s->pin, s->a, s->b };
+		hash = layout_hash(hash, key, sizeof(key));
+	}
+	for ( int i = 0; i < layout.switches_n; i++ ) {
+		layout_switch_t *sw = &layout.switches[i];
+		uint8_t key[6] = { sw->uid, sw->arg, sw->block, sw->from, sw->straight, sw->fork };
+		hash = layout_hash(hash, key, sizeof(key));
+	}
+	return hash;
+}
+
+int layout_save(void *data) {
+	layout_state_t *state = (layout_state_t *)data;
+	memset(state, 0, sizeof(layout_state_t));
+	state->signature = layout_signature();
+	memcpy(state->occupant, layout.occupant, sizeof(state->occupant));
+	memcpy(state->position, layout.position, sizeof(state->position));
+	memcpy(state->previous, layout.previous, sizeof(state->previous));
+	memcpy(state->reserved, layout.reserved, sizeof(state->reserved));
+	memcpy(state->reserved_state, layout.reserved_state, sizeof(state->reserved_state));
+	for ( int i = 0; i < layout.switches_n; i++ ) {
+		state->switches[i] = layout.switches[i].state;
+	}
+	for ( int i = 0; i < layout.sensors_n; i++ ) {
+		state->trains[i] = layout.sensors[i].train;
+		state->times[i] = layout.sensors[i].time;
+	}
+	return sizeof(layout_state_t);
+}
+
+// Occupancy of the previous server, only if it ran the same layout
+int layout_restore(const void *data, int len) {
+	const layout_state_t *state = (const layout_state_t *)data;
+	if ( len != sizeof(layout_state_t) || state->signature != layout_signature() ) {
+		printf("Layout changed, occupancy not taken over\n");
+		return -1;
+	}
+	memcpy(layout.occupant, state->occupant, sizeof(layout.occupant));
+	memcpy(layout.position, state->position, sizeof(layout.position));
+	memcpy(layout.previous, state->previous, sizeof(layout.previous));
+	memcpy(layout.reserved, state->reserved, sizeof(layout.reserved));
+	memcpy(layout.reserved_state, state->reserved_state, sizeof(layout.reserved_state));
+	for ( int i = 0; i < layout.switches_n; i++ ) {
+		layout.switches[i].state = state->switches[i];
+	}
+	for ( int i = 0; i < layout.sensors_n; i++ ) {
+		layout.sensors[i].train = state->trains[i];
+		layout.sensors[i].time = state->times[i];
+	}
+	return 0;
+}
@@ -0,0 +1,101 @@
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+/*
+ * Layout graph and block occupancy
+ * blocks are joined by sensors (a onewire pin of a master), switches sit in a block
+ * devices may be put in multicast groups,
+ * sensor events move trains between blocks, updated by the bus thread,
+ * occupancy can be read from any thread
+ */
+
+#include <stdint.h>
+#include "uart.h"
+#include "../../twpc_def.h"
+
+#define LAYOUT_MAX_BLOCKS 128
+#define LAYOUT_MAX_SENSORS 128
+#define LAYOUT_MAX_SWITCHES 64
+#define LAYOUT_MAX_PINS 8 // onewire pins of a master
+#define LAYOUT_MAX_ROUTES 64
+#define LAYOUT_ROUTE_BLOCKS 16
+#define LAYOUT_NONE 0xFF
+
+typedef struct {
+	char name[16];
+	uint8_t sensors[8]; // sensors on the border of the block
+	uint8_t sensors_n;
+	uint8_t sw; // switch in the block, LAYOUT_NONE if none
+	uint16_t length; // mm between the sensors, 0 if not known
+} layout_block_t;
+
+typedef struct {
+	uint8_t link;
+	uint8_t pin;
+	uint8_t a; // blocks on the two sides
+	uint8_t b;
+	uint64_t time; // journal_time() of the last event
+	uint8_t train; // last train seen
+} layout_sensor_t;
+
+typedef struct {
+	uint8_t uid; // device and arg of the s command
+	uint8_t arg;
+	uint8_t block;
+	uint8_t from; // entering from this block leads to straight or fork
+	uint8_t straight;
+	uint8_t fork;
+	uint8_t state; // last commanded, 1: fork
+} layout_switch_t;
+
+typedef struct {
+	char name[16];
+	uint8_t blocks[LAYOUT_ROUTE_BLOCKS];
+	uint8_t states[LAYOUT_ROUTE_BLOCKS]; // switch position in the block, LAYOUT_NONE if any
+	uint8_t blocks_n;
+} layout_route_t;
+
+typedef struct {
+	layout_block_t blocks[LAYOUT_MAX_BLOCKS];
+	int blocks_n;
+	layout_sensor_t sensors[LAYOUT_MAX_SENSORS];
+	int sensors_n;
+	layout_switch_t switches[LAYOUT_MAX_SWITCHES];
+	int switches_n;
+	layout_route_t routes[LAYOUT_MAX_ROUTES];
+	int routes_n;
+	char group_names[TWPC_GROUPS][16]; // group number is the order in the file
+	int groups_n;
+	uint8_t groups[256]; // device uid -> groups it belongs in (bits)
+	uint8_t sensor_index[UART_MAX_LINKS][LAYOUT_MAX_PINS]; // link, pin -> sensor
+	uint8_t occupant[LAYOUT_MAX_BLOCKS]; // block -> train uid, 0 if free
+	uint8_t position[256]; // train uid -> block
+	uint8_t previous[256]; // train uid -> block behind it
+	uint8_t reserved[LAYOUT_MAX_BLOCKS]; // block -> train uid of the route holding it, 0 if none
+	uint8_t reserved_state[LAYOUT_MAX_BLOCKS]; // switch position the route needs, LAYOUT_NONE if any
+	// precompiled at load, LAYOUT_NONE where there is no way
+	uint8_t exits[LAYOUT_MAX_BLOCKS][LAYOUT_MAX_BLOCKS][2]; // from, block, switch state -> next block
+	uint8_t joins[LAYOUT_MAX_BLOCKS][LAYOUT_MAX_BLOCKS]; // block, block -> sensor between them
+	uint8_t switch_index[256][256]; // uid, arg of the s command -> switch
+} layout_t;
+
+extern layout_t layout;
+
+int layout_load(const char *);
+int layout_block(const char *);
+int layout_route(const char *);
+int layout_group(const char *);
+
+int layout_sensor(int, int, int, uint64_t, int *, int *);
+int layout_switch(int, int);
+void layout_set_switch(int, int);
+
+int layout_occupant(int);
+int layout_position(int);
+int layout_exit(int, int, int);
+int layout_ahead(int);
+
+int layout_save(void *);
+int layout_restore(const void *, int);
+
+#endif
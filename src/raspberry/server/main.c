@@ -1,102 +1,305 @@
-//#include "socket.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
 #include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/signalfd.h>
 #include "socket.h"
-#include "websocket.h"
+#include "io.h"
 #include "uart.h"
-#include "control.h"
-#include "../../twpc_def.h"
+#include "bus.h"
+#include "worker.h"
+#include "journal.h"
+#include "sim.h"
+#include "http.h"
+#include "registry.h"
+#include "layout.h"
+#include "dispatch.h"
+#include "handover.h"
 
-static int sockets[512];
-static int running = 1;
+#define MAX_WORKERS BUS_MAX_WORKERS
 
-void signal_close(int n) {
-	running = 0;
+static worker_t *workers[MAX_WORKERS];
+
+static char *links[UART_MAX_LINKS];
+static int links_n = 0;
+static char *routes[256];
+static int routes_n = 0;
+
+static sim_t *sims[UART_MAX_LINKS];
+static int sim_links[UART_MAX_LINKS];
+static int sims_n = 0;
+
+static void usage(char *name) {
+	printf("Usage: %s [-b epoll|uring] [-t threads] [-u device[:baud][:cts]]... [-r uid[-uid]=link[.district]]... [-j journal[:MB]] [-w webdir] [-d registry] [-l layout] [-s timetable] [-H socket] [port]\n", name);
+	printf("  -u sim[:devices] adds a simulated master, with -l its trains run on the layout\n");
+	printf("  -u device:baud:cts waits for the CTS line of the master before sending\n");
+	printf("  -H takes over the clients and masters of the server listening on socket, then listens there for the next one,\n");
+	printf("     epoll backend only: io_uring reads ahead into buffers which would not go along\n");
+}
+
+// The fields after the path: a number is the baud (devices of a sim), cts the flag, -1 if any other
+static int link_options(char *fields, int *baud, int *cts) {
+	char *field;
+	while ( ( field = strsep(&fields, ":") ) != NULL ) {
+		char *end;
+		long n = strtol(field, &end, 10);
+		if ( strcmp(field, "cts") == 0 ) {
+			*cts = 1;
+		} else if ( *field != '\0' && *end == '\0' && n > 0 && n < 0x7FFFFFFF ) {
+			*baud = n;
+		} else {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// device[:baud][:cts], e.g. /dev/ttyUSB0:57600 or /dev/ttyUSB0:cts, or sim[:devices], baud is the highest rate negotiated,
+// -2 if the argument is not valid
+static int open_link(char *arg) {
+	char path[64];
+	int baud = 0;
+	int cts = 0;
+	strncpy(path, arg, sizeof(path) - 1);
+	path[sizeof(path) - 1] = '\0';
+	char *colon = strchr(path, ':');
+	if ( colon != NULL ) {
+		*colon = '\0';
+		if ( link_options(colon + 1, &baud, &cts) < 0 ) {
+			return -2;
+		}
+	}
+	if ( strcmp(path, "sim") == 0 && cts ) {
+		return -2; // a socket has no flow control
+	}
+	if ( strcmp(path, "sim") == 0 && sims_n < UART_MAX_LINKS ) {
+		sim_t *sim = sim_create(baud != 0 ? baud : 8);
+		int fd = sim == NULL ? -1 : sim_start(sim, 1);
+		if ( fd < 0 ) {
+			free(sim);
+			return -1;
+		}
+		sims[sims_n] = sim;
+		sim_links[sims_n++] = uart_links();
+		printf("Link %d: simulated master\n", uart_links());
+		return uart_add(fd, "sim");
+	}
+	handover_record_t *r = handover_take(HANDOVER_LINK, path);
+	if ( r != NULL ) {
+		printf("Link %d: %s taken over\n", uart_links(), path);
+		return uart_add(r->fd, path);
+	}
+	baud = baud != 0 ? baud : UART_DEFAULT_BAUD;
+	int link = uart_open(path, baud, cts);
+	if ( link >= 0 ) {
+		printf("Link %d: %s up to %d baud%s\n", link, path, baud, cts ? ", CTS" : "");
+	}
+	return link;
+}
+
+// uid[-uid]=link[.district], e.g. 1-40=0, 0x2a=1 or 41-80=0.1
+static int add_route(char *arg) {
+	char *end;
+	int lo = strtol(arg, &end, 0);
+	int hi = lo;
+	int link;
+	int district = 0;
+	if ( *end == '-' ) {
+		hi = strtol(end + 1, &end, 0);
+	}
+	if ( *end != '=' ) {
+		return -1;
+	}
+	link = strtol(end + 1, &end, 10);
+	if ( *end == '.' ) {
+		district = strtol(end + 1, &end, 10);
+	}
+	return bus_route(lo, hi, link, district);
 }
 
-void socket_list_close(int *sock) {
-	printf("Socket closed\n");
-	socket_close(*sock);
-	*sock = -1;
+// path[:MB]
+static int open_journal(char *arg) {
+	char *colon = strchr(arg, ':');
+	uint32_t size = JOURNAL_DEFAULT_SIZE;
+	if ( colon != NULL ) {
+		*colon = '\0';
+		size = atoi(colon + 1) * 1024 * 1024;
+	}
+	return journal_open(arg, size);
+}
+
+// Waits for SIGINT / SIGTERM or the next server, returns the connection of the next server or -1
+static int wait_exit(sigset_t *signals, int sock) {
+	struct pollfd pfd[2];
+	pfd[0].fd = signalfd(-1, signals, SFD_CLOEXEC);
+	pfd[0].events = POLLIN;
+	pfd[1].fd = sock;
+	pfd[1].events = POLLIN;
+	int next = -1;
+	while ( next < 0 ) {
+		if ( poll(pfd, sock >= 0 ? 2 : 1, -1) <= 0 ) {
+			continue;
+		} else if ( pfd[0].revents ) {
+			break;
+		}
+		next = handover_accept(sock);
+	}
+	close(pfd[0].fd);
+	return next;
 }
 
 int main (int argc, char * argv[]) {
 	int port = 9090;
-	if ( argc > 1 ) {
-		port = atoi(argv[1]);
-	}
-	uart_setup();
-	signal(SIGINT, signal_close);
-	signal(SIGTERM, signal_close);
-	int sock_listen = socket_create();
-	if ( socket_listen(sock_listen, port) == -1 ) {
-		printf("Bind failed\n");
+	int backend = IO_BACKEND_EPOLL;
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	const char *web = HTTP_DEFAULT_ROOT;
+	const char *devices = REGISTRY_DEFAULT_PATH;
+	const char *track = NULL;
+	const char *timetable = NULL;
+	char *journal = NULL;
+	const char *successor = NULL;
+	int opt;
+	while ( ( opt = getopt(argc, argv, "b:t:u:r:j:w:d:l:s:H:h") ) != -1 ) {
+		if ( opt == 'b' ) {
+			backend = io_backend(optarg);
+			if ( backend < 0 ) {
+				usage(argv[0]);
+				return 1;
+			}
+		} else if ( opt == 't' ) {
+			threads = atoi(optarg);
+		} else if ( opt == 'u' && links_n < UART_MAX_LINKS ) {
+			links[links_n++] = optarg;
+		} else if ( opt == 'r' && routes_n < 256 ) {
+			routes[routes_n++] = optarg;
+		} else if ( opt == 'j' ) {
+			journal = optarg;
+		} else if ( opt == 'w' ) {
+			web = optarg;
+		} else if ( opt == 'd' ) {
+			devices = optarg;
+		} else if ( opt == 'l' ) {
+			track = optarg;
+		} else if ( opt == 's' ) {
+			timetable = optarg;
+		} else if ( opt == 'H' ) {
+			successor = optarg;
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if ( optind < argc ) {
+		port = atoi(argv[optind]);
+	}
+	if ( successor != NULL && backend != IO_BACKEND_EPOLL ) {
+		printf("Handover needs the epoll backend\n");
+		usage(argv[0]);
+		return 1;
+	}
+	if ( threads < 1 ) {
+		threads = 1;
+	} else if ( threads > MAX_WORKERS ) {
+		threads = MAX_WORKERS;
+	}
+	// signals are only taken by the main thread
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+	// the old server stops its threads and sends everything before the journal or a link is opened here
+	if ( successor != NULL && handover_receive(successor) < 0 ) {
+		printf("Handover failed\n");
+		return 1;
+	}
+	if ( journal != NULL && open_journal(journal) < 0 ) {
 		return 1;
 	}
-	for ( int i = 0; i < 512; i++ ) {
-		sockets[i] = -1;
-	}
-	char msg[512];
-	twpc_packet_t serial_packet;
-	printf("Server started.\n");
-	while ( running ) {
-		// Receive data from mcu
-		memset(msg, 0, sizeof(char) * 512);
-		uart_rx(msg, 512);
-		if ( strlen(msg) > 0 ) {
-			printf("Received from serial: %s\n", msg);
+	for ( int i = 0; i < links_n; i++ ) {
+		if ( open_link(links[i]) == -2 ) {
+			printf("Invalid link: %s\n", links[i]);
+			return 1;
 		}
-		// Receive data from connected clients
-		for ( int i = 0; i < 512; i++ ) {
-			if ( sockets[i] != -1 ) {
-				// There is data to receive
-				int len = websocket_recv(sockets[i], msg);
-				if ( len < 0 ) {
-					// Failed
-					socket_list_close(&(sockets[i]));
-				} else if ( len > 0 ) {
-					// Handle and send data
-					printf("Received: '%s'\n", msg);
-					if ( control_handle(msg, &serial_packet) == 0 ) {
-						serial_packet.checksum = TWPC_CHECKSUM(serial_packet);
-						uart_tx((char *)&serial_packet, sizeof(twpc_packet_t));
-					}
-				}
-			}
+	}
+	if ( uart_links() == 0 ) {
+		open_link(UART_DEFAULT_PATH);
+	}
+	if ( http_init(web) < 0 || registry_open(devices) < 0 || layout_load(track) < 0 || dispatch_load(timetable) < 0 ) {
+		return 1;
+	}
+	for ( int i = 0; i < sims_n && track != NULL; i++ ) {
+		sim_layout(sims[i], sim_links[i]);
+	}
+	if ( bus_init(backend) < 0 ) {
+		return 1;
+	}
+	for ( int i = 0; i < routes_n; i++ ) {
+		if ( add_route(routes[i]) < 0 ) {
+			printf("Invalid route: %s\n", routes[i]);
+			return 1;
 		}
-		// Accept connection of new clients
-		int sock_accept = socket_accept(sock_listen);
-		if ( sock_accept > 0 ) {
-			printf("Connection accepted\n");
-			if ( websocket_accept(sock_accept) ) {
-				int found = 0;
-				for ( int i = 0; i < 512; i++ ) {
-					if ( sockets[i] == -1 ) {
-						sockets[i] = sock_accept;
-						found = 1;
-						break;
-					}
-				}
-				if ( !found ) {
-					printf("No room for more connections");
-					socket_close(sock_accept);
-				}
-			} else {
-				printf("Accept failed\n");
-				socket_close(sock_accept);
-			}
+	}
+	handover_record_t *r;
+	for ( int i = 0; i < threads; i++ ) {
+		r = handover_take(HANDOVER_LISTEN, NULL);
+		workers[i] = worker_create(i, backend, port, r != NULL ? r->fd : -1);
+		if ( workers[i] == NULL ) {
+			return 1;
 		}
 	}
-	uart_close();
-	for ( int i = 0; i < 512; i++ ) {
-		if ( sockets[i] != -1 ) {
-			socket_list_close(&sockets[i]);
+	for ( int i = 0; ( r = handover_take(HANDOVER_CONN, NULL) ) != NULL; i++ ) {
+		worker_adopt(workers[i % threads], r->fd, r->data, r->len);
+	}
+	bus_start();
+	for ( int i = 0; i < threads; i++ ) {
+		worker_start(workers[i]);
+	}
+	handover_done();
+	int sock = successor != NULL ? handover_listen(successor) : -1;
+	printf("Server started (%s backend, %d workers).\n", io_backend_name(backend), threads);
+	int next = wait_exit(&signals, sock);
+	if ( next >= 0 ) {
+		// nothing may touch the links or the clients while they are passed on
+		printf("Handing over\n");
+		bus_stop();
+		for ( int i = 0; i < threads; i++ ) {
+			worker_stop(workers[i]);
 		}
+		int result = 0;
+		for ( int i = 0; i < threads; i++ ) {
+			result |= worker_export(workers[i], next);
+		}
+		result |= bus_export(next);
+		result |= handover_send(next, HANDOVER_DONE, -1, NULL, NULL, 0);
+		close(next);
+		printf("Handover %s\n", result < 0 ? "incomplete" : "done");
+	} else {
+		for ( int i = 0; i < threads; i++ ) {
+			worker_stop(workers[i]);
+		}
+		bus_stop();
+	}
+	handover_close(sock, successor, next >= 0);
+	for ( int i = 0; i < threads; i++ ) {
+		worker_free(workers[i]);
 	}
-	socket_close(sock_listen);
+	bus_free();
+	for ( int i = 0; i < sims_n; i++ ) {
+		if ( sims[i]->link >= 0 ) {
+			printf("sim link %d: %llu collisions, %llu conflicting packets\n", sims[i]->link,
+				(unsigned long long)sims[i]->collisions, (unsigned long long)sims[i]->conflicts);
+		}
+		sim_free(sims[i]);
+	}
+	uart_close();
+	journal_close();
+	http_free();
+	registry_close();
 	WSA_CLEAN();
 	return 0;
 }
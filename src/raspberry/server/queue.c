@@ -0,0 +1,88 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "queue.h"
+
+/*
+ * Every cell carries a sequence number: a producer may fill the cell when
+ * seq == position, the consumer may take it when seq == position + 1.
+ */
+
+#define QUEUE_SEQ(q, pos) ( (uint32_t *)( (q)->cells + ( (pos) & (q)->mask ) * (q)->stride ) )
+
+int queue_init(queue_t *q, int item_size, int capacity) {
+	memset(q, 0, sizeof(queue_t));
+	if ( capacity & ( capacity - 1 ) ) {
+		return -1; // capacity must be a power of two
+	}
+	q->item_size = item_size;
+	q->stride = ( sizeof(uint32_t) + item_size + 7 ) & ~7;
+	q->mask = capacity - 1;
+	q->cells = (char *)malloc(q->stride * capacity);
+	if ( q->cells == NULL ) {
+		return -1;
+	}
+	for ( uint32_t i = 0; i < capacity; i++ ) {
+		*QUEUE_SEQ(q, i) = i;
+	}
+	q->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if ( q->fd < 0 ) {
+		free(q->cells);
+		return -1;
+	}
+	return 0;
+}
+
+void queue_free(queue_t *q) {
+	close(q->fd);
+	free(q->cells);
+}
+
+int queue_push(queue_t *q, const void *item) {
+	uint32_t pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	uint32_t *seq;
+	while ( 1 ) {
+		seq = QUEUE_SEQ(q, pos);
+		int32_t dif = (int32_t)( __atomic_load_n(seq, __ATOMIC_ACQUIRE) - pos );
+		if ( dif == 0 ) {
+			if ( __atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED) ) {
+				break;
+			}
+		} else if ( dif < 0 ) {
+			return -1; // full
+		} else {
+			pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+		}
+	}
+	memcpy(seq + 1, item, q->item_size);
+	__atomic_store_n(seq, pos + 1, __ATOMIC_RELEASE);
+	queue_wake(q);
+	return 0;
+}
+
+int queue_pop(queue_t *q, void *item) {
+	uint32_t *seq = QUEUE_SEQ(q, q->tail);
+	if ( (int32_t)( __atomic_load_n(seq, __ATOMIC_ACQUIRE) - ( q->tail + 1 ) ) < 0 ) {
+		return 0; // empty
+	}
+	memcpy(item, seq + 1, q->item_size);
+	__atomic_store_n(seq, q->tail + q->mask + 1, __ATOMIC_RELEASE);
+	q->tail++;
+	return 1;
+}
+
+// consumer: call after the eventfd fired and before draining the queue
+void queue_rearm(queue_t *q) {
+	__atomic_store_n(&q->signaled, 0, __ATOMIC_SEQ_CST);
+}
+
+// only the first push after a rearm costs a write()
+void queue_wake(queue_t *q) {
+	if ( !__atomic_exchange_n(&q->signaled, 1, __ATOMIC_SEQ_CST) ) {
+		uint64_t one = 1;
+		if ( write(q->fd, &one, sizeof(one)) < 0 ) {
+			__atomic_store_n(&q->signaled, 0, __ATOMIC_SEQ_CST);
+		}
+	}
+}
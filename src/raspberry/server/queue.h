@@ -0,0 +1,30 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+/*
+ * Bounded lock-free multi producer / single consumer queue
+ * with an eventfd to wake the consumer's event loop
+ */
+
+#include <stdint.h>
+
+typedef struct {
+	int item_size;
+	int stride;
+	uint32_t mask;
+	char *cells;
+	int fd;
+	uint32_t head __attribute__((aligned(64))); // next slot for producers
+	int signaled;
+	uint32_t tail __attribute__((aligned(64))); // next slot for the consumer
+} queue_t;
+
+int queue_init(queue_t *, int, int);
+void queue_free(queue_t *);
+
+int queue_push(queue_t *, const void *);
+int queue_pop(queue_t *, void *);
+void queue_rearm(queue_t *);
+void queue_wake(queue_t *);
+
+#endif
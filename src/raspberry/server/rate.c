@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <string.h>
+#include "registry.h"
+#include "rate.h"
+
+/*
+A device starts at the rate the registry has for it, new ones at 0. After
+RATE_PROBE good answers in a row the bus tries the next rate with a status
+packet, unless that rate failed less than RATE_HOLD ago, and the device moves
+up if it answers. A transaction failing above rate 0 steps the device down
+at once and the bus sends it again, only one failing at rate 0 tells that
+the device is gone. Broadcasts are always sent at rate 0, group packets at
+the rate of their slowest member.
+*/
+
+typedef struct {
+	uint8_t rate;
+	uint8_t good; // answers in a row at the rate
+	uint64_t hold; // bus_now() until the next rate is not tried
+} rate_device_t;
+
+static rate_device_t devices[256];
+static uint64_t ups;
+static uint64_t downs;
+
+void rate_init(void) {
+	registry_device_t d;
+	memset(devices, 0, sizeof(devices));
+	for ( int uid = 1; uid < 255; uid++ ) {
+		if ( registry_get(uid, &d) == 0 && d.rate < TWPC_RATES ) {
+			devices[uid].rate = d.rate;
+		}
+	}
+	ups = 0;
+	downs = 0;
+}
+
+int rate_get(int uid) {
+	return uid > 0 && uid < 255 ? devices[uid].rate : 0;
+}
+
+// A transaction with uid at rate ended, good if the device answered it right,
+// returns 1 if the next rate is to be tried
+int rate_answered(int uid, int rate, int good, uint64_t now) {
+	if ( uid <= 0 || uid >= 255 ) {
+		return 0;
+	}
+	rate_device_t *d = &devices[uid];
+	if ( rate == d->rate + 1 ) { // a probe
+		if ( good ) {
+			d->rate++;
+			ups++;
+			registry_rate(uid, d->rate);
+		} else {
+			d->hold = now + RATE_HOLD;
+		}
+		d->good = 0;
+		return 0;
+	} else if ( rate != d->rate ) {
+		return 0; // sent before the last change
+	} else if ( !good ) {
+		d->good = 0;
+		if ( d->rate > 0 ) {
+			d->rate--;
+			d->hold = now + RATE_HOLD;
+			downs++;
+			registry_rate(uid, d->rate);
+		}
+		return 0;
+	}
+	if ( d->good < RATE_PROBE ) {
+		d->good++;
+	}
+	if ( d->good == RATE_PROBE && d->rate + 1 < TWPC_RATES && now >= d->hold ) {
+		d->good = 0;
+		return 1;
+	}
+	return 0;
+}
+
+void rate_report(void) {
+	int fast = 0;
+	for ( int uid = 1; uid < 255; uid++ ) {
+		fast += devices[uid].rate > 0;
+	}
+	printf("rate: %llu steps up, %llu steps down, %d devices above rate 0\n", (unsigned long long)ups, (unsigned long long)downs, fast);
+}
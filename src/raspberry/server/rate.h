@@ -0,0 +1,21 @@
+#ifndef RATE_H
+#define RATE_H
+
+/*
+ * TWPC bit rate of every device: stepped up while it answers,
+ * down as soon as it does not, kept in the registry
+ * runs in the bus thread
+ */
+
+#include <stdint.h>
+#include "../../twpc_def.h"
+
+#define RATE_PROBE 32 // answers in a row before the next rate is tried
+#define RATE_HOLD 60000 // ms a rate which failed is not tried again
+
+void rate_init(void);
+int rate_get(int);
+int rate_answered(int, int, int, uint64_t);
+void rate_report(void);
+
+#endif
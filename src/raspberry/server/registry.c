@@ -0,0 +1,285 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "registry.h"
+
+static registry_file_t *registry = NULL;
+static int registry_fd = -1;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// known uids of every type, dense
+static uint8_t by_type[REGISTRY_TYPES][256];
+static int by_type_n[REGISTRY_TYPES];
+static int by_type_pos[256];
+
+static uint64_t registry_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static void registry_index_add(int uid) {
+	int type = registry->devices[uid].type;
+	by_type_pos[uid] = by_type_n[type];
+	by_type[type][by_type_n[type]++] = uid;
+}
+
+static void registry_index_del(int uid) {
+	int type = registry->devices[uid].type;
+	int last = by_type[type][--by_type_n[type]];
+	by_type[type][by_type_pos[uid]] = last;
+	by_type_pos[last] = by_type_pos[uid];
+}
+
+// Without a file the registry lives in anonymous memory
+int registry_open(const char *path) {
+	int fresh = 1;
+	if ( path != NULL ) {
+		registry_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		if ( registry_fd < 0 ) {
+			printf("Error opening registry %s\n", path);
+			return -1;
+		}
+		fresh = lseek(registry_fd, 0, SEEK_END) != sizeof(registry_file_t);
+		if ( fresh && ftruncate(registry_fd, sizeof(registry_file_t)) < 0 ) {
+			close(registry_fd);
+			registry_fd = -1;
+			return -1;
+		}
+		registry = (registry_file_t *)mmap(NULL, sizeof(registry_file_t), PROT_READ | PROT_WRITE, MAP_SHARED, registry_fd, 0);
+	} else {
+		registry = (registry_file_t *)mmap(NULL, sizeof(registry_file_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	}
+	if ( registry == MAP_FAILED ) {
+		registry = NULL;
+		if ( registry_fd >= 0 ) {
+			close(registry_fd);
+			registry_fd = -1;
+		}
+		return -1;
+	}
+	if ( !fresh && ( memcmp(registry->magic, REGISTRY_MAGIC, 4) != 0 || registry->version != REGISTRY_VERSION
+		|| registry->entry_size != sizeof(registry_device_t) ) ) {
+		printf("Registry %s has an unknown format, starting empty\n", path);
+		fresh = 1;
+	}
+	if ( fresh ) {
+		memset(registry, 0, sizeof(registry_file_t));
+		memcpy(registry->magic, REGISTRY_MAGIC, 4);
+		registry->version = REGISTRY_VERSION;
+		registry->entry_size = sizeof(registry_device_t);
+	}
+	memset(by_type_n, 0, sizeof(by_type_n));
+	registry->count = 0;
+	for ( int uid = 1; uid < 255; uid++ ) {
+		registry_device_t *d = &registry->devices[uid];
+		if ( d->uid == uid && d->type < REGISTRY_TYPES ) {
+			registry_index_add(uid);
+			registry->count++;
+		} else {
+			memset(d, 0, sizeof(registry_device_t));
+		}
+	}
+	if ( path != NULL ) {
+		printf("Registry %s: %d known devices\n", path, registry->count);
+	}
+	return 0;
+}
+
+void registry_close(void) {
+	if ( registry != NULL ) {
+		if ( registry_fd >= 0 ) {
+			msync(registry, sizeof(registry_file_t), MS_SYNC);
+			close(registry_fd);
+			registry_fd = -1;
+		}
+		munmap(registry, sizeof(registry_file_t));
+		registry = NULL;
+	}
+}
+
+// A device answered request with reply, returns 1 if clients should be told
+int registry_seen(int link, const twpc_packet_t *request, const twpc_packet_t *reply) {
+	int uid = reply->uid;
+	if ( registry == NULL || reply->data_raw == 0 || uid == 0 || uid == 255 ) {
+		return 0;
+	}
+	pthread_mutex_lock(&registry_lock);
+	registry_device_t *d = &registry->devices[uid];
+	registry_device_t old = *d;
+	if ( d->uid == 0 ) {
+		d->uid = uid;
+		d->type = REGISTRY_TRAIN;
+		registry_index_add(uid);
+		registry->count++;
+	}
+	int type = d->type;
+	switch ( reply->cmd ) {
+		case TWPC_CMD_LIGHT_ON:
+		case TWPC_CMD_LIGHT_OFF:
+			d->caps |= REGISTRY_CAP_LIGHT;
+			d->state = ( d->state & ~REGISTRY_STATE_LIGHT ) | ( reply->cmd == TWPC_CMD_LIGHT_ON ? REGISTRY_STATE_LIGHT : 0 );
+			break;
+		case TWPC_CMD_MOTOR_A:
+		case TWPC_CMD_MOTOR_B:
+			d->caps |= REGISTRY_CAP_MOTOR;
+			d->state = ( d->state & ~REGISTRY_STATE_DIR ) | ( reply->cmd == TWPC_CMD_MOTOR_B ? REGISTRY_STATE_DIR : 0 );
+			d->speed = reply->arg;
+			break;
+		case TWPC_CMD_SW_STRAIGHT:
+		case TWPC_CMD_SW_FORK:
+			d->caps |= REGISTRY_CAP_SWITCH;
+			d->state = ( d->state & ~REGISTRY_STATE_FORK ) | ( reply->cmd == TWPC_CMD_SW_FORK ? REGISTRY_STATE_FORK : 0 );
+			type = REGISTRY_SWITCH;
+			break;
+		case TWPC_CMD_STATUS: // arg 0: light | motor A << 1 | fork << 2, arg 1: speed
+			if ( request != NULL && request->arg == 0 ) {
+				d->state = ( d->state & ~REGISTRY_STATE_LIGHT ) | ( reply->arg & 1 ? REGISTRY_STATE_LIGHT : 0 );
+				if ( d->type == REGISTRY_TRAIN ) {
+					d->state = ( d->state & ~REGISTRY_STATE_DIR ) | ( reply->arg & 2 ? 0 : REGISTRY_STATE_DIR );
+				}
+				if ( d->caps & REGISTRY_CAP_SWITCH ) {
+					d->state = ( d->state & ~REGISTRY_STATE_FORK ) | ( reply->arg & 4 ? REGISTRY_STATE_FORK : 0 );
+				}
+			} else if ( request != NULL && request->arg == 1 && d->type == REGISTRY_TRAIN ) {
+				d->speed = reply->arg;
+			}
+			break;
+		case TWPC_CMD_NAME:
+			if ( request != NULL && request->arg < 3 ) {
+				d->caps |= REGISTRY_CAP_NAME;
+				d->name[request->arg] = reply->arg >= ' ' && reply->arg < 127 ? reply->arg : '?';
+			}
+			break;
+	}
+	if ( type != d->type ) {
+		registry_index_del(uid);
+		d->type = type;
+		registry_index_add(uid);
+	}
+	d->present = 1;
+	d->link = link;
+	d->replies++;
+	d->last_seen = registry_now();
+	int changed = old.uid != d->uid || old.present != d->present || old.type != d->type || old.caps != d->caps || old.link != d->link
+		|| old.state != d->state || old.speed != d->speed || memcmp(old.name, d->name, sizeof(d->name)) != 0;
+	pthread_mutex_unlock(&registry_lock);
+	return changed;
+}
+
+// Discovery found uid on link, type -1 keeps the known type
+int registry_found(int uid, int link, int type) {
+	if ( registry == NULL || uid <= 0 || uid >= 255 ) {
+		return 0;
+	}
+	pthread_mutex_lock(&registry_lock);
+	registry_device_t *d = &registry->devices[uid];
+	registry_device_t old = *d;
+	if ( d->uid == 0 ) {
+		d->uid = uid;
+		d->type = type < 0 ? REGISTRY_TRAIN : type;
+		registry_index_add(uid);
+		registry->count++;
+	} else if ( type >= 0 && type != d->type ) {
+		registry_index_del(uid);
+		d->type = type;
+		registry_index_add(uid);
+	}
+	d->present = 1;
+	d->link = link;
+	d->last_seen = registry_now();
+	int changed = old.uid != d->uid || old.present != d->present || old.type != d->type || old.link != d->link;
+	pthread_mutex_unlock(&registry_lock);
+	return changed;
+}
+
+// Nobody answered a packet addressed to uid
+int registry_lost(int uid) {
+	if ( registry == NULL || uid == 0 || uid == 255 ) {
+		return 0;
+	}
+	pthread_mutex_lock(&registry_lock);
+	int changed = registry->devices[uid].present;
+	registry->devices[uid].present = 0;
+	pthread_mutex_unlock(&registry_lock);
+	return changed;
+}
+
+// Link of a known device, -1 if unknown
+int registry_link(int uid) {
+	if ( registry == NULL || uid <= 0 || uid >= 255 ) {
+		return -1;
+	}
+	pthread_mutex_lock(&registry_lock);
+	int link = registry->devices[uid].uid == uid ? registry->devices[uid].link : -1;
+	pthread_mutex_unlock(&registry_lock);
+	return link;
+}
+
+// TWPC rate of a known device
+void registry_rate(int uid, int rate) {
+	if ( registry == NULL || uid <= 0 || uid >= 255 ) {
+		return;
+	}
+	pthread_mutex_lock(&registry_lock);
+	if ( registry->devices[uid].uid == uid ) {
+		registry->devices[uid].rate = rate;
+	}
+	pthread_mutex_unlock(&registry_lock);
+}
+
+int registry_get(int uid, registry_device_t *out) {
+	if ( registry == NULL || uid <= 0 || uid >= 255 ) {
+		return -1;
+	}
+	pthread_mutex_lock(&registry_lock);
+	*out = registry->devices[uid];
+	pthread_mutex_unlock(&registry_lock);
+	return out->uid == uid ? 0 : -1;
+}
+
+// Known devices of a type, or of every type (-1) in uid order
+int registry_list(int type, registry_device_t *out, int max) {
+	int n = 0;
+	if ( registry == NULL ) {
+		return 0;
+	}
+	pthread_mutex_lock(&registry_lock);
+	if ( type < 0 ) {
+		for ( int uid = 1; uid < 255 && n < max; uid++ ) {
+			if ( registry->devices[uid].uid != 0 ) {
+				out[n++] = registry->devices[uid];
+			}
+		}
+	} else if ( type < REGISTRY_TYPES ) {
+		for ( int i = 0; i < by_type_n[type] && n < max; i++ ) {
+			out[n++] = registry->devices[by_type[type][i]];
+		}
+	}
+	pthread_mutex_unlock(&registry_lock);
+	return n;
+}
+
+// d[uid][type][caps][link][present][state][speed][name]
+int registry_format(char *msg, const registry_device_t *d) {
+	return sprintf(msg, "d%02x%02x%02x%02x%d%02x%02x%.3s", d->uid, d->type, d->caps, d->link, d->present, d->state, d->speed, d->name);
+}
+
+// Present devices in the old devlist.txt format: type << 16 | uid, comma separated
+int registry_devlist(char *buf, int size) {
+	registry_device_t devices[256];
+	int n = registry_list(-1, devices, 256);
+	int len = 0;
+	buf[0] = '\0';
+	for ( int i = 0; i < n && len < size - 16; i++ ) {
+		if ( devices[i].present ) {
+			len += sprintf(&buf[len], "%s%d", len > 0 ? "," : "", devices[i].type << 16 | devices[i].uid);
+		}
+	}
+	return len;
+}
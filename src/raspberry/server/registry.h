@@ -0,0 +1,70 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+/*
+ * Device registry: every device ever seen on the bus
+ * indexed by uid and by type, persisted in a memory mapped file
+ * updated by the bus thread, read by the workers
+ */
+
+#include <stdint.h>
+#include "../../twpc_def.h"
+
+#define REGISTRY_MAGIC "TWPR"
+#define REGISTRY_VERSION 1
+#define REGISTRY_DEFAULT_PATH "registry.bin"
+
+#define REGISTRY_TRAIN TWPC_TYPE_TRAIN
+#define REGISTRY_SWITCH TWPC_TYPE_SWITCH
+#define REGISTRY_TYPES 2
+
+// capabilities, learned from the commands a device answered
+#define REGISTRY_CAP_LIGHT 0x01
+#define REGISTRY_CAP_MOTOR 0x02
+#define REGISTRY_CAP_SWITCH 0x04
+#define REGISTRY_CAP_NAME 0x08
+
+// state bits
+#define REGISTRY_STATE_LIGHT 0x01
+#define REGISTRY_STATE_DIR 0x02
+#define REGISTRY_STATE_FORK 0x04
+
+typedef struct {
+	uint8_t uid; // 0: unused entry
+	uint8_t present;
+	uint8_t type;
+	uint8_t caps;
+	uint8_t link;
+	uint8_t state;
+	uint8_t speed;
+	uint8_t rate; // TWPC rate it answers at
+	char name[4];
+	uint32_t replies;
+	uint64_t last_seen; // CLOCK_REALTIME ms
+	uint64_t reserved2;
+} registry_device_t;
+
+typedef struct {
+	char magic[4];
+	uint16_t version;
+	uint16_t entry_size;
+	uint32_t count; // known devices
+	uint32_t reserved;
+	registry_device_t devices[256];
+} registry_file_t;
+
+int registry_open(const char *);
+void registry_close(void);
+
+int registry_seen(int, const twpc_packet_t *, const twpc_packet_t *);
+int registry_found(int, int, int);
+int registry_lost(int);
+int registry_link(int);
+void registry_rate(int, int);
+
+int registry_get(int, registry_device_t *);
+int registry_list(int, registry_device_t *, int);
+int registry_format(char *, const registry_device_t *);
+int registry_devlist(char *, int);
+
+#endif
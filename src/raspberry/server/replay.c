@@ -0,0 +1,462 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "socket.h"
+#include "uart.h"
+#include "control.h"
+#include "journal.h"
+#include "sim.h"
+#include "layout.h"
+
+/*
+Journal replay tool
+- print a journal
+- play the client commands of a journal against a running server
+- play the uart traffic against a simulated master and compare the replies
+at the recorded pace or as fast as possible
+- soak test: play the client commands again and again on a new connection each
+time and print the memory the server reports (p) after every pass
+- random test: seeded random train and switch commands against a server with
+simulated masters and the layout, fails if the sims saw collisions or packets
+the interlocking should have refused (c)
+- with -s the syscalls of the server per command are printed (c), to compare the
+io backends on the same journal
+*/
+
+static journal_header_t *header = NULL;
+static journal_entry_t *entries = NULL;
+static int fast = 0;
+static uint64_t replay_start = 0;
+static char rx[16384]; // frames from the server
+static int rx_len = 0;
+
+static void usage(char *name) {
+	printf("Usage: %s [-f] [-s host:port [-l hours] | -m] journal\n", name);
+	printf("       %s -s host:port -r seed[:commands] layout\n", name);
+	printf("  -s host:port  send the client commands to a server\n");
+	printf("  -m            replay the uart traffic against a simulated master\n");
+	printf("  -f            as fast as possible (default: recorded pace)\n");
+	printf("  -l hours      with -s: replay until the time is up, report the memory of the server\n");
+	printf("  -r seed       with -s: random commands on the trains of the server and the switches of the layout (default 200)\n");
+}
+
+static int load(const char *path) {
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if ( fd < 0 || fstat(fd, &st) < 0 || st.st_size < sizeof(journal_header_t) ) {
+		printf("Cannot read %s\n", path);
+		return -1;
+	}
+	header = (journal_header_t *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if ( header == MAP_FAILED || memcmp(header->magic, JOURNAL_MAGIC, 4) != 0 || header->entry_size != sizeof(journal_entry_t) ) {
+		printf("%s is not a journal\n", path);
+		return -1;
+	}
+	uint32_t fits = ( st.st_size - sizeof(journal_header_t) ) / sizeof(journal_entry_t);
+	if ( header->count > fits ) {
+		printf("Journal is truncated\n");
+		return -1;
+	}
+	entries = (journal_entry_t *)( header + 1 );
+	return 0;
+}
+
+// Wait until the entry is due, relative to the first entry
+static void pace(journal_entry_t *e) {
+	if ( fast || e->time < header->start ) {
+		return;
+	}
+	uint64_t due = replay_start + ( e->time - header->start );
+	uint64_t now = journal_time();
+	if ( due > now ) {
+		usleep(( due - now ) / 1000);
+	}
+}
+
+static void print(void) {
+	char msg[32];
+	for ( uint32_t i = 0; i < header->count; i++ ) {
+		journal_entry_t *e = &entries[i];
+		twpc_packet_t packet;
+		packet.data_raw = e->data;
+		printf("%12.6f %-7s link %d", (double)(int64_t)( e->time - header->start ) / 1e9, journal_type_name(e->type), e->link);
+		if ( e->type == JOURNAL_CMD ) {
+			printf(" worker %d %08x", e->source, e->data);
+			if ( control_format(msg, &packet) > 0 ) {
+				printf(" '%s'", msg);
+			}
+		} else if ( e->type == JOURNAL_TX || e->type == JOURNAL_REPLY ) {
+			printf(" uid %3d cmd %02x arg %02x", packet.uid, packet.cmd, packet.arg);
+		} else if ( e->type == JOURNAL_SENSOR ) {
+			printf(" train %02x pin %d", e->arg, e->data);
+		}
+		printf("\n");
+	}
+}
+
+// A masked text frame, -1 if it is longer than the frame buffer or cannot be sent
+static int ws_send(int sock, const char *msg) {
+	char frame[1024];
+	int len = strlen(msg);
+	int pos = len < 126 ? 2 : 4;
+	const unsigned char mask[4] = { 0x12, 0x34, 0x56, 0x78 };
+	if ( pos + 4 + len > sizeof(frame) ) {
+		printf("Message of %d bytes is too long\n", len);
+		return -1;
+	}
+	frame[0] = 0x81;
+	if ( len < 126 ) {
+		frame[1] = 0x80 | len;
+	} else {
+		frame[1] = 0x80 | 126;
+		frame[2] = len >> 8;
+		frame[3] = len & 0xFF;
+	}
+	memcpy(&frame[pos], mask, 4);
+	for ( int i = 0; i < len; i++ ) {
+		frame[pos + 4 + i] = msg[i] ^ mask[i % 4];
+	}
+	return send(sock, frame, pos + 4 + len, 0) == pos + 4 + len ? 0 : -1;
+}
+
+// Frames the server sent so far, with want: waits for a message starting with one of its characters
+static int ws_read(int sock, const char *want, char *msg, int size) {
+	unsigned char *b = (unsigned char *)rx;
+	while ( 1 ) {
+		while ( rx_len >= 2 ) {
+			int n = b[1] & 0x7F;
+			int pos = 2;
+			if ( n == 126 ) {
+				n = b[2] << 8 | b[3];
+				pos = 4;
+			} else if ( n == 127 ) {
+				n = b[6] << 24 | b[7] << 16 | b[8] << 8 | b[9];
+				pos = 10;
+			}
+			if ( pos + n > sizeof(rx) ) {
+				return -1;
+			} else if ( rx_len < pos + n ) {
+				break;
+			}
+			int found = want != NULL && n > 0 && n < size && rx[pos] != '\0' && strchr(want, rx[pos]) != NULL;
+			if ( found ) {
+				memcpy(msg, &rx[pos], n);
+				msg[n] = '\0';
+			}
+			rx_len -= pos + n;
+			memmove(rx, &rx[pos + n], rx_len);
+			if ( found ) {
+				return n;
+			}
+		}
+		int n = recv(sock, &rx[rx_len], sizeof(rx) - rx_len, want != NULL ? 0 : MSG_DONTWAIT);
+		if ( n <= 0 ) {
+			return n < 0 && want == NULL && ( errno == EAGAIN || errno == EWOULDBLOCK ) ? 0 : -1;
+		}
+		rx_len += n;
+	}
+}
+
+static int ws_connect(char *target) {
+	char *colon = strchr(target, ':');
+	int port = 9090;
+	if ( colon != NULL ) {
+		*colon = '\0';
+		port = atoi(colon + 1);
+	}
+	int sock = socket_create();
+	if ( sock < 0 || socket_connect(sock, target, port) < 0 ) {
+		printf("Cannot connect to %s:%d\n", target, port);
+		return -1;
+	}
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) & ~O_NONBLOCK);
+	char msg[512];
+	sprintf(msg, "GET / HTTP/1.1\r\nHost: %s\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+		"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n", target);
+	send(sock, msg, strlen(msg), 0);
+	int len = 0;
+	while ( len < sizeof(msg) - 1 ) {
+		int n = recv(sock, &msg[len], sizeof(msg) - 1 - len, 0);
+		if ( n <= 0 ) {
+			break;
+		}
+		len += n;
+		msg[len] = '\0';
+		if ( strstr(msg, "\r\n\r\n") != NULL ) {
+			break;
+		}
+	}
+	if ( strstr(msg, " 101 ") == NULL ) {
+		printf("Handshake failed\n");
+		socket_close(sock);
+		return -1;
+	}
+	rx_len = 0;
+	return sock;
+}
+
+// c: collisions, conflicting packets, syscalls and commands of the worker, then of the bus thread,
+// idle waits of the worker and the bus
+static int counters(int sock, unsigned long long *c) {
+	char msg[160];
+	if ( ws_send(sock, "c") < 0 || ws_read(sock, "c", msg, sizeof(msg)) < 0
+		|| sscanf(msg, "c%16llx%16llx%16llx%16llx%16llx%16llx%16llx%16llx", &c[0], &c[1], &c[2], &c[3], &c[4], &c[5], &c[6], &c[7]) != 8 ) {
+		return -1;
+	}
+	return 0;
+}
+
+// pass > 0: one pass of a soak test, ends with the memory report of the server
+static int play_server(char *target, int pass) {
+	int sock = ws_connect(target);
+	if ( sock < 0 ) {
+		return 1;
+	}
+	char msg[64];
+	unsigned long long before[8];
+	unsigned long long after[8];
+	int counted = counters(sock, before) == 0;
+	int sent = 0;
+	for ( uint32_t i = 0; i < header->count; i++ ) {
+		journal_entry_t *e = &entries[i];
+		twpc_packet_t packet;
+		packet.data_raw = e->data;
+		if ( e->type != JOURNAL_CMD || control_format(msg, &packet) < 0 ) {
+			continue;
+		}
+		pace(e);
+		if ( ws_send(sock, msg) < 0 || ws_read(sock, NULL, NULL, 0) < 0 ) {
+			printf("Connection lost\n");
+			break;
+		}
+		sent++;
+	}
+	printf("%d commands sent in %.3f s\n", sent, (double)( journal_time() - replay_start ) / 1e9);
+	if ( counted && sent > 0 && counters(sock, after) == 0 ) {
+		// the waits which timed out are the idle timer of the threads, not the commands
+		double worker = (double)( after[2] - before[2] - ( after[6] - before[6] ) ) / sent;
+		double bus = (double)( after[4] - before[4] - ( after[7] - before[7] ) ) / sent;
+		printf("%.2f syscalls per command (worker %.2f, bus %.2f), %.2f idle waits per command left out\n", worker + bus, worker, bus,
+			(double)( after[6] - before[6] + after[7] - before[7] ) / sent);
+	}
+	int result = 0;
+	unsigned long rss = 0;
+	unsigned conns[3];
+	unsigned frames[3];
+	if ( pass > 0 ) {
+		if ( ws_send(sock, "p") < 0 || ws_read(sock, "p", msg, sizeof(msg)) < 0
+			|| sscanf(msg, "p%8lx%4x%4x%4x%4x%4x%4x", &rss, &conns[0], &conns[1], &conns[2], &frames[0], &frames[1], &frames[2]) != 7 ) {
+			printf("No memory report\n");
+			result = 1;
+		} else {
+			printf("pass %d: rss %lu kB, conns %u/%u (peak %u), frames %u/%u (peak %u)\n", pass, rss,
+				conns[0], conns[1], conns[2], frames[0], frames[1], frames[2]);
+		}
+	}
+	socket_close(sock);
+	return result;
+}
+
+// The resident memory of a server without leaks stops growing after the first passes
+static int soak_server(const char *target, double hours) {
+	char host[256];
+	uint64_t end = journal_time() + (uint64_t)( hours * 3600e9 );
+	for ( int pass = 1; journal_time() < end; pass++ ) {
+		snprintf(host, sizeof(host), "%s", target);
+		replay_start = journal_time();
+		if ( play_server(host, pass) != 0 ) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Trains the server found, discovery may still be running right after the start
+static int trains(int sock, uint8_t *uids) {
+	char msg[64];
+	char query[8];
+	unsigned uid, type, caps, link, present;
+	sprintf(query, "q%02x", SIM_TRAIN);
+	for ( int tries = 0; tries < 50; tries++ ) {
+		int n = 0;
+		if ( ws_send(sock, query) < 0 ) {
+			return -1;
+		}
+		msg[0] = '\0';
+		while ( ws_read(sock, "dq", msg, sizeof(msg)) > 0 && msg[0] == 'd' ) {
+			if ( sscanf(msg, "d%2x%2x%2x%2x%1u", &uid, &type, &caps, &link, &present) == 5 && present ) {
+				uids[n++] = uid;
+			}
+		}
+		if ( msg[0] != 'q' ) {
+			return -1;
+		} else if ( n > 0 ) {
+			return n;
+		}
+		usleep(100000);
+	}
+	return 0;
+}
+
+// Commands at 0.1-0.6 s, or without pause with -f, the same seed gives the same commands
+static int random_server(char *target, const char *path, unsigned seed, int commands) {
+	const uint8_t speeds[] = { 0, 120, 200, 255, 255 };
+	uint8_t uids[256];
+	char msg[64];
+	if ( layout_load(path) < 0 ) {
+		return 1;
+	} else if ( layout.switches_n == 0 ) {
+		printf("%s has no switches\n", path);
+		return 1;
+	}
+	int sock = ws_connect(target);
+	if ( sock < 0 ) {
+		return 1;
+	}
+	int n = trains(sock, uids);
+	if ( n <= 0 ) {
+		printf("No trains on the server\n");
+		socket_close(sock);
+		return 1;
+	}
+	srand(seed);
+	int sent = 0;
+	for ( ; sent < commands; sent++ ) {
+		if ( rand() % 10 < 6 ) {
+			sprintf(msg, "m%02x%02x%02x", uids[rand() % n], rand() % 2, speeds[rand() % 5]);
+		} else {
+			layout_switch_t *sw = &layout.switches[rand() % layout.switches_n];
+			sprintf(msg, "s%02x%02x%c", sw->uid, sw->arg, rand() % 2 ? '1' : '0');
+		}
+		if ( ws_send(sock, msg) < 0 || ws_read(sock, NULL, NULL, 0) < 0 ) {
+			printf("Connection lost\n");
+			break;
+		}
+		int pause = 100 + rand() % 500; // drawn with -f too, the commands stay the same
+		if ( !fast ) {
+			usleep(pause * 1000);
+		}
+	}
+	unsigned long long c[8];
+	int result = 0;
+	if ( counters(sock, c) < 0 ) {
+		printf("No counters\n");
+		result = 1;
+	} else {
+		printf("seed %u: %d commands on %d trains in %.3f s, %llu collisions, %llu conflicting packets\n", seed, sent, n,
+			(double)( journal_time() - replay_start ) / 1e9, c[0], c[1]);
+		result = sent < commands || c[0] > 0 || c[1] > 0;
+	}
+	socket_close(sock);
+	return result;
+}
+
+static int play_master(void) {
+	sim_t *sim = sim_create(0);
+	// devices which answered in the recording are present, at every rate until one went unanswered
+	for ( uint32_t i = 0; i < header->count; i++ ) {
+		twpc_packet_t packet;
+		packet.data_raw = entries[i].data;
+		if ( entries[i].type == JOURNAL_REPLY && packet.data_raw != 0 && packet.uid != 0 && packet.uid != 255 ) {
+			sim->devices[packet.uid].present = 1;
+			sim->devices[packet.uid].rate_max = TWPC_RATES - 1;
+		}
+	}
+	// expected replies per link, in order
+	uint32_t expect[UART_MAX_LINKS][64];
+	uint8_t expect_rate[UART_MAX_LINKS][64]; // TWPC rate of the packet
+	int expect_head[UART_MAX_LINKS] = { 0, };
+	int expect_tail[UART_MAX_LINKS] = { 0, };
+	int tx = 0;
+	int matched = 0;
+	int mismatched = 0;
+	for ( uint32_t i = 0; i < header->count; i++ ) {
+		journal_entry_t *e = &entries[i];
+		int l = e->link % UART_MAX_LINKS;
+		if ( e->type == JOURNAL_TX ) {
+			twpc_packet_t in;
+			twpc_packet_t out;
+			in.data_raw = e->data;
+			pace(e);
+			sim_transaction(sim, &in, e->arg, &out);
+			expect_rate[l][expect_head[l] % 64] = e->arg;
+			expect[l][expect_head[l]++ % 64] = out.data_raw;
+			tx++;
+		} else if ( e->type == JOURNAL_REPLY && expect_tail[l] != expect_head[l] ) {
+			int rate = expect_rate[l][expect_tail[l] % 64];
+			twpc_packet_t want;
+			want.data_raw = expect[l][expect_tail[l]++ % 64];
+			if ( want.data_raw == e->data ) {
+				matched++;
+			} else if ( e->data == 0 && rate > 0 ) {
+				sim->devices[want.uid].rate_max = rate - 1; // not that fast in the recording
+				matched++;
+			} else {
+				mismatched++;
+				printf("%12.6f link %d: recorded %08x, simulated %08x\n", (double)( e->time - header->start ) / 1e9, e->link, e->data, want.data_raw);
+			}
+		} else if ( e->type == JOURNAL_SENT && expect_tail[l] != expect_head[l] ) {
+			expect_tail[l]++; // nothing to compare
+		} else if ( e->type == JOURNAL_ERROR && e->data != 0 && expect_tail[l] != expect_head[l] ) {
+			expect_tail[l]++; // lost on the link, never answered
+		} else if ( e->type == JOURNAL_TIMEOUT ) {
+			expect_tail[l] = expect_head[l]; // the server gave up on what the master had
+		}
+	}
+	printf("%d packets, %d replies matched, %d differ, %.3f s simulated bus time\n", tx, matched, mismatched, (double)sim->bus_us / 1e6);
+	sim_free(sim);
+	return mismatched > 0;
+}
+
+int main(int argc, char *argv[]) {
+	char *target = NULL;
+	int master = 0;
+	double hours = 0;
+	char *seed = NULL;
+	int opt;
+	while ( ( opt = getopt(argc, argv, "fs:l:mr:h") ) != -1 ) {
+		if ( opt == 'f' ) {
+			fast = 1;
+		} else if ( opt == 's' ) {
+			target = optarg;
+		} else if ( opt == 'l' ) {
+			hours = atof(optarg);
+		} else if ( opt == 'm' ) {
+			master = 1;
+		} else if ( opt == 'r' ) {
+			seed = optarg;
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if ( optind >= argc || ( seed != NULL && target == NULL ) ) {
+		usage(argv[0]);
+		return 1;
+	}
+	if ( seed != NULL ) {
+		char *colon = strchr(seed, ':');
+		replay_start = journal_time();
+		return random_server(target, argv[optind], strtoul(seed, NULL, 0), colon != NULL ? atoi(colon + 1) : 200);
+	}
+	if ( load(argv[optind]) < 0 ) {
+		return 1;
+	}
+	replay_start = journal_time();
+	if ( target != NULL && hours > 0 ) {
+		return soak_server(target, hours);
+	} else if ( target != NULL ) {
+		return play_server(target, 0);
+	} else if ( master ) {
+		return play_master();
+	}
+	print();
+	return 0;
+}
@@ -0,0 +1,381 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include "uart.h"
+#include "sim.h"
+
+static sim_t *sim_layouts[UART_MAX_LINKS]; // the ones with the layout model, for sim_counters()
+
+// Devices 1..n, the first half are trains, the rest switches
+sim_t *sim_create(int n) {
+	sim_t *sim = (sim_t *)malloc(sizeof(sim_t));
+	if ( sim == NULL ) {
+		return NULL;
+	}
+	memset(sim, 0, sizeof(sim_t));
+	sim->fd = -1;
+	sim->link = -1;
+	if ( n > 254 ) {
+		n = 254;
+	}
+	for ( int uid = 0; uid < 256; uid++ ) {
+		sim->devices[uid].block = LAYOUT_NONE;
+	}
+	for ( int uid = 1; uid <= n; uid++ ) {
+		sim_device_t *d = &sim->devices[uid];
+		d->present = 1;
+		d->type = uid <= ( n + 1 ) / 2 ? SIM_TRAIN : SIM_SWITCH;
+		d->name[0] = d->type == SIM_TRAIN ? 'T' : 'S';
+		d->name[1] = '0' + ( uid / 10 ) % 10;
+		d->name[2] = '0' + uid % 10;
+		d->rate_max = uid % 4 == 0 ? 1 : TWPC_RATES - 1; // every fourth one is slower
+	}
+	return sim;
+}
+
+void sim_free(sim_t *sim) {
+	sim_stop(sim);
+	if ( sim->link >= 0 && sim->link < UART_MAX_LINKS && sim_layouts[sim->link] == sim ) {
+		sim_layouts[sim->link] = NULL;
+	}
+	free(sim);
+}
+
+static void sim_apply(sim_device_t *d, const twpc_packet_t *in, twpc_packet_t *out) {
+	*out = *in;
+	if ( in->cmd == TWPC_CMD_LIGHT_ON ) {
+		d->light = 1;
+	} else if ( in->cmd == TWPC_CMD_LIGHT_OFF ) {
+		d->light = 0;
+	} else if ( in->cmd == TWPC_CMD_MOTOR_A ) {
+		d->speed = in->arg;
+		d->dir = 1;
+	} else if ( in->cmd == TWPC_CMD_MOTOR_B ) {
+		d->speed = in->arg;
+		d->dir = 0;
+	} else if ( in->cmd == TWPC_CMD_STATUS ) {
+		if ( in->arg == 0 ) {
+			out->arg = d->light | ( d->dir << 1 ) | ( d->fork << 2 );
+		} else if ( in->arg == 1 ) {
+			out->arg = d->speed;
+		} else {
+			out->arg = 0;
+		}
+	} else if ( in->cmd == TWPC_CMD_NAME && in->arg < 3 ) {
+		out->arg = d->name[in->arg];
+	} else if ( in->cmd == TWPC_CMD_SW_STRAIGHT ) {
+		d->fork = 0;
+	} else if ( in->cmd == TWPC_CMD_SW_FORK ) {
+		d->fork = 1;
+	} else if ( in->cmd == TWPC_CMD_GROUP ) {
+		int group = in->arg & 0x0F;
+		if ( group < TWPC_GROUPS && ( in->arg & 0xF0 ) == TWPC_GROUP_JOIN ) {
+			d->groups |= 1 << group;
+		} else if ( group < TWPC_GROUPS && ( in->arg & 0xF0 ) == TWPC_GROUP_LEAVE ) {
+			d->groups &= ~( 1 << group );
+		}
+		out->arg = d->groups;
+	}
+	out->checksum = TWPC_CHECKSUM(*out);
+}
+
+// A device takes the packets to its uid, broadcasts and the ones to its groups
+static int sim_addressed(const sim_device_t *d, int uid, int to) {
+	return to == uid || to == 255 || ( TWPC_IS_GROUP(to) && ( d->groups & ( 1 << ( to - TWPC_GROUP_FIRST ) ) ) );
+}
+
+// Same behaviour as the master + device firmware at a TWPC rate, returns the bus time in us
+int sim_transaction(sim_t *sim, const twpc_packet_t *in, int rate, twpc_packet_t *out) {
+	sim->transactions++;
+	if ( in->uid == 0 ) { // handled by the master itself
+		*out = *in;
+		return 0;
+	}
+	int bits = SIM_FRAME_BITS;
+	if ( in->uid == 255 && in->cmd == TWPC_CMD_DISCOVER ) {
+		// every device of the block drives its own bit of the same answer
+		int block = in->arg & 0x0F;
+		int type = in->arg >> 4;
+		uint32_t bitmap = 0;
+		for ( int slot = 0; slot < TWPC_DISCOVER_SLOTS; slot++ ) {
+			int uid = block * TWPC_DISCOVER_SLOTS + slot;
+			if ( uid > 0 && uid < 255 && sim->devices[uid].present && ( type == 0 || sim->devices[uid].type == type - 1 ) ) {
+				bitmap |= 1UL << slot;
+			}
+		}
+		out->data_raw = bitmap ? ~bitmap : 0; // the last bit is never driven
+		bits += bitmap ? SIM_FRAME_BITS : SIM_FAULT_BITS;
+	} else if ( ( in->checksum & TWPC_NO_REPLY ) && in->uid != 255 ) {
+		for ( int uid = 1; uid < 255; uid++ ) {
+			sim_device_t *d = &sim->devices[uid];
+			if ( d->present && rate <= d->rate_max && sim_addressed(d, uid, in->uid) ) {
+				sim_apply(d, in, out);
+			}
+		}
+		out->data_raw = 0; // the master does not wait for an answer
+	} else if ( in->uid == 255 || !sim->devices[in->uid].present || rate > sim->devices[in->uid].rate_max ) {
+		for ( int uid = 1; in->uid == 255 && uid < 255; uid++ ) {
+			if ( sim->devices[uid].present ) {
+				sim_apply(&sim->devices[uid], in, out);
+			}
+		}
+		out->data_raw = 0; // nobody answers, the master gives up
+		bits += SIM_FAULT_BITS;
+	} else {
+		sim_apply(&sim->devices[in->uid], in, out);
+		bits += SIM_FRAME_BITS;
+	}
+	sim->bus_us += bits * SIM_BIT_US >> rate;
+	return bits * SIM_BIT_US >> rate;
+}
+
+// Other train in a block of the layout, 0 if none
+static int sim_train_in(sim_t *sim, int block, int uid) {
+	for ( int i = 1; i < 255 && block != LAYOUT_NONE; i++ ) {
+		if ( i != uid && sim->devices[i].type == SIM_TRAIN && sim->devices[i].block == block ) {
+			return i;
+		}
+	}
+	return 0;
+}
+
+// Block a train runs into with its motor turning in dir
+static int sim_target(sim_t *sim, sim_device_t *d, int dir) {
+	if ( dir != d->forward ) {
+		return d->behind;
+	}
+	int sw = layout.blocks[d->block].sw;
+	return layout_exit(d->behind, d->block, sw == LAYOUT_NONE ? 0 : sim->switches[sw]);
+}
+
+// The rules the interlocking must keep: no train started into an occupied block, no switch moved under a train
+static void sim_check(sim_t *sim, const twpc_packet_t *in) {
+	if ( in->cmd == TWPC_CMD_MOTOR_A || in->cmd == TWPC_CMD_MOTOR_B ) {
+		int dir = in->cmd == TWPC_CMD_MOTOR_A;
+		for ( int uid = 1; uid < 255 && in->arg > 0; uid++ ) {
+			sim_device_t *d = &sim->devices[uid];
+			if ( sim_addressed(d, uid, in->uid) && d->type == SIM_TRAIN && d->block != LAYOUT_NONE
+				&& sim_train_in(sim, sim_target(sim, d, dir), uid) ) {
+				sim->conflicts++;
+			}
+		}
+	} else if ( in->cmd == TWPC_CMD_SW_STRAIGHT || in->cmd == TWPC_CMD_SW_FORK ) {
+		int sw = layout_switch(in->uid, in->arg);
+		if ( sw >= 0 ) {
+			if ( sim_train_in(sim, layout.switches[sw].block, 0) ) {
+				sim->conflicts++;
+			}
+			sim->switches[sw] = in->cmd == TWPC_CMD_SW_FORK;
+		}
+	}
+}
+
+static uint64_t sim_now_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static uint32_t sim_length(int block) {
+	return ( layout.blocks[block].length ? layout.blocks[block].length : SIM_BLOCK_MM ) * 1000;
+}
+
+// mm/s of a train, every motor is a bit different
+static uint32_t sim_velocity(int uid, sim_device_t *d) {
+	return d->speed < SIM_STALL ? 0 : ( d->speed - SIM_STALL ) * ( 8 + uid % 5 ) / 8;
+}
+
+// Train passes the sensor into block at time, the master reports it if the sensor is on this link
+static void sim_enter(sim_t *sim, int uid, int block, uint64_t us) {
+	sim_device_t *d = &sim->devices[uid];
+	int s = layout.joins[d->block][block];
+	if ( sim_train_in(sim, block, uid) ) {
+		sim->collisions++;
+	}
+	d->behind = d->block;
+	d->block = block;
+	d->forward = d->dir;
+	d->um = 0;
+	if ( s != LAYOUT_NONE && layout.sensors[s].link == sim->link ) {
+		char frame[LINK_ENCODED_MAX];
+		uint16_t tick = us / SIM_TICK_US;
+		uint8_t event[4] = { layout.sensors[s].pin, uid, tick, tick >> 8 };
+		int len = uart_frame(frame, LINK_SENSOR, 0, event, 4);
+		if ( write(sim->fd, frame, len) != len ) {
+			return;
+		}
+	}
+}
+
+// Moves the trains to time now, us after the last move
+static void sim_move(sim_t *sim, uint64_t now, uint32_t us) {
+	for ( int uid = 1; uid < 255; uid++ ) {
+		sim_device_t *d = &sim->devices[uid];
+		uint32_t v = sim_velocity(uid, d);
+		if ( d->type != SIM_TRAIN || d->block == LAYOUT_NONE || v == 0 ) {
+			continue;
+		}
+		uint32_t step = (uint64_t)v * us / 1000; // um
+		uint32_t length = sim_length(d->block);
+		int target = sim_target(sim, d, d->dir);
+		if ( d->dir != d->forward ) {
+			if ( d->um > step ) {
+				d->um -= step;
+			} else {
+				sim_enter(sim, uid, target, now - (uint64_t)( step - d->um ) * 1000 / v);
+			}
+		} else if ( d->um + step < length ) {
+			d->um += step;
+		} else if ( target != LAYOUT_NONE ) {
+			sim_enter(sim, uid, target, now - (uint64_t)( d->um + step - length ) * 1000 / v);
+		} else {
+			d->um = length; // end of the track
+		}
+	}
+}
+
+// Puts the trains on every second block, the sensor they just passed reports them
+void sim_layout(sim_t *sim, int link) {
+	int uid = 1;
+	sim->link = link;
+	if ( link >= 0 && link < UART_MAX_LINKS ) {
+		sim_layouts[link] = sim;
+	}
+	for ( int block = 0; block < layout.blocks_n; block += 2 ) {
+		while ( uid < 255 && ( !sim->devices[uid].present || sim->devices[uid].type != SIM_TRAIN ) ) {
+			uid++;
+		}
+		if ( uid == 255 ) {
+			break;
+		}
+		layout_block_t *b = &layout.blocks[block];
+		for ( int i = 0; i < b->sensors_n; i++ ) {
+			layout_sensor_t *s = &layout.sensors[b->sensors[i]];
+			if ( s->b == block && s->link == link && layout_exit(s->a, block, 0) != LAYOUT_NONE ) {
+				sim->devices[uid].block = s->a;
+				sim_enter(sim, uid, block, sim_now_us());
+				sim->devices[uid].um = sim_length(block) / 2;
+				uid++;
+				break;
+			}
+		}
+	}
+}
+
+// Collisions and conflicting packets of all the running sims so far
+void sim_counters(uint64_t *collisions, uint64_t *conflicts) {
+	*collisions = 0;
+	*conflicts = 0;
+	for ( int i = 0; i < UART_MAX_LINKS; i++ ) {
+		if ( sim_layouts[i] != NULL ) {
+			*collisions += __atomic_load_n(&sim_layouts[i]->collisions, __ATOMIC_RELAXED);
+			*conflicts += __atomic_load_n(&sim_layouts[i]->conflicts, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+// Answers a frame of the server like the master: a reply with its seq, or LINK_LOST
+static void sim_frame(sim_t *sim, uart_frame_t *f, int good, uint8_t *seq) {
+	char frame[LINK_ENCODED_MAX];
+	twpc_packet_t in;
+	twpc_packet_t out;
+	int len;
+	if ( !good && f->len != LINK_PACKET_FRAME && f->len != LINK_PACKET_FRAME + 1 ) {
+		return; // not a packet, nothing to answer
+	} else if ( !good ) {
+		len = uart_frame(frame, LINK_LOST, ( *seq )++, NULL, 0);
+	} else if ( f->type == LINK_SPEED && f->len == 1 && f->body[0] < LINK_BAUDS_N ) {
+		len = uart_frame(frame, LINK_SPEED, f->seq, f->body, 1); // a socket has no rate
+	} else if ( f->type != LINK_PACKET || ( f->len != sizeof(twpc_packet_t) && f->len != sizeof(twpc_packet_t) + 1 ) ) {
+		return;
+	} else {
+		memcpy(&in, f->body, sizeof(twpc_packet_t));
+		*seq = f->seq + 1;
+		if ( !TWPC_CHECKSUM_OK(in) ) {
+			len = uart_frame(frame, LINK_LOST, f->seq, NULL, 0);
+		} else {
+			if ( sim->link >= 0 ) {
+				sim_check(sim, &in);
+			}
+			int rate = f->len > sizeof(twpc_packet_t) && LINK_RATE(f->body[4]) < TWPC_RATES ? LINK_RATE(f->body[4]) : 0; // the sim drives one bus for every district
+			int us = sim_transaction(sim, &in, rate, &out);
+			if ( sim->realtime && us > 0 ) {
+				usleep(us);
+			}
+			if ( in.checksum & TWPC_NO_REPLY ) {
+				len = uart_frame(frame, LINK_SENT, f->seq, NULL, 0);
+			} else {
+				len = uart_frame(frame, LINK_REPLY, f->seq, &out, sizeof(twpc_packet_t));
+			}
+		}
+	}
+	if ( write(sim->fd, frame, len) != len ) {
+		return;
+	}
+}
+
+static void *sim_thread(void *arg) {
+	sim_t *sim = (sim_t *)arg;
+	char buffer[256];
+	uart_reader_t reader;
+	uart_frame_t f;
+	uint8_t seq = 0; // of the next packet
+	struct pollfd pfd;
+	pfd.fd = sim->fd;
+	pfd.events = POLLIN;
+	reader.n = 0;
+	uint64_t last = sim_now_us();
+	while ( sim->running ) {
+		int ready = poll(&pfd, 1, sim->link >= 0 ? SIM_TICK_MS : 100);
+		if ( sim->link >= 0 ) {
+			uint64_t now = sim_now_us();
+			sim_move(sim, now, now - last);
+			last = now;
+		}
+		if ( ready <= 0 ) {
+			continue;
+		}
+		int n = read(sim->fd, buffer, sizeof(buffer));
+		if ( n <= 0 ) {
+			break;
+		}
+		for ( int i = 0; i < n; i++ ) {
+			int result = uart_unframe(&reader, buffer[i], &f);
+			if ( result != 0 ) {
+				sim_frame(sim, &f, result > 0, &seq);
+			}
+		}
+	}
+	return NULL;
+}
+
+// Returns the fd the server uses as the uart of this master
+int sim_start(sim_t *sim, int realtime) {
+	int fds[2];
+	if ( socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0 ) {
+		return -1;
+	}
+	sim->fd = fds[1];
+	sim->realtime = realtime;
+	sim->running = 1;
+	if ( pthread_create(&sim->thread, NULL, sim_thread, sim) != 0 ) {
+		close(fds[0]);
+		close(fds[1]);
+		sim->running = 0;
+		return -1;
+	}
+	return fds[0];
+}
+
+void sim_stop(sim_t *sim) {
+	if ( sim->running ) {
+		sim->running = 0;
+		pthread_join(sim->thread, NULL);
+		close(sim->fd);
+		sim->fd = -1;
+	}
+}
@@ -0,0 +1,67 @@
+#ifndef SIM_H
+#define SIM_H
+
+/*
+ * Simulated master board with devices on its TWPC bus
+ * speaks the same uart protocol as src/master
+ */
+
+#include <stdint.h>
+#include <pthread.h>
+#include "../../twpc_def.h"
+#include "layout.h"
+
+#define SIM_TRAIN TWPC_TYPE_TRAIN
+#define SIM_SWITCH TWPC_TYPE_SWITCH
+
+#define SIM_BIT_US 1000 // one TWPC bit at rate 0 (two 0.5ms half bits)
+#define SIM_FRAME_BITS ( 3 + TWPC_DATA_BITS ) // start bits + data + stop
+#define SIM_FAULT_BITS 26 // TWPC_FAULT_THRESHOLD of the master
+#define SIM_BLOCK_MM 1000 // length of the blocks the layout has no length for
+#define SIM_STALL 24 // PWM below which a motor does not turn
+#define SIM_TICK_US 496 // timer tick of the master
+#define SIM_TICK_MS 10 // trains move in steps of this
+
+typedef struct {
+	uint8_t present;
+	uint8_t type;
+	uint8_t light;
+	uint8_t dir;
+	uint8_t speed;
+	uint8_t fork;
+	char name[3];
+	uint8_t rate_max; // fastest TWPC rate it answers at
+	uint8_t groups;
+	// trains on the layout
+	uint8_t block; // LAYOUT_NONE if not on the layout
+	uint8_t behind;
+	uint8_t forward; // dir running away from behind
+	uint32_t um; // distance from behind
+} sim_device_t;
+
+typedef struct {
+	sim_device_t devices[256];
+	int realtime;
+	uint64_t bus_us;
+	uint64_t transactions;
+	int fd;
+	// layout model: trains move by their speed (mm/s) and pass the sensors of link
+	int link; // -1 without the layout
+	uint8_t switches[LAYOUT_MAX_SWITCHES];
+	uint64_t collisions; // a train entered an occupied block
+	uint64_t conflicts; // packets the interlocking should not have sent
+	pthread_t thread;
+	volatile int running;
+} sim_t;
+
+sim_t *sim_create(int);
+void sim_free(sim_t *);
+
+int sim_transaction(sim_t *, const twpc_packet_t *, int, twpc_packet_t *);
+
+void sim_layout(sim_t *, int);
+void sim_counters(uint64_t *, uint64_t *);
+int sim_start(sim_t *, int);
+void sim_stop(sim_t *);
+
+#endif
@@ -0,0 +1,67 @@
+#include <stdlib.h>
+#include <string.h>
+#include "slab.h"
+
+// per_slab objects of size each time the pool runs out, up to slabs_max times
+void slab_init(slab_t *s, const char *name, int size, int per_slab, int slabs_max) {
+	memset(s, 0, sizeof(slab_t));
+	s->name = name;
+	s->size = ( size + 15 ) & ~15;
+	s->per_slab = per_slab;
+	s->slabs_max = slabs_max < SLAB_MAX ? slabs_max : SLAB_MAX;
+}
+
+void slab_destroy(slab_t *s) {
+	for ( int i = 0; i < s->slabs_n; i++ ) {
+		free(s->slabs[i]);
+	}
+	s->slabs_n = 0;
+	s->free = NULL;
+	s->used = 0;
+}
+
+static int slab_grow(slab_t *s) {
+	if ( s->slabs_n == s->slabs_max ) {
+		return -1;
+	}
+	char *slab = (char *)malloc((size_t)s->size * s->per_slab);
+	if ( slab == NULL ) {
+		return -1;
+	}
+	s->slabs[s->slabs_n++] = slab;
+	for ( int i = s->per_slab - 1; i >= 0; i-- ) {
+		slab_object_t *o = (slab_object_t *)( slab + (size_t)i * s->size );
+		o->next = s->free;
+		s->free = o;
+	}
+	return 0;
+}
+
+// NULL if the pool is full
+void *slab_alloc(slab_t *s) {
+	if ( s->free == NULL && slab_grow(s) < 0 ) {
+		return NULL;
+	}
+	slab_object_t *o = s->free;
+	s->free = o->next;
+	s->used++;
+	s->allocs++;
+	if ( s->used > s->peak ) {
+		s->peak = s->used;
+	}
+	return o;
+}
+
+void slab_release(slab_t *s, void *p) {
+	if ( p != NULL ) {
+		slab_object_t *o = (slab_object_t *)p;
+		o->next = s->free;
+		s->free = o;
+		s->used--;
+	}
+}
+
+// Objects allocated from the system so far
+int slab_capacity(slab_t *s) {
+	return s->slabs_n * s->per_slab;
+}
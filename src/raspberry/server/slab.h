@@ -0,0 +1,38 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+/*
+ * Pools of fixed size objects
+ * slabs of objects are allocated when a pool runs out and kept until it is destroyed,
+ * a server in steady state reuses its objects and never calls malloc
+ * a pool belongs to one thread
+ */
+
+#include <stdint.h>
+
+#define SLAB_MAX 64 // slabs of a pool at most
+
+typedef struct slab_object_s {
+	struct slab_object_s *next;
+} slab_object_t;
+
+typedef struct {
+	const char *name;
+	int size; // of an object, rounded for alignment
+	int per_slab;
+	int slabs_max;
+	char *slabs[SLAB_MAX];
+	int slabs_n;
+	slab_object_t *free;
+	int used;
+	int peak;
+	uint64_t allocs; // of objects, not of memory
+} slab_t;
+
+void slab_init(slab_t *, const char *, int, int, int);
+void slab_destroy(slab_t *);
+void *slab_alloc(slab_t *);
+void slab_release(slab_t *, void *);
+int slab_capacity(slab_t *);
+
+#endif
@@ -50,11 +50,22 @@ int socket_listen(int socket_id, int port) {
 	if ( bind(socket_id, (struct sockaddr *)&address, sizeof(address)) < 0 ) {
 		return -1;
 	}
-	listen(socket_id, 5);
+	listen(socket_id, SOMAXCONN);
 	socket_nonblock(socket_id);
 	return 0;
 }
 
+// several sockets may listen on the same port, the kernel balances connections between them
+int socket_listen_shared(int socket_id, int port) {
+#ifdef SO_REUSEPORT
+	int yes = 1;
+	if ( setsockopt(socket_id, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) < 0 ) {
+		return -1;
+	}
+#endif
+	return socket_listen(socket_id, port);
+}
+
 int socket_connect(int socket_id, char *ip, int port) {
 	struct sockaddr_in address;
 	memset(&address, 0, sizeof(struct sockaddr_in));
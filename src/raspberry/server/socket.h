@@ -40,6 +40,7 @@
 
 int socket_create();
 int socket_listen(int, int);
+int socket_listen_shared(int, int);
 int socket_connect(int, char *, int);
 void socket_close(int);
 int socket_accept(int);
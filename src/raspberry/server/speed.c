@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <string.h>
+#include "layout.h"
+#include "speed.h"
+
+/*
+A block is measured when a train leaves it: its length over the time between
+the sensor it came in through and the one it leaves through. The sample counts
+only if the motor ran with the same command for the whole block, from
+SPEED_SETTLE after the last change. Samples go to the curve point of their PWM
+(a running average of both the PWM and the speed), the curve is the line
+through the points with samples.
+
+A target speed is turned into PWM by the curve (1 mm/s per PWM step while it
+has no points), plus a trim the controller integrates from the error of every
+measured block. A new motor command is only sent if the PWM moves by
+SPEED_DEADBAND or more. Any other motor command to the train (a client, the
+interlocking) ends the control.
+*/
+
+typedef struct {
+	uint16_t pwm[SPEED_POINTS]; // averages, 1/16 PWM steps
+	uint16_t mms[SPEED_POINTS];
+	uint8_t samples[SPEED_POINTS];
+} speed_curve_t;
+
+typedef struct {
+	speed_curve_t curve;
+	uint8_t pwm; // last sent
+	uint8_t dir;
+	uint64_t changed; // journal_time() of the last change
+	uint8_t block; // block entered and when
+	uint64_t entered;
+	uint16_t measured; // mm/s of the last block
+	uint16_t target; // mm/s, 0: no control
+	uint8_t command; // PWM the controller sent last
+	int16_t trim;
+} speed_train_t;
+
+static speed_train_t trains[256];
+static speed_send_t speed_send;
+static speed_measured_t speed_measured;
+static uint64_t samples;
+static uint64_t corrections;
+static uint64_t skipped; // corrections within the deadband
+
+void speed_init(speed_send_t send, speed_measured_t measured) {
+	memset(trains, 0, sizeof(trains));
+	for ( int i = 0; i < 256; i++ ) {
+		trains[i].block = LAYOUT_NONE;
+	}
+	speed_send = send;
+	speed_measured = measured;
+	samples = 0;
+	corrections = 0;
+	skipped = 0;
+}
+
+// PWM for a speed on the curve of a train
+int speed_pwm(int train, int mms) {
+	speed_curve_t *c = &trains[train].curve;
+	int lo = -1; // last point below mms
+	int hi = -1; // first point at or above mms
+	int prev = -1;
+	if ( mms <= 0 ) {
+		return 0;
+	}
+	for ( int i = 0; i < SPEED_POINTS && hi < 0; i++ ) {
+		if ( c->samples[i] == 0 ) {
+			continue;
+		} else if ( c->mms[i] >= mms ) {
+			hi = i;
+		} else {
+			prev = lo;
+			lo = i;
+		}
+	}
+	if ( hi < 0 && prev >= 0 ) {
+		// faster than any point: on from the last two
+		hi = lo;
+		lo = prev;
+	}
+	int pwm;
+	if ( lo < 0 && hi < 0 ) {
+		pwm = mms;
+	} else if ( lo < 0 || hi < 0 ) {
+		int i = lo < 0 ? hi : lo; // a single point: through the origin
+		pwm = c->mms[i] > 0 ? mms * c->pwm[i] / c->mms[i] / 16 : 255;
+	} else {
+		int dv = c->mms[hi] - c->mms[lo];
+		pwm = ( c->pwm[lo] + ( dv > 0 ? ( mms - c->mms[lo] ) * ( c->pwm[hi] - c->pwm[lo] ) / dv : 0 ) ) / 16;
+	}
+	return pwm < 1 ? 1 : pwm > 255 ? 255 : pwm;
+}
+
+static void speed_motor(int train, int pwm) {
+	speed_train_t *t = &trains[train];
+	twpc_packet_t packet;
+	packet.uid = train;
+	packet.cmd = t->dir ? TWPC_CMD_MOTOR_B : TWPC_CMD_MOTOR_A;
+	packet.arg = pwm;
+	packet.checksum = TWPC_CHECKSUM(packet);
+	t->command = pwm;
+	speed_send(&packet);
+}
+
+// Hold a train at mm/s, 0 stops it
+void speed_set(int train, int dir, int mms) {
+	speed_train_t *t = &trains[train];
+	if ( t->dir != dir || mms == 0 ) {
+		t->trim = 0;
+	}
+	t->dir = dir;
+	t->target = mms;
+	int pwm = mms == 0 ? 0 : speed_pwm(train, mms) + t->trim;
+	speed_motor(train, pwm < 0 ? 0 : pwm > 255 ? 255 : pwm);
+}
+
+// Every motor packet that went to a master
+void speed_sent(const twpc_packet_t *packet, uint64_t time) {
+	int dir = packet->cmd == TWPC_CMD_MOTOR_B;
+	for ( int train = packet->uid == 255 ? 1 : packet->uid; train <= ( packet->uid == 255 ? 254 : packet->uid ); train++ ) {
+		speed_train_t *t = &trains[train];
+		if ( t->target > 0 && ( packet->arg != t->command || dir != t->dir ) ) {
+			t->target = 0; // someone else drives the train
+		}
+		if ( packet->arg != t->pwm || dir != t->dir ) {
+			t->changed = time;
+		}
+		t->pwm = packet->arg;
+		t->dir = dir;
+	}
+}
+
+static void speed_sample(int train, int mms) {
+	speed_train_t *t = &trains[train];
+	speed_curve_t *c = &t->curve;
+	int i = t->pwm / 16;
+	if ( c->samples[i] == 0 ) {
+		c->pwm[i] = t->pwm * 16;
+		c->mms[i] = mms;
+	} else {
+		c->pwm[i] = ( c->pwm[i] * 3 + t->pwm * 16 ) / 4;
+		c->mms[i] = ( c->mms[i] * 3 + mms ) / 4;
+	}
+	if ( c->samples[i] < 255 ) {
+		c->samples[i]++;
+	}
+	t->measured = mms;
+	samples++;
+	speed_measured(train, mms);
+	if ( t->target == 0 ) {
+		return;
+	}
+	// integral control on what the curve does not know yet
+	int trim = t->trim + ( t->target - mms ) * speed_pwm(train, t->target) / t->target / 4;
+	t->trim = trim < -SPEED_TRIM ? -SPEED_TRIM : trim > SPEED_TRIM ? SPEED_TRIM : trim;
+	int pwm = speed_pwm(train, t->target) + t->trim;
+	pwm = pwm < 1 ? 1 : pwm > 255 ? 255 : pwm;
+	if ( pwm - t->pwm >= SPEED_DEADBAND || t->pwm - pwm >= SPEED_DEADBAND ) {
+		speed_motor(train, pwm);
+		corrections++;
+	} else {
+		skipped++;
+	}
+}
+
+// Train passed the sensor from a block to the next one at time
+void speed_moved(int train, int from, int to, uint64_t time) {
+	speed_train_t *t = &trains[train];
+	if ( t->block == from && from != LAYOUT_NONE && layout.blocks[from].length > 0 && t->pwm > 0
+		&& t->changed + SPEED_SETTLE * 1000000ULL <= t->entered && time > t->entered ) {
+		speed_sample(train, layout.blocks[from].length * 1000000000ULL / ( time - t->entered ));
+	}
+	t->block = to;
+	t->entered = time;
+}
+
+void speed_report(void) {
+	printf("speed: %llu blocks measured, %llu corrections, %llu within the deadband\n",
+		(unsigned long long)samples, (unsigned long long)corrections, (unsigned long long)skipped);
+	for ( int train = 1; train < 255; train++ ) {
+		speed_curve_t *c = &trains[train].curve;
+		int n = 0;
+		char line[256];
+		for ( int i = 0; i < SPEED_POINTS; i++ ) {
+			if ( c->samples[i] > 0 ) {
+				n += sprintf(&line[n], " %d:%d", c->pwm[i] / 16, c->mms[i]);
+			}
+		}
+		if ( n > 0 ) {
+			printf("speed: train %d PWM:mm/s%s\n", train, line);
+		}
+	}
+}
+
+int speed_save(void *data) {
+	memcpy(data, trains, sizeof(trains));
+	return sizeof(trains);
+}
+
+// Curves and targets of the previous server, the clock is the same CLOCK_MONOTONIC
+int speed_restore(const void *data, int len) {
+	if ( len != sizeof(trains) ) {
+		return -1;
+	}
+	memcpy(trains, data, sizeof(trains));
+	return 0;
+}
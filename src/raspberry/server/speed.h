@@ -0,0 +1,32 @@
+#ifndef SPEED_H
+#define SPEED_H
+
+/*
+ * Train speeds: measured over the blocks of the layout from the sensor times,
+ * learnt per train as a PWM -> mm/s curve, held at a target by a feedback controller
+ * runs in the bus thread
+ */
+
+#include <stdint.h>
+#include "../../twpc_def.h"
+
+#define SPEED_POINTS 16 // curve points per train, one per 16 PWM steps
+#define SPEED_SETTLE 500 // ms after a motor change before a block is measured
+#define SPEED_DEADBAND 3 // PWM correction worth a bus transaction
+#define SPEED_TRIM 64 // PWM correction of the controller at most
+#define SPEED_UNIT 4 // mm/s per step of a client request
+#define SPEED_CMD 0xC0 // pseudo command of a client request (+1: motor B), arg is the speed in SPEED_UNIT
+
+typedef void (*speed_send_t)(twpc_packet_t *);
+typedef void (*speed_measured_t)(int, int);
+
+void speed_init(speed_send_t, speed_measured_t);
+void speed_sent(const twpc_packet_t *, uint64_t);
+void speed_moved(int, int, int, uint64_t);
+void speed_set(int, int, int);
+int speed_pwm(int, int);
+int speed_save(void *);
+int speed_restore(const void *, int);
+void speed_report(void);
+
+#endif
@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/random.h>
+#include "websocket.h"
+#include "layout.h"
+#include "state.h"
+
+/*
+Stream of a client, all hex:
+Y[version] - forget everything, a snapshot follows
+u[version][entries] - entries, more of the same version follow
+U[version][entries] - entries, the client is at version now
+an entry is [uid (2)][field (1)][value (4)]
+
+A version is one batch, fields changed several times in a tick are sent
+once. The batches live in a ring, a slot carries its version as a
+sequence number: 0 while the bus thread rewrites it, so a reader copying
+a slot can tell if it was overwritten under it. Every process starts its
+versions at a random point, a client at a version of the previous server
+(handover, reconnect with y) does not find it among the batches and gets
+a snapshot.
+*/
+
+typedef struct {
+	uint32_t version;
+	int len; // -1: too big, clients resync
+	char frames[STATE_BATCH_SIZE];
+} state_batch_t;
+
+typedef struct {
+	char *out;
+	int size;
+	int len;
+	uint32_t version;
+	char msg[STATE_MSG_SIZE + 16];
+	int msg_len;
+	int overflow;
+} state_writer_t;
+
+static const uint16_t defaults[STATE_FIELDS] = { 0, 0, 0, LAYOUT_NONE, 0 };
+
+static uint16_t values[256][STATE_FIELDS];
+static uint8_t dirty[256]; // bit per field
+static int pending;
+static uint64_t first; // bus_now() of the first change of the batch, 0 until the next tick sees it
+static uint32_t current; // version of the last batch
+static state_batch_t batches[STATE_BATCHES];
+
+static void state_flush(state_writer_t *w, char type) {
+	if ( w->msg_len == 0 ) {
+		w->msg_len = sprintf(w->msg, "%c%08x", type, w->version);
+	}
+	w->msg[0] = type;
+	if ( w->len + WEBSOCKET_HEADROOM + w->msg_len > w->size ) {
+		w->overflow = 1;
+	} else {
+		w->len += websocket_frame(&w->out[w->len], WEBSOCKET_OP_TEXT, w->msg, w->msg_len);
+	}
+	w->msg_len = 0;
+}
+
+static void state_put(state_writer_t *w, int uid, int field, int value) {
+	if ( w->msg_len + 7 > STATE_MSG_SIZE ) {
+		state_flush(w, 'u');
+	}
+	if ( w->msg_len == 0 ) {
+		w->msg_len = sprintf(w->msg, "u%08x", w->version);
+	}
+	w->msg_len += sprintf(&w->msg[w->msg_len], "%02x%x%04x", uid, field, value);
+}
+
+static void state_writer(state_writer_t *w, char *out, int size, uint32_t version) {
+	w->out = out;
+	w->size = size;
+	w->len = 0;
+	w->version = version;
+	w->msg_len = 0;
+	w->overflow = 0;
+}
+
+// Snapshots before the first batch are the random first version, below 2^30 so it does not wrap
+void state_init(void) {
+	uint32_t start;
+	if ( getrandom(&start, sizeof(start), 0) != sizeof(start) ) {
+		start = (uint32_t)time(NULL) ^ (uint32_t)getpid() << 16;
+	}
+	for ( int uid = 0; uid < 256; uid++ ) {
+		memcpy(values[uid], defaults, sizeof(defaults));
+	}
+	memset(dirty, 0, sizeof(dirty));
+	memset(batches, 0, sizeof(batches));
+	pending = 0;
+	first = 0;
+	current = ( start & 0x3FFFFFFF ) + 1; // 0 is the version of a client not subscribed
+}
+
+void state_set(int uid, int field, int value) {
+	if ( uid < 0 || uid > 255 || values[uid][field] == value ) {
+		return;
+	}
+	__atomic_store_n(&values[uid][field], value, __ATOMIC_RELAXED);
+	dirty[uid] |= 1 << field;
+	pending = 1;
+}
+
+// Publishes the changes of a tick as the next version, returns it or 0 if it is not time yet
+uint32_t state_tick(uint64_t now) {
+	if ( !pending ) {
+		return 0;
+	} else if ( first == 0 ) {
+		first = now;
+		return 0;
+	} else if ( now - first < STATE_TICK_MS ) {
+		return 0;
+	}
+	uint32_t version = current + 1;
+	state_batch_t *b = &batches[version % STATE_BATCHES];
+	state_writer_t w;
+	__atomic_store_n(&b->version, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	state_writer(&w, b->frames, STATE_BATCH_SIZE, version);
+	for ( int uid = 0; uid < 256; uid++ ) {
+		for ( int field = 0; dirty[uid] && field < STATE_FIELDS; field++ ) {
+			if ( dirty[uid] & ( 1 << field ) ) {
+				state_put(&w, uid, field, values[uid][field]);
+			}
+		}
+		dirty[uid] = 0;
+	}
+	state_flush(&w, 'U');
+	b->len = w.overflow ? -1 : w.len;
+	__atomic_store_n(&b->version, version, __ATOMIC_RELEASE);
+	__atomic_store_n(&current, version, __ATOMIC_RELEASE);
+	pending = 0;
+	first = 0;
+	return version;
+}
+
+// ms until the changes are due, -1 if there are none
+int state_timeout(uint64_t now) {
+	if ( !pending ) {
+		return -1;
+	} else if ( first == 0 ) {
+		return STATE_TICK_MS;
+	}
+	return now - first >= STATE_TICK_MS ? 0 : STATE_TICK_MS - ( now - first );
+}
+
+uint32_t state_version(void) {
+	return __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+}
+
+// Frames of a version, -1 if it is not kept any more
+int state_batch(uint32_t version, char *frames) {
+	state_batch_t *b = &batches[version % STATE_BATCHES];
+	if ( __atomic_load_n(&b->version, __ATOMIC_ACQUIRE) != version ) {
+		return -1;
+	}
+	int len = b->len;
+	if ( len > 0 ) {
+		memcpy(frames, b->frames, len);
+	}
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if ( __atomic_load_n(&b->version, __ATOMIC_RELAXED) != version ) {
+		return -1;
+	}
+	return len;
+}
+
+// Frames of every field off its default, at least as new as the version returned
+int state_snapshot(char *frames, uint32_t *version) {
+	state_writer_t w;
+	*version = state_version();
+	state_writer(&w, frames, STATE_SNAPSHOT_SIZE, *version);
+	state_flush(&w, 'Y');
+	for ( int uid = 0; uid < 256; uid++ ) {
+		for ( int field = 0; field < STATE_FIELDS; field++ ) {
+			int value = __atomic_load_n(&values[uid][field], __ATOMIC_RELAXED);
+			if ( value != defaults[field] ) {
+				state_put(&w, uid, field, value);
+			}
+		}
+	}
+	state_flush(&w, 'U');
+	return w.len;
+}
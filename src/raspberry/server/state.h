@@ -0,0 +1,36 @@
+#ifndef STATE_H
+#define STATE_H
+
+/*
+ * Versioned state of the devices for the dashboards
+ * the bus thread sets fields, changes are published as one batch per tick,
+ * serialized (as websocket frames) once and sent as they are to every subscribed client
+ * batches and the table can be read from any thread
+ */
+
+#include <stdint.h>
+
+#define STATE_TICK_MS 40 // changes are collected this long into a batch
+#define STATE_BATCHES 64 // last batches kept for clients catching up
+#define STATE_BATCH_SIZE 2048 // frames of a batch at most, clients resync after a bigger one
+#define STATE_SNAPSHOT_SIZE 16384
+#define STATE_MSG_SIZE 120 // text of a frame at most
+
+// fields of a uid
+#define STATE_PRESENT 0
+#define STATE_FLAGS 1 // REGISTRY_STATE_* bits
+#define STATE_SPEED 2 // motor PWM
+#define STATE_BLOCK 3 // block of a train, LAYOUT_NONE if not known
+#define STATE_MMS 4 // measured mm/s
+#define STATE_FIELDS 5
+
+void state_init(void);
+void state_set(int, int, int);
+uint32_t state_tick(uint64_t);
+int state_timeout(uint64_t);
+
+uint32_t state_version(void);
+int state_batch(uint32_t, char *);
+int state_snapshot(char *, uint32_t *);
+
+#endif
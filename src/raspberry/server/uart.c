@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <termios.h>
@@ -8,32 +9,66 @@
 
 /*
 RaspberryPi UART software for model railway
-connects to Arduino MEGA
+connects to the master boards (one link per board)
 created by LSzabi
 
 thanks to wiringPi library for their code
 */
 
-static int uart_stream = -1;
+typedef struct {
+	int fd;
+	char path[64];
+	int baud_max; // the link may be switched up to it
+} uart_link_t;
 
-void uart_setup() {
-	uart_stream = open("/dev/ttyAMA0", O_RDWR | O_NOCTTY | O_NDELAY | O_NONBLOCK);
+static uart_link_t uart_list[UART_MAX_LINKS];
+static int uart_n = 0;
+
+static speed_t uart_speed(int baud) {
+	switch ( baud ) {
+		case 9600: return B9600;
+		case 19200: return B19200;
+		case 38400: return B38400;
+		case 57600: return B57600;
+		case 115200: return B115200;
+		case 230400: return B230400;
+		case 460800: return B460800;
+		case 500000: return B500000;
+		case 1000000: return B1000000;
+	}
+	return B0;
+}
+
+// Opened at the first rate of the link, baud is the highest it may be switched to,
+// with cts nothing is sent while the master holds its CTS line high,
+// returns the index of the new link, -1 on error
+int uart_open(const char *path, int baud, int cts) {
+	const int bauds[LINK_BAUDS_N] = LINK_BAUDS;
+	if ( uart_n == UART_MAX_LINKS || baud < bauds[0] ) {
+		return -1;
+	}
+	int uart_stream = open(path, O_RDWR | O_NOCTTY | O_NDELAY | O_NONBLOCK);
 	if ( uart_stream == -1 ) {
-		printf("Error opening /dev/ttyAMA0\n");
+		printf("Error opening %s\n", path);
+		return -1;
 	}
-	fcntl(uart_stream, F_SETFL, O_RDWR);
 	struct termios options;
 	tcgetattr(uart_stream, &options);
 	cfmakeraw(&options);
-	cfsetispeed(&options, B57600);
-	cfsetospeed(&options, B57600);
+	cfsetispeed(&options, uart_speed(bauds[0]));
+	cfsetospeed(&options, uart_speed(bauds[0]));
 	options.c_cflag |= CLOCAL | CREAD;
 	options.c_cflag &= ~( PARENB | CSTOPB | CSIZE );
 	options.c_cflag |= CS8;
+	if ( cts ) {
+		options.c_cflag |= CRTSCTS;
+	} else {
+		options.c_cflag &= ~CRTSCTS;
+	}
 	options.c_lflag &= ~( ICANON | ECHO | ECHOE | ISIG );
 	options.c_oflag &= ~OPOST;
-	options.c_cc[VMIN] = 0;
-	options.c_cc[VTIME] = 1; // wait time: n * 100ms
+	options.c_cc[VMIN] = 1; // reads are driven by the event loop
+	options.c_cc[VTIME] = 0;
 	tcsetattr(uart_stream, TCSANOW | TCSAFLUSH, &options);
 	int status;
 	ioctl(uart_stream, TIOCMGET, &status);
@@ -41,52 +76,181 @@ void uart_setup() {
 	ioctl(uart_stream, TIOCMSET, &status);
 	usleep(10000);
 	tcflush(uart_stream, TCIFLUSH);
+	int link = uart_add(uart_stream, path);
+	if ( link >= 0 ) {
+		uart_list[link].baud_max = baud;
+	}
+	return link;
+}
+
+// Registers an already open stream (e.g. a simulated master) as a link
+int uart_add(int fd, const char *name) {
+	if ( uart_n == UART_MAX_LINKS ) {
+		close(fd);
+		return -1;
+	}
+	uart_list[uart_n].fd = fd;
+	uart_list[uart_n].baud_max = 0;
+	strncpy(uart_list[uart_n].path, name, sizeof(uart_list[uart_n].path) - 1);
+	return uart_n++;
 }
 
 void uart_close() {
-	close(uart_stream);
+	for ( int i = 0; i < uart_n; i++ ) {
+		close(uart_list[i].fd);
+	}
+	uart_n = 0;
+}
+
+int uart_links() {
+	return uart_n;
+}
+
+int uart_fd(int link) {
+	return link >= 0 && link < uart_n ? uart_list[link].fd : -1;
+}
+
+// Link index of a file descriptor, -1 if it is not a uart
+int uart_link(int fd) {
+	for ( int i = 0; i < uart_n; i++ ) {
+		if ( uart_list[i].fd == fd ) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+const char *uart_path(int link) {
+	return uart_list[link].path;
+}
+
+// Highest rate the link may be switched to, 0 if it stays at the rate it has
+int uart_baud_max(int link) {
+	return uart_list[link].baud_max;
+}
+
+// Switches the rate after what was written is out, streams other than a tty have none
+int uart_baud(int link, int baud) {
+	struct termios options;
+	if ( !isatty(uart_fd(link)) ) {
+		return 0;
+	} else if ( uart_speed(baud) == B0 || tcgetattr(uart_fd(link), &options) < 0 ) {
+		return -1;
+	}
+	cfsetispeed(&options, uart_speed(baud));
+	cfsetospeed(&options, uart_speed(baud));
+	return tcsetattr(uart_fd(link), TCSADRAIN, &options);
 }
 
-void uart_putchar(char c) {
-	int count = write(uart_stream, &c, 1);
+void uart_putchar(int link, char c) {
+	int count = write(uart_fd(link), &c, 1);
 	if ( count != 1 ) {
 		printf("UART TX error (in putchar)\n");
 	}
 }
 
-int uart_getchar() {
+int uart_getchar(int link) {
 	char c;
-	if ( read(uart_stream, &c, 1) != 1 ) {
+	if ( read(uart_fd(link), &c, 1) != 1 ) {
 		return -1;
 	}
 	return ( (int)c ) & 0xFF;
 }
 
-int uart_rx(char *s, int n) {
-	return read(uart_stream, s, n);
-	/*
-	int i;
-	for ( i = 0; i < n; i++ ) {
-		int c = uart_getchar();
-		if ( c == -1 ) {
-			break;
-		}
-		s[i] = c;
-	}
-	s[i] = '\0';
-	return i;
-	*/
+int uart_rx(int link, char *s, int n) {
+	return read(uart_fd(link), s, n);
 }
 
-void uart_tx(char *s, int n) {
-	int count = write(uart_stream, s, n);
+void uart_tx(int link, char *s, int n) {
+	int count = write(uart_fd(link), s, n);
 	if ( count != n ) {
 		printf("UART TX error\n");
 	}
-	/*
-	int i;
-	for ( i = 0; i < n; i++ ) {
-		uart_putchar(s[i]);
+}
+
+// Framing of the link, see link_def.h
+
+uint16_t uart_crc(uint16_t crc, uint8_t data) {
+	crc ^= data;
+	for ( int i = 0; i < 8; i++ ) {
+		crc = crc & 1 ? ( crc >> 1 ) ^ 0x8408 : crc >> 1;
+	}
+	return crc;
+}
+
+// Encoded frame ended by its 0 into out (LINK_ENCODED_MAX), returns its length
+int uart_frame(char *out, int type, int seq, const void *body, int len) {
+	uint8_t frame[LINK_FRAME_MAX];
+	uint16_t crc = LINK_CRC_INIT;
+	int n = 0;
+	frame[n++] = type;
+	frame[n++] = seq;
+	if ( len > 0 ) {
+		memcpy(&frame[n], body, len);
+		n += len;
+	}
+	for ( int i = 0; i < n; i++ ) {
+		crc = uart_crc(crc, frame[i]);
+	}
+	frame[n++] = crc;
+	frame[n++] = crc >> 8;
+	// COBS: every 0 becomes the distance to the next one, frames are too short for runs of 254
+	int code = 0;
+	int pos = 1;
+	for ( int i = 0; i < n; i++ ) {
+		if ( frame[i] == 0 ) {
+			out[code] = pos - code;
+			code = pos++;
+		} else {
+			out[pos++] = frame[i];
+		}
+	}
+	out[code] = pos - code;
+	out[pos++] = 0;
+	return pos;
+}
+
+// Takes a byte of the link: 1 if it ended a good frame, -1 if it ended a bad one, 0 otherwise
+int uart_unframe(uart_reader_t *r, char c, uart_frame_t *f) {
+	uint8_t frame[LINK_FRAME_MAX];
+	if ( c != 0 ) {
+		if ( r->n >= 0 && r->n < LINK_ENCODED_MAX - 1 ) { // without its 0
+			r->data[r->n++] = c;
+		} else {
+			r->n = -1;
+		}
+		return 0;
+	}
+	int len = r->n;
+	int n = 0;
+	r->n = 0;
+	f->len = -1;
+	if ( len <= 0 ) {
+		return len < 0 ? -1 : 0; // empty frames only resync
+	}
+	for ( int i = 0; i < len; ) {
+		int code = r->data[i++];
+		if ( code == 0 || i + code - 1 > len ) {
+			return -1;
+		}
+		for ( int j = 1; j < code; j++ ) {
+			frame[n++] = r->data[i++];
+		}
+		if ( i < len ) {
+			frame[n++] = 0;
+		}
+	}
+	f->len = n;
+	uint16_t crc = LINK_CRC_INIT;
+	for ( int i = 0; i < n - 2; i++ ) {
+		crc = uart_crc(crc, frame[i]);
+	}
+	if ( n < 4 || n - 4 > LINK_BODY_MAX || frame[n - 2] != ( crc & 0xFF ) || frame[n - 1] != crc >> 8 ) {
+		return -1;
 	}
-	*/
+	f->type = frame[0];
+	f->seq = frame[1];
+	f->len = n - 4;
+	memcpy(f->body, &frame[2], f->len);
+	return 1;
 }
@@ -1,13 +1,45 @@
 #ifndef UART_H
 #define UART_H
 
-void uart_setup();
+#define UART_MAX_LINKS 8
+#define UART_DEFAULT_PATH "/dev/ttyAMA0"
+#define UART_DEFAULT_BAUD 1000000 // highest rate negotiated with a master
+
+#include <stdint.h>
+#include "../../link_def.h"
+
+typedef struct {
+	int type;
+	int seq;
+	uint8_t body[LINK_BODY_MAX];
+	int len; // of the body, of the whole decoded frame if it was bad
+} uart_frame_t;
+
+// Encoded bytes of the frame being received
+typedef struct {
+	uint8_t data[LINK_ENCODED_MAX];
+	int n; // -1: too long, skipped up to the next 0
+} uart_reader_t;
+
+int uart_open(const char *, int, int);
+int uart_add(int, const char *);
 void uart_close();
 
-void uart_putchar(char);
-int uart_getchar();
+int uart_links();
+int uart_fd(int);
+int uart_link(int);
+const char *uart_path(int);
+int uart_baud_max(int);
+int uart_baud(int, int);
+
+void uart_putchar(int, char);
+int uart_getchar(int);
+
+int uart_rx(int, char *, int);
+void uart_tx(int, char *, int);
 
-int uart_rx(char *, int);
-void uart_tx(char *, int);
+uint16_t uart_crc(uint16_t, uint8_t);
+int uart_frame(char *, int, int, const void *, int);
+int uart_unframe(uart_reader_t *, char, uart_frame_t *);
 
 #endif
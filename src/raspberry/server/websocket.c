@@ -1,7 +1,7 @@
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdio.h>
-#include "socket.h"
 #include "sha1.h"
 #include "websocket.h"
 
@@ -15,26 +15,30 @@ static char encoding_table[] = {
 	'0', '1', '2', '3', '4', '5', '6', '7', '8', '9', '+', '/'
 };
 
-char *base64_encode(const unsigned char *data, size_t input_length) {
+// output_length + 1 bytes into out
+static void base64_write(char *out, const unsigned char *data, size_t input_length) {
 	int output_length = 4 * ( ( input_length + 2 ) / 3 );
-	char *encoded_data = (char *)malloc(sizeof(char) * ( output_length + 1 ));
-	if ( encoded_data == NULL ) {
-		return NULL;
-	}
 	for ( int i = 0, j = 0; i < input_length; ) {
 		uint32_t octet_a = i < input_length ? (unsigned char)data[i++] : 0;
 		uint32_t octet_b = i < input_length ? (unsigned char)data[i++] : 0;
 		uint32_t octet_c = i < input_length ? (unsigned char)data[i++] : 0;
 		uint32_t triple = (octet_a << 0x10) + (octet_b << 0x08) + octet_c;
-		encoded_data[j++] = encoding_table[(triple >> 3 * 6) & 0x3F];
-		encoded_data[j++] = encoding_table[(triple >> 2 * 6) & 0x3F];
-		encoded_data[j++] = encoding_table[(triple >> 1 * 6) & 0x3F];
-		encoded_data[j++] = encoding_table[(triple >> 0 * 6) & 0x3F];
+		out[j++] = encoding_table[(triple >> 3 * 6) & 0x3F];
+		out[j++] = encoding_table[(triple >> 2 * 6) & 0x3F];
+		out[j++] = encoding_table[(triple >> 1 * 6) & 0x3F];
+		out[j++] = encoding_table[(triple >> 0 * 6) & 0x3F];
 	}
 	for ( int i = 0; i < mod_table[input_length % 3]; i++ ) {
-		encoded_data[output_length - 1 - i] = '=';
+		out[output_length - 1 - i] = '=';
+	}
+	out[output_length] = '\0';
+}
+
+char *base64_encode(const unsigned char *data, size_t input_length) {
+	char *encoded_data = (char *)malloc(sizeof(char) * ( 4 * ( ( input_length + 2 ) / 3 ) + 1 ));
+	if ( encoded_data != NULL ) {
+		base64_write(encoded_data, data, input_length);
 	}
-	encoded_data[output_length] = '\0';
 	return encoded_data;
 }
 
@@ -42,82 +46,104 @@ static uint32_t read_octet(unsigned char *buffer, int start) {
 	return buffer[start] << 24 | buffer[start + 1] << 16 | buffer[start + 2] << 8 | buffer[start + 3];
 }
 
-static uint32_t read_bits(unsigned char *buffer, int frame, int start_bit, int bits) {
-	uint32_t frame_data = read_octet(buffer, 4 * frame);
-	return ( frame_data >> start_bit ) & ( ( 1 << bits ) - 1 );
-}
-
-static char *websocket_key(const char *input) {
-	char *output = (char *)malloc(sizeof(char) * 64);
-	memset(output, 0, sizeof(char) * 64);
+// Sec-WebSocket-Accept of a request into accept (29 bytes)
+static int websocket_key(const char *input, char *accept) {
 	const char search[] = "Sec-WebSocket-Key: ";
-	char *start = strstr(input, search);
+	const char *start = strstr(input, search);
 	if ( start == NULL ) {
-		return NULL;
+		return -1;
 	}
 	start += strlen(search);
-	char *end = strstr((const char *)start, "\r");
+	const char *end = strstr(start, "\r");
 	if ( end == NULL ) {
-		end = strstr((const char *)start, "\n");
+		end = strstr(start, "\n");
+	}
+	if ( end == NULL || end - start > 32 ) {
+		return -1;
 	}
+	char output[32 + sizeof(guid)];
+	memset(output, 0, sizeof(output));
 	strncpy(output, start, end - start);
 	strcat(output, guid);
 	char sha1[20];
 	SHA1String(output, sha1);
-	char *base64 = base64_encode((const unsigned char *)sha1, 20);
-	free(output);
-	return base64;
+	base64_write(accept, (const unsigned char *)sha1, 20);
+	return 0;
 }
 
-int websocket_accept(int sock) {
-	char msg[512];
-	int len = 0;
-	while ( len == 0 ) {
-		len = socket_recv(sock, msg, 512);
-	}
-	if ( len < 0 ) {
-		return 0;
+int websocket_handshake(const char *request, char *response) {
+	char key[32];
+	if ( websocket_key(request, key) < 0 ) {
+		return -1;
 	}
-	msg[len] = '\0';
-	char *key = websocket_key(msg);
-	sprintf(msg, "HTTP/1.1 101 Switching Protocols\r\n"
+	sprintf(response, "HTTP/1.1 101 Switching Protocols\r\n"
 		"Upgrade: websocket\r\n"
 		"Connection: Upgrade\r\n"
 		"Sec-WebSocket-Accept: %s\r\n\r\n", key);
-	free(key);
-	if ( socket_send(sock, msg, strlen(msg)) < 0 ) {
+	return strlen(response);
+}
+
+int websocket_decode(const char *data, int len, char *msg, int size, int *opcode) {
+	const unsigned char *buffer = (const unsigned char *)data;
+	if ( len < 2 ) {
+		return 0;
+	}
+	int pos = 2;
+	uint64_t pl_len = buffer[1] & 0x7F;
+	if ( pl_len == 126 ) {
+		if ( len < 4 ) {
+			return 0;
+		}
+		pl_len = buffer[2] << 8 | buffer[3];
+		pos = 4;
+	} else if ( pl_len == 127 ) {
+		if ( len < 10 ) {
+			return 0;
+		}
+		pl_len = (uint64_t)read_octet((unsigned char *)buffer, 2) << 32 | read_octet((unsigned char *)buffer, 6);
+		pos = 10;
+	}
+	if ( pl_len >= size ) {
+		return -1;
+	}
+	const unsigned char *mask = &buffer[pos];
+	if ( buffer[1] & 0x80 ) {
+		pos += 4;
+	}
+	if ( len < pos + pl_len ) {
 		return 0;
 	}
-	return 1;
+	for ( int i = 0; i < pl_len; i++ ) {
+		msg[i] = buffer[1] & 0x80 ? buffer[pos + i] ^ mask[i % 4] : buffer[pos + i];
+	}
+	msg[pl_len] = '\0';
+	*opcode = buffer[0] & 0x0F;
+	return pos + pl_len;
 }
 
-int websocket_recv(int sock, char *msg) {
-	char buffer[512];
-	int len = socket_recv(sock, buffer, 512);
-	if ( len < 0 ) {
-		return -1;
-	} else if ( len > 0 ) {
-		int opcode = read_bits((unsigned char *)buffer, 0, 24, 4);
-		if ( opcode == 0x01 ) {
-			int pl_len = read_bits((unsigned char *)buffer, 0, 16, 7);
-			uint32_t mask_key = read_octet((unsigned char *)buffer, 2);
-			int i;
-			for ( i = 0; i < pl_len; i++ ) {
-				msg[i] = ((unsigned char *)buffer)[6 + i] ^ ((unsigned char *)buffer)[2 + i % 4];
-			}
-			msg[i] = '\0';
-			return strlen(msg);
-		} else if ( opcode == 0x08 ) {
-			return -1;
+// Header of a frame written into the headroom right before its payload, returns its length
+int websocket_prefix(char *payload, int opcode, int len) {
+	int n = len < 126 ? 2 : len < 65536 ? 4 : 10;
+	unsigned char *h = (unsigned char *)payload - n;
+	h[0] = 0x80 | opcode;
+	if ( n == 2 ) {
+		h[1] = len;
+	} else if ( n == 4 ) {
+		h[1] = 126;
+		h[2] = len >> 8;
+		h[3] = len;
+	} else {
+		h[1] = 127;
+		for ( int i = 0; i < 8; i++ ) {
+			h[2 + i] = (uint64_t)len >> ( 56 - 8 * i );
 		}
 	}
-	return 0;
+	return n;
 }
 
-int websocket_send(int sock, char *msg) {
-	char response[512];
-	response[0] = 0x81;
-	response[1] = strlen(msg);
-	sprintf(&(response[2]), "%s", msg);
-	return socket_send(sock, response, 2 + strlen(msg));
+// frame needs WEBSOCKET_HEADROOM bytes more than the message
+int websocket_frame(char *frame, int opcode, const char *msg, int len) {
+	int n = len < 126 ? 2 : len < 65536 ? 4 : 10;
+	memmove(&frame[n], msg, len);
+	return websocket_prefix(&frame[n], opcode, len) + len;
 }
@@ -3,10 +3,18 @@
 
 #include <stdlib.h>
 
+#define WEBSOCKET_OP_TEXT 0x01
+#define WEBSOCKET_OP_CLOSE 0x08
+#define WEBSOCKET_OP_PING 0x09
+#define WEBSOCKET_OP_PONG 0x0A
+
+#define WEBSOCKET_HEADROOM 10 // longest frame header
+
 char *base64_encode(const unsigned char *, size_t);
 
-int websocket_accept(int);
-int websocket_recv(int, char *);
-int websocket_send(int, char *);
+int websocket_handshake(const char *, char *);
+int websocket_decode(const char *, int, char *, int, int *);
+int websocket_prefix(char *, int, int);
+int websocket_frame(char *, int, const char *, int);
 
 #endif
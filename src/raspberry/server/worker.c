@@ -0,0 +1,353 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "socket.h"
+#include "control.h"
+#include "bus.h"
+#include "worker.h"
+#include "journal.h"
+#include "registry.h"
+#include "layout.h"
+#include "handover.h"
+#include "state.h"
+#include "websocket.h"
+#include "sim.h"
+
+// sock: listener handed over by the previous server, -1 to open one on port
+worker_t *worker_create(int id, int backend, int port, int sock) {
+	worker_t *w = (worker_t *)malloc(sizeof(worker_t));
+	if ( w == NULL ) {
+		return NULL;
+	}
+	memset(w, 0, sizeof(worker_t));
+	w->id = id;
+	slab_init(&w->pool, "conns", sizeof(conn_t), 16, IO_MAX_FDS / 16);
+	w->sock_listen = sock >= 0 ? sock : socket_create();
+	if ( w->sock_listen < 0 || ( sock < 0 && socket_listen_shared(w->sock_listen, port) == -1 ) ) {
+		printf("Bind failed\n");
+		free(w);
+		return NULL;
+	}
+	if ( queue_init(&w->events, sizeof(bus_event_t), BUS_QUEUE_SIZE) < 0 ) {
+		socket_close(w->sock_listen);
+		free(w);
+		return NULL;
+	}
+	w->io = io_create(backend);
+	if ( w->io == NULL ) {
+		queue_free(&w->events);
+		socket_close(w->sock_listen);
+		free(w);
+		return NULL;
+	}
+	io_add(w->io, w->sock_listen, IO_FD_LISTEN);
+	io_add(w->io, w->events.fd, IO_FD_STREAM);
+	bus_attach(&w->events);
+	return w;
+}
+
+static int worker_open(worker_t *w, int fd, conn_t *c) {
+	if ( fd >= IO_MAX_FDS || c == NULL ) {
+		printf("No room for more connections\n");
+		conn_free(&w->pool, c);
+		socket_close(fd);
+		return -1;
+	}
+	w->conns[fd] = c;
+	io_add(w->io, fd, IO_FD_SOCKET);
+	w->open_pos[fd] = w->open_n;
+	w->open[w->open_n++] = fd;
+	return 0;
+}
+
+static void worker_forget(worker_t *w, int fd) {
+	io_del(w->io, fd);
+	conn_free(&w->pool, w->conns[fd]);
+	w->conns[fd] = NULL;
+	int last = w->open[--w->open_n];
+	w->open[w->open_pos[fd]] = last;
+	w->open_pos[last] = w->open_pos[fd];
+}
+
+static void worker_close(worker_t *w, int fd) {
+	printf("Socket closed\n");
+	socket_close(fd);
+	worker_forget(w, fd);
+}
+
+// Connection handed over by the previous server, data from conn_save()
+int worker_adopt(worker_t *w, int fd, const char *data, int len) {
+	return worker_open(w, fd, conn_restore(&w->pool, fd, data, len));
+}
+
+// q or q[type]: registry entries, then the count
+static void worker_query(worker_t *w, conn_t *c, char *msg) {
+	registry_device_t devices[256];
+	char reply[CONN_MSG_SIZE];
+	int n = registry_list(strlen(msg) >= 3 ? (int)hex_to_int(&msg[1], 2) : -1, devices, 256);
+	for ( int i = 0; i < n; i++ ) {
+		registry_format(reply, &devices[i]);
+		conn_send(c, w->io, reply);
+	}
+	sprintf(reply, "q%02x", n);
+	conn_send(c, w->io, reply);
+}
+
+// o: occupant of every block
+static void worker_occupancy(worker_t *w, conn_t *c) {
+	char reply[CONN_MSG_SIZE];
+	int len = sprintf(reply, "o");
+	for ( int i = 0; i < layout.blocks_n; i++ ) {
+		len += sprintf(&reply[len], "%02x", layout_occupant(i));
+	}
+	conn_send(c, w->io, reply);
+}
+
+static void worker_pool(char *out, slab_t *s) {
+	sprintf(out, "%04x%04x%04x", s->used, slab_capacity(s), s->peak);
+}
+
+// p: resident memory of the server and the pools of this worker, for soak tests
+static void worker_memory(worker_t *w, conn_t *c) {
+	char reply[CONN_MSG_SIZE];
+	unsigned long size = 0;
+	unsigned long resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if ( f != NULL ) {
+		if ( fscanf(f, "%lu %lu", &size, &resident) != 2 ) {
+			resident = 0;
+		}
+		fclose(f);
+	}
+	int len = sprintf(reply, "p%08lx", resident * ( sysconf(_SC_PAGESIZE) / 1024 ));
+	worker_pool(&reply[len], &w->pool);
+	worker_pool(&reply[len + 12], &w->io->shared);
+	conn_send(c, w->io, reply);
+}
+
+// c: collisions and conflicting packets of the simulated masters, syscalls, commands and
+// idle waits of this worker and of the bus thread, for replay
+static void worker_counters(worker_t *w, conn_t *c) {
+	char reply[CONN_MSG_SIZE];
+	uint64_t collisions, conflicts, syscalls, idle, commands;
+	sim_counters(&collisions, &conflicts);
+	bus_counters(&syscalls, &idle, &commands);
+	sprintf(reply, "c%016llx%016llx%016llx%016llx%016llx%016llx%016llx%016llx", (unsigned long long)collisions,
+		(unsigned long long)conflicts, (unsigned long long)w->io->stats.syscalls, (unsigned long long)w->commands,
+		(unsigned long long)syscalls, (unsigned long long)commands, (unsigned long long)w->io->stats.idle,
+		(unsigned long long)idle);
+	conn_send(c, w->io, reply);
+}
+
+// Brings a subscribed client to the last version: the batches it missed or a snapshot,
+// also after a handover, the versions of the previous server are not among the batches (state_init())
+static int worker_sync(worker_t *w, conn_t *c) {
+	char frames[STATE_SNAPSHOT_SIZE];
+	uint32_t current = state_version();
+	int len = 0;
+	if ( c->version < current && current - c->version < STATE_BATCHES ) {
+		while ( c->version < current && ( len = state_batch(c->version + 1, frames) ) >= 0 ) {
+			if ( conn_send_frames(c, w->io, frames, len) < 0 ) {
+				return -1;
+			}
+			c->version++;
+		}
+	}
+	if ( c->version != current ) {
+		len = state_snapshot(frames, &c->version);
+		w->snapshots++;
+		return conn_send_frames(c, w->io, frames, len);
+	}
+	return 0;
+}
+
+// y[version]: state stream from the version on, 0 for a snapshot first
+static int worker_subscribe(worker_t *w, conn_t *c, char *msg) {
+	c->version = strlen(msg) >= 9 ? hex_to_int(&msg[1], 8) : 0;
+	return worker_sync(w, c);
+}
+
+// A batch serialized once by the bus thread goes as it is to every client right before it
+static void worker_state(worker_t *w, uint32_t version) {
+	char frames[STATE_BATCH_SIZE];
+	io_shared_t *b = io_shared_get(w->io); // a batch fits
+	int len = state_batch(version, b != NULL ? b->data : frames);
+	if ( b != NULL ) {
+		b->len = len;
+	}
+	for ( int i = w->open_n - 1; i >= 0; i-- ) {
+		int fd = w->open[i];
+		conn_t *c = w->conns[fd];
+		int result = 0;
+		if ( c->version == 0 ) {
+			continue;
+		} else if ( len >= 0 && c->version == version - 1 ) {
+			result = b != NULL ? conn_send_shared(c, w->io, b) : conn_send_frames(c, w->io, frames, len);
+			c->version = version;
+		} else {
+			result = worker_sync(w, c);
+		}
+		if ( result < 0 ) {
+			worker_close(w, fd);
+		}
+	}
+	if ( b != NULL ) {
+		io_shared_put(b);
+	}
+}
+
+static void worker_recv(worker_t *w, conn_t *c, const char *data, int len) {
+	char msg[CONN_MSG_SIZE];
+	bus_cmd_t cmd;
+	cmd.worker = w->id;
+	len = conn_feed(c, data, len);
+	while ( len >= 0 && ( len = conn_recv(c, w->io, msg) ) > 0 ) {
+		printf("Received: '%s'\n", msg);
+		w->commands++;
+		if ( msg[0] == 'q' ) {
+			worker_query(w, c, msg);
+		} else if ( msg[0] == 'o' ) {
+			worker_occupancy(w, c);
+		} else if ( msg[0] == 'p' ) {
+			worker_memory(w, c);
+		} else if ( msg[0] == 'c' ) {
+			worker_counters(w, c);
+		} else if ( msg[0] == 'y' ) {
+			if ( worker_subscribe(w, c, msg) < 0 ) {
+				len = -1;
+			}
+		} else if ( control_handle(msg, &cmd.packet) == 0 ) {
+			cmd.packet.checksum = TWPC_CHECKSUM(cmd.packet);
+			cmd.time = journal_time();
+			if ( bus_submit(&cmd) < 0 ) {
+				printf("Bus queue full\n");
+			}
+		}
+	}
+	if ( len < 0 ) {
+		worker_close(w, c->fd);
+	}
+}
+
+// telemetry fan-out: format and frame once, send the same buffer to every open connection
+static void worker_events(worker_t *w) {
+	char msg[WEBSOCKET_HEADROOM + CONN_MSG_SIZE];
+	bus_event_t ev;
+	queue_rearm(&w->events);
+	while ( queue_pop(&w->events, &ev) ) {
+		if ( ev.type == BUS_EV_STATE ) {
+			worker_state(w, ev.packet.data_raw);
+			continue;
+		}
+		// all still being sent to slow clients: framed for each of them
+		io_shared_t *b = io_shared_get(w->io);
+		char *payload = ( b != NULL ? b->buffer : msg ) + WEBSOCKET_HEADROOM;
+		int len = control_event(payload, &ev);
+		if ( len > 0 && b != NULL ) {
+			b->data = payload - websocket_prefix(payload, WEBSOCKET_OP_TEXT, len);
+			b->len = payload + len - b->data;
+		}
+		int streamed = ev.type == BUS_EV_DEVICE || ev.type == BUS_EV_BLOCK || ev.type == BUS_EV_SPEED;
+		for ( int i = w->open_n - 1; i >= 0 && len > 0; i-- ) {
+			int fd = w->open[i];
+			if ( streamed && w->conns[fd]->version != 0 ) {
+				continue; // the state stream has it
+			}
+			int result = b != NULL ? conn_send_shared(w->conns[fd], w->io, b) : conn_send(w->conns[fd], w->io, payload);
+			if ( result < 0 ) {
+				worker_close(w, fd);
+			}
+		}
+		if ( b != NULL ) {
+			io_shared_put(b);
+		}
+	}
+}
+
+static void *worker_thread(void *arg) {
+	worker_t *w = (worker_t *)arg;
+	io_event_t events[IO_MAX_EVENTS];
+	while ( w->running ) {
+		int n = io_wait(w->io, events, IO_MAX_EVENTS, 100);
+		for ( int i = 0; i < n; i++ ) {
+			io_event_t *ev = &events[i];
+			if ( ev->fd == w->events.fd ) {
+				worker_events(w);
+			} else if ( ev->type == IO_EV_ACCEPT ) {
+				printf("Connection accepted\n");
+				worker_open(w, ev->fd, conn_open(&w->pool, ev->fd));
+			} else if ( ev->type == IO_EV_CLOSE ) {
+				if ( w->conns[ev->fd] != NULL ) {
+					worker_close(w, ev->fd);
+				}
+			} else if ( ev->type == IO_EV_DATA && w->conns[ev->fd] != NULL ) {
+				worker_recv(w, w->conns[ev->fd], ev->data, ev->len);
+			}
+		}
+	}
+	worker_events(w); // what the bus said before it stopped
+	return NULL;
+}
+
+int worker_start(worker_t *w) {
+	w->running = 1;
+	if ( pthread_create(&w->thread, NULL, worker_thread, w) != 0 ) {
+		w->running = 0;
+		return -1;
+	}
+	return 0;
+}
+
+void worker_stop(worker_t *w) {
+	if ( w->running ) {
+		w->running = 0;
+		queue_wake(&w->events);
+		pthread_join(w->thread, NULL);
+	}
+	printf("worker %d: %llu syscalls, %llu events, %llu commands, %llu snapshots", w->id, (unsigned long long)w->io->stats.syscalls,
+		(unsigned long long)w->io->stats.events, (unsigned long long)w->commands, (unsigned long long)w->snapshots);
+	if ( w->commands > 0 ) {
+		printf(" (%.2f syscalls per command)", (double)w->io->stats.syscalls / w->commands);
+	}
+	printf("\n");
+	printf("worker %d: %d/%d conns (peak %d, %llu taken), %d/%d frames (peak %d, %llu taken)\n", w->id,
+		w->pool.used, slab_capacity(&w->pool), w->pool.peak, (unsigned long long)w->pool.allocs,
+		w->io->shared.used, slab_capacity(&w->io->shared), w->io->shared.peak, (unsigned long long)w->io->shared.allocs);
+}
+
+// Passes the listener and the connections of a stopped worker to the next server,
+// only closed here: a shutdown() would end them for the new process too
+int worker_export(worker_t *w, int sock) {
+	char data[CONN_SAVE_SIZE];
+	uint64_t end = journal_time() + HANDOVER_DRAIN_MS * 1000000ULL;
+	int result = handover_send(sock, HANDOVER_LISTEN, w->sock_listen, NULL, NULL, 0);
+	while ( w->open_n > 0 ) {
+		int fd = w->open[w->open_n - 1];
+		uint64_t now = journal_time();
+		if ( io_drain(w->io, fd, now < end ? ( end - now ) / 1000000 : 0) < 0 ) {
+			printf("Socket closed, its frames did not go out\n");
+		} else if ( handover_send(sock, HANDOVER_CONN, fd, NULL, data, conn_save(w->conns[fd], data)) < 0 ) {
+			result = -1;
+		}
+		close(fd);
+		worker_forget(w, fd);
+	}
+	io_del(w->io, w->sock_listen);
+	close(w->sock_listen);
+	w->sock_listen = -1;
+	return result;
+}
+
+void worker_free(worker_t *w) {
+	while ( w->open_n > 0 ) {
+		worker_close(w, w->open[w->open_n - 1]);
+	}
+	io_destroy(w->io);
+	queue_free(&w->events);
+	if ( w->sock_listen >= 0 ) {
+		socket_close(w->sock_listen);
+	}
+	slab_destroy(&w->pool);
+	free(w);
+}
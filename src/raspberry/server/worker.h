@@ -0,0 +1,40 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+/*
+ * Network worker thread
+ * own listener (SO_REUSEPORT), own connection table and event loop
+ * listener and connections can be handed over to the next server process
+ */
+
+#include <stdint.h>
+#include <pthread.h>
+#include "io.h"
+#include "conn.h"
+#include "queue.h"
+#include "slab.h"
+
+typedef struct {
+	int id;
+	pthread_t thread;
+	volatile int running;
+	io_t *io;
+	int sock_listen;
+	queue_t events;
+	slab_t pool; // of the conns
+	conn_t *conns[IO_MAX_FDS];
+	int open[IO_MAX_FDS]; // dense list of open fds for the fan-out
+	int open_pos[IO_MAX_FDS];
+	int open_n;
+	uint64_t commands;
+	uint64_t snapshots; // of the state stream
+} worker_t;
+
+worker_t *worker_create(int, int, int, int);
+int worker_adopt(worker_t *, int, const char *, int);
+int worker_start(worker_t *);
+void worker_stop(worker_t *);
+int worker_export(worker_t *, int);
+void worker_free(worker_t *);
+
+#endif
@@ -4,6 +4,7 @@ Commads:
 l[uid][state] - set light
 m[uid][dir][speed] - set motor speed
 s[uid1][uid2][state] - state: 0 - straight, 1 - fork
+y[version] - subscribe to the state stream (see state_message)
 */
 
 var ctx = -1;
@@ -20,16 +21,91 @@ function $(id) {
 	return document.getElementById(id);
 }
 
+// State stream of the server: state[uid][field], version of the last complete batch
+var state = {};
+var state_version = 0;
+var state_changed = null; // function(uid, field, value)
+
+// Y: snapshot follows, u / U: uid (2) field (1) value (4) entries, U completes the version
+function state_message(msg) {
+	var type = msg.charAt(0);
+	if ( type == 'Y' ) {
+		state = {};
+		return true;
+	} else if ( type != 'u' && type != 'U' ) {
+		return false;
+	}
+	for ( var i = 9; i + 7 <= msg.length; i += 7 ) {
+		var uid = parseInt(msg.substr(i, 2), 16);
+		var field = parseInt(msg.substr(i + 2, 1), 16);
+		var value = parseInt(msg.substr(i + 3, 4), 16);
+		if ( !( uid in state ) ) {
+			state[uid] = [ 0, 0, 0, 255, 0 ];
+		}
+		state[uid][field] = value;
+		if ( state_changed ) {
+			state_changed(uid, field, value);
+		}
+	}
+	if ( type == 'U' ) {
+		state_version = parseInt(msg.substr(1, 8), 16);
+	}
+	return true;
+}
+
 function ws_connect(url) {
 	con = new WebSocket(url);
+	con.onopen = function() {
+		// a reconnect only gets what changed since
+		con.send('y' + ( '00000000' + state_version.toString(16) ).slice(-8));
+	}
 	con.onmessage = function(evt) {
-		$('log').innerText += evt.data + "\n";
+		if ( !state_message(evt.data) ) {
+			$('log').innerText += evt.data + "\n";
+		}
 	}
 	con.onerror = function() {
 		alert('Error in websocket connection');
 	}
 }
 
+// id from the query string (?id=...), as hex padded to digits
+function page_id(digits) {
+	var match = /[?&]id=([0-9]+)/.exec(location.search);
+	var id = match ? parseInt(match[1]) : -1;
+	if ( id < 0 || id > 255 ) {
+		document.body.innerHTML = 'Invalid id. <a href="index.html">back</a>';
+		return -1;
+	}
+	var id_str = ( '0000' + id.toString(16) ).slice(-digits);
+	$('id_str').innerText = id_str;
+	return id_str;
+}
+
+// Device list of the server: type << 16 | id, comma separated
+function load_devices() {
+	var dev_types = [ 'train', 'switch' ];
+	var req = new XMLHttpRequest();
+	req.onload = function() {
+		var devices = req.responseText.split(',');
+		for ( var i = 0; i < devices.length; i++ ) {
+			if ( devices[i] == '' ) {
+				continue;
+			}
+			var dev = parseInt(devices[i]);
+			var type = dev_types[( dev & 0xFF0000 ) >> 16];
+			var id = dev & 0xFFFF;
+			var row = $('main_table').insertRow(-1);
+			row.insertCell(-1).innerText = ( '0000' + id.toString(16) ).slice(-4);
+			row.insertCell(-1).innerText = type;
+			row.insertCell(-1).innerText = 'n/a';
+			row.insertCell(-1).innerHTML = '<a href="control_' + type + '.html?id=' + id + '">override</a>';
+		}
+	}
+	req.open('GET', '/devices');
+	req.send();
+}
+
 function ws_send(a) {
 	if ( con != -1 ) {
 		while ( con.readyState != 1 );
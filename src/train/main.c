@@ -1,6 +1,7 @@
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <util/delay.h>
+#include <avr/eeprom.h>
 #include "../twpc_def.h"
 
 /*
@@ -9,7 +10,8 @@ Model railway train code
 created by L Szabi 2015
 
 Code for trains
-- TWPC receive only
+- TWPC client, at the rate the master uses
+- Multicast groups, kept in the eeprom
 - Onewire client
 - LED
 - Motor
@@ -17,6 +19,7 @@ Code for trains
 */
 
 #define TWPC_UID 0xAA
+#define TWPC_TYPE TWPC_TYPE_TRAIN
 
 #define LED_P 1
 #define LED_PORT PORTA
@@ -188,15 +191,53 @@ int motor_get_dir(void) {
 	return motor_dir;
 }
 
+// Groups
+
+static uint8_t groups_ee EEMEM; // inverted: an erased eeprom (0xFF) is in no group
+static uint8_t groups = 0;
+
+void groups_init(void) {
+	groups = ~eeprom_read_byte(&groups_ee) & ( _BV(TWPC_GROUPS) - 1 );
+}
+
+int groups_member(uint8_t uid) {
+	return TWPC_IS_GROUP(uid) && ( groups & _BV(uid - TWPC_GROUP_FIRST) );
+}
+
+// TWPC_CMD_GROUP, returns the groups after it
+uint8_t groups_command(uint8_t arg) {
+	uint8_t group = arg & 0x0F;
+	if ( group < TWPC_GROUPS && ( arg & 0xF0 ) == TWPC_GROUP_JOIN ) {
+		groups |= _BV(group);
+	} else if ( group < TWPC_GROUPS && ( arg & 0xF0 ) == TWPC_GROUP_LEAVE ) {
+		groups &= ~_BV(group);
+	}
+	eeprom_update_byte(&groups_ee, ~groups); // written only if it changed
+	return groups;
+}
+
 // Communication
 
+#define COM_DIV TWPC_TICK_DIV // timer interrupts per onewire tick, 0.496ms
 
-static volatile int twpc_even = 1;
+#define TWPC_IDLE 0
+#define TWPC_START 1 // first start bit, its length tells the rate
+#define TWPC_RECV 2
+#define TWPC_SEND_WAIT 3 // for the '1' the master ends its stop bit with
+#define TWPC_SEND 4
 
-static volatile int twpc_bit = 0;
+static uint8_t com_div = 0;
+
+static volatile uint8_t twpc_state = TWPC_IDLE;
+static uint8_t twpc_wait; // timer interrupts until the next bit
+static uint8_t twpc_len; // of the first start bit, in timer interrupts
+static uint8_t twpc_half = TWPC_HALF_TICKS(0); // timer interrupts of a half bit at the rate of the last frame
+static uint8_t twpc_bit;
+static uint32_t twpc_shift;
 static volatile int twpc_send = 0;
 
 static volatile int twpc_pin = 0;
+static volatile int twpc_slot = -1; // discovery answer: only this bit is sent
 
 static volatile int onewire_bit = 0;
 static volatile int onewire_even = 0;
@@ -233,6 +274,11 @@ static void twpc_line_off(void) { // '0'
 	}
 }
 
+static void twpc_line_float(void) {
+	TWPC_DDR_A &= ~_BV(TWPC_P_A);
+	TWPC_DDR_B &= ~_BV(TWPC_P_B);
+}
+
 static void twpc_line_on(void) { // '1'
 	if ( twpc_pin ) {
 		TWPC_DDR_B |= _BV(TWPC_P_B);
@@ -260,20 +306,24 @@ static void onewire_line_on(void) {
 }
 
 void com_init(void) {
-	OCR0A = 30; // 0.5ms
 	TCCR0A = _BV(WGM01); // CTC mode
+#ifdef TWPC_FAST
+	OCR0A = 123; // TWPC_TICK_US
+	TCCR0B = _BV(CS01); // F_CPU/8
+#else
+	OCR0A = 30; // 0.5ms
 	TCCR0B = _BV(CS02); // F_CPU/256
+#endif
 	TIMSK0 = _BV(OCIE0A);
 }
 
 void com_send(void) {
-	if ( twpc_bit == 0 ) {
+	if ( twpc_state == TWPC_IDLE ) {
 		twpc_send = 1;
 	}
 }
 
-ISR(TIM0_COMPA_vect) {
-	// code for onewire
+static void onewire_tick(void) {
 	if ( onewire_even ) {
 		if ( onewire_bit == 0 ) {
 			if ( onewire_read() ) {
@@ -302,66 +352,99 @@ ISR(TIM0_COMPA_vect) {
 			onewire_even = 1; // sync
 		}
 	}
-	// code for twpc
-	if ( twpc_even ) {
-		if ( twpc_send ) {
-			// code for sending
-			if ( twpc_bit == 0 ) {
+	onewire_even ^= 1;
+}
+
+// Every timer interrupt, the bits are read in their middle and sent at the rate of the last frame
+static void twpc_tick(void) {
+	switch ( twpc_state ) {
+		case TWPC_IDLE:
+			if ( twpc_send ) {
+				twpc_state = TWPC_SEND_WAIT;
+			} else if ( twpc_read() ) {
+				twpc_len = 1;
+				twpc_state = TWPC_START;
+			}
+			break;
+		case TWPC_START:
+			if ( twpc_read() ) {
+				if ( twpc_len < 255 ) {
+					twpc_len++;
+				}
+				break;
+			}
+			twpc_state = TWPC_IDLE; // too long for a start bit
+			for ( uint8_t rate = TWPC_RATES; rate-- > 0; ) {
+				if ( twpc_len <= 3 * TWPC_HALF_TICKS(rate) ) { // two half bits and some
+					twpc_half = TWPC_HALF_TICKS(rate);
+					twpc_wait = 3 * twpc_half - 1;
+					twpc_bit = 0;
+					twpc_state = TWPC_RECV;
+					break;
+				}
+			}
+			break;
+		case TWPC_RECV:
+			if ( --twpc_wait ) {
+				break;
+			}
+			twpc_wait = 2 * twpc_half;
+			if ( twpc_bit < TWPC_DATA_BITS ) {
+				twpc_shift >>= 1;
 				if ( twpc_read() ) {
-					twpc_bit = 1;
+					twpc_shift |= 1UL << ( TWPC_DATA_BITS - 1 );
 				}
-			} else if ( twpc_bit == 1 ) { // sending 2nd start bit
+				twpc_bit++;
+			} else { // in the stop bit
+				com_data.data_raw = twpc_shift;
+				com_received = 1;
+				twpc_state = TWPC_IDLE;
+			}
+			break;
+		case TWPC_SEND_WAIT:
+			if ( twpc_read() ) {
+				twpc_wait = 2 * twpc_half;
+				twpc_bit = 0;
+				twpc_state = TWPC_SEND;
+			}
+			break;
+		case TWPC_SEND:
+			if ( --twpc_wait ) {
+				break;
+			}
+			twpc_wait = 2 * twpc_half;
+			if ( twpc_bit == 0 ) { // sending 2nd start bit
 				twpc_line_off();
-				twpc_bit = 2;
-			} else if ( twpc_bit >= 2 && twpc_bit < 2 + TWPC_DATA_BITS ) { // sending data
-				if ( com_data.data_raw & ( 1UL << ( twpc_bit - 2 ) ) ) {
+			} else if ( twpc_bit <= TWPC_DATA_BITS ) { // sending data
+				if ( twpc_slot >= 0 ) { // other devices answer in the same frame
+					if ( twpc_bit - 1 == twpc_slot ) {
+						twpc_line_off();
+					} else {
+						twpc_line_float();
+					}
+				} else if ( com_data.data_raw & ( 1UL << ( twpc_bit - 1 ) ) ) {
 					twpc_line_on();
 				} else {
 					twpc_line_off();
 				}
-				twpc_bit++;
-			} else if ( twpc_bit == 2 + TWPC_DATA_BITS ) {
+			} else if ( twpc_bit == TWPC_DATA_BITS + 1 ) {
 				twpc_read();
-				twpc_bit++;
 			} else {
 				twpc_send = 0;
-				twpc_bit = 0;
-			}
-		} else {
-			// code for receiving
-			if ( twpc_bit == 0 ) { // first start bit
-				if ( twpc_read() ) {
-					twpc_bit = 1;
-				}
-			} else if ( twpc_bit == 1 ) { // second start bit
-				if ( !twpc_read() ) {
-					twpc_bit = 2;
-					com_data.data_raw = 0;
-				}
-			} else if ( twpc_bit >= 2 && twpc_bit < 2 + TWPC_DATA_BITS ) { // read data
-				com_data.data_raw |= twpc_read() << ( twpc_bit - 2 );
-				twpc_bit++;
-			} else if ( twpc_bit == 2 + TWPC_DATA_BITS ) {
-				twpc_bit++;
-			} else {
-				twpc_bit = 0;
-				com_received = 1;
-			}
-		}
-	} else {
-		if ( !twpc_send ) {
-			// code for receiving ( synchronize )
-			if ( twpc_bit == 0 && twpc_read() ) {
-				twpc_bit = 1;
-			} else if ( twpc_bit == 1 && !twpc_read() ) {
-				twpc_bit = 2;
-				com_data.data_raw = 0;
-				twpc_even = 1; // turn parity
+				twpc_slot = -1;
+				twpc_state = TWPC_IDLE;
 			}
-		}
+			twpc_bit++;
+			break;
 	}
-	twpc_even ^= 1;
-	onewire_even ^= 1;
+}
+
+ISR(TIM0_COMPA_vect) {
+	if ( ++com_div == COM_DIV ) {
+		com_div = 0;
+		onewire_tick();
+	}
+	twpc_tick();
 }
 
 // Main
@@ -392,6 +475,7 @@ int main(void) {
 	cli();
 	_delay_ms(200);
 	led_init();
+	groups_init();
 	com_init();
 	motor_init();
 	sei();
@@ -399,8 +483,9 @@ int main(void) {
 	while ( 1 ) {
 		if ( com_received ) {
 			com_received = 0;
-			if ( com_data.checksum == TWPC_CHECKSUM(com_data) ) {
-				if ( com_data.uid == TWPC_UID || com_data.uid == 255 ) {
+			if ( TWPC_CHECKSUM_OK(com_data) ) {
+				uint8_t quiet = com_data.checksum & TWPC_NO_REPLY;
+				if ( com_data.uid == TWPC_UID || com_data.uid == 255 || groups_member(com_data.uid) ) {
 					if ( com_data.cmd == TWPC_CMD_LIGHT_ON ) {
 						led_on();
 					} else if ( com_data.cmd == TWPC_CMD_LIGHT_OFF ) {
@@ -421,9 +506,17 @@ int main(void) {
 						}
 					} else if ( com_data.cmd == TWPC_CMD_NAME && com_data.arg >= 0 && com_data.arg < 3 ) {
 						com_data.arg = name[com_data.arg];
+					} else if ( com_data.cmd == TWPC_CMD_GROUP ) {
+						com_data.arg = groups_command(com_data.arg);
 					}
 					com_data.checksum = TWPC_CHECKSUM(com_data);
-					if ( com_data.uid == TWPC_UID ) {
+					if ( com_data.uid == 255 && com_data.cmd == TWPC_CMD_DISCOVER ) {
+						uint8_t type = com_data.arg >> 4;
+						if ( ( com_data.arg & 0x0F ) == TWPC_UID / TWPC_DISCOVER_SLOTS && ( type == 0 || type == TWPC_TYPE + 1 ) ) {
+							twpc_slot = TWPC_UID % TWPC_DISCOVER_SLOTS;
+							com_send();
+						}
+					} else if ( com_data.uid == TWPC_UID && !quiet ) {
 						/*
 						com_data.cmd = TWPC_CMD_ACK;
 						com_data.arg = 0;
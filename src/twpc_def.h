@@ -6,7 +6,26 @@
 #define TWPC_DATA_BITS ( sizeof(twpc_packet_t) * 8 )
 #define TWPC_BUFFER_SIZE 32
 
+// Bit rates: a half bit is TWPC_HALF_TICKS(rate) timer ticks of TWPC_TICK_US, rate 0 is the 1 kbit/s
+// every device understands, used for broadcasts and discovery. A device tells the rate of a frame
+// from the length of its first start bit and answers at the same rate.
+// The fast tick is only built with TWPC_FAST, until make cycles in src/master has measured that the
+// timer interrupt leaves room for the uart at its highest rate. Without it the timers tick every
+// half bit of rate 0 and rate 0 is the only one.
+#ifdef TWPC_FAST
+#define TWPC_TICK_US 62
+#define TWPC_RATES 3 // 1, 2, 4 kbit/s
+#define TWPC_HALF_TICKS(rate) ( 8 >> (rate) )
+#else
+#define TWPC_TICK_US 496
+#define TWPC_RATES 1
+#define TWPC_HALF_TICKS(rate) 1
+#endif
+#define TWPC_TICK_DIV ( 496 / TWPC_TICK_US ) // timer interrupts per 0.496ms tick of the clocks and onewire
+
 #define TWPC_CHECKSUM(a) ( ( ( (a).uid & 0x03 ) << 4 ) | ( ( (a).cmd & 0x03 ) << 2 ) | ( (a).arg & 0x03 ) )
+#define TWPC_NO_REPLY 0x80 // or-ed to the checksum: the device does not answer, the master does not wait for it
+#define TWPC_CHECKSUM_OK(a) ( ( (a).checksum & ~TWPC_NO_REPLY ) == TWPC_CHECKSUM(a) )
 
 typedef union {
 	uint32_t data_raw;
@@ -26,5 +45,31 @@ typedef union {
 #define TWPC_CMD_NAME			0x06
 #define TWPC_CMD_SW_STRAIGHT	0x07
 #define TWPC_CMD_SW_FORK		0x08
+#define TWPC_CMD_DISCOVER		0x09
+#define TWPC_CMD_GROUP			0x0A
+
+#define TWPC_TYPE_TRAIN 0
+#define TWPC_TYPE_SWITCH 1
+
+// Discovery: broadcast (uid 255) TWPC_CMD_DISCOVER, arg = block or TWPC_DISCOVER_ARG(block, type) for one type only
+// every device of the block answers in the same frame by sending a '0' in the bit uid % TWPC_DISCOVER_SLOTS
+// and leaving the other bits alone, which read as '1'. The last bit is never driven: it tells an
+// answer (a block with no '0' bits is empty) from no answer at all (all zero).
+#define TWPC_DISCOVER_SLOTS 31
+#define TWPC_DISCOVER_MASK 0x7FFFFFFFUL
+#define TWPC_DISCOVER_ARG(block, type) ( (block) | ( (type) + 1 ) << 4 )
+
+// Groups: a packet to TWPC_GROUP_UID(group) reaches every device in the group, device uids are below
+// TWPC_GROUP_FIRST. Nobody answers a group packet, it always has TWPC_NO_REPLY. A device keeps its
+// groups over a power loss. TWPC_CMD_GROUP arg = TWPC_GROUP_ASK, or TWPC_GROUP_JOIN / TWPC_GROUP_LEAVE
+// or-ed with the group, the answer is the groups (bits) the device is in. Requests have bit 7 set and
+// answers never, a device which only echoes the packet is not taken for one in groups.
+#define TWPC_GROUPS 7
+#define TWPC_GROUP_FIRST 0xF8
+#define TWPC_GROUP_UID(group) ( TWPC_GROUP_FIRST + (group) )
+#define TWPC_IS_GROUP(uid) ( (uid) >= TWPC_GROUP_FIRST && (uid) < TWPC_GROUP_FIRST + TWPC_GROUPS )
+#define TWPC_GROUP_ASK 0x80
+#define TWPC_GROUP_JOIN 0x90
+#define TWPC_GROUP_LEAVE 0xA0
 
 #endif
\ No newline at end of file